@@ -28,7 +28,7 @@
 // maybe for VERY large data sizes.
 
 
-// build command on POSIX systems;  c++ -o sftcrypt sftcrypt.cpp
+// build command on POSIX systems;  c++ -pthread -o sftcrypt sftcrypt.cpp
 
 
 #include <stdio.h>
@@ -38,6 +38,11 @@
 #include <fcntl.h>
 #include <string.h>
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <tmmintrin.h>
+#define BASE64_SSSE3 /* compiled for SSSE3, used when the CPU has it */
+#endif // __GNUC__, x86
+
 #ifdef WIN32
 
 // Win32-isms to help with compatibility
@@ -46,13 +51,47 @@
 
 #define __CDECL__ __cdecl
 
+struct iovec  // as in POSIX <sys/uio.h>
+{
+  void *iov_base;
+  size_t iov_len;
+};
+
 #else // WIN32
 
 #include <unistd.h>
+#include <limits.h>
 #include <ctype.h>
 #include <memory.h>
 #include <errno.h>
 #include <termios.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <linux/futex.h>
+#include <sched.h>
+
+#ifndef MPOL_BIND
+#define MPOL_BIND 2 /* from linux/mempolicy.h */
+#endif // MPOL_BIND
+#endif // __linux__
 
 #define _O_BINARY 0
 #define _O_RDONLY O_RDONLY
@@ -95,32 +134,312 @@ LPBYTE BuildEncryptionDictionary(DWORD dw1, DWORD dw2, DWORD dwMask,
                                  BYTE bTableSize = 0);
 
 
+// dictionary memory.  2Mb aligned and (on Linux) backed by transparent huge
+// pages, so the whole dictionary needs a single TLB entry.  A dictionary
+// may be replicated on every NUMA node, after which 'GetLocalDictionary()'
+// returns the copy on the calling thread's node.  'FreeDictionary()' frees
+// the replicas as well.
+LPBYTE AllocDictionary(DWORD cbSize);
+void FreeDictionary(LPBYTE pDict);
+int ReplicateDictionary(LPBYTE pDict);
+const BYTE *GetLocalDictionary(const BYTE *pDict);
+const BYTE *GetNodeDictionary(const BYTE *pDict, int iNode);
+int ParseSysList(LPCSTR szFile, BOOL *pbList, int nMax);
+
+// the cipher used for the data ('-1' selects 'EncryptDataStream')
+typedef void (*LPENCRYPTDATASTREAM)(const BYTE *lpDict, LPBYTE lpData, UINT cbData,
+                                    BYTE *pbSeed, UINT cbKeysize,
+                                    BOOL bDecryptFlag, BYTE bTableSize);
+
+extern LPENCRYPTDATASTREAM lpfnEncryptDataStream;
+
+// scatter/gather version - all of the buffers as one stream, in place,
+// with 'lpfnCipher' (version 2 unless you say otherwise)
+void EncryptDataStreamV(const BYTE *lpDict, const struct iovec *pIov, int nIov,
+                        BYTE *pbSeed, UINT cbKeySize,
+                        BOOL bDecryptFlag = FALSE,
+                        BYTE bTableSize = 0,
+                        LPENCRYPTDATASTREAM lpfnCipher = EncryptDataStream2);
+
+int RunBenchmark(const DWORD *pdwKey, UINT cbMB, BOOL bPerf, BOOL bNuma);
+
+// hardware performance counters ('--perf', Linux only).  Counters that
+// can't be opened are reported as 'n/a', and if none of them can be opened
+// 'PerfCountersOpen()' returns NULL (after saying why) and the rest of the
+// 'PerfCounters' functions do nothing with it.
+
+typedef struct tagPERF_COUNTERS PERF_COUNTERS;
+
+PERF_COUNTERS *PerfCountersOpen(void);
+void PerfCountersStart(PERF_COUNTERS *pPerf);
+void PerfCountersStop(PERF_COUNTERS *pPerf);
+void PerfCountersReport(PERF_COUNTERS *pPerf, LPCSTR szWhat, double dBytes);
+void PerfCountersClose(PERF_COUNTERS *pPerf);
+
+// dictionary access profiling.  Build with -DPROFILE_DICT ('make profile')
+// to count the table and cache line hits in 'EncryptDataStream2()', and the
+// distribution of the final 'bSeed' values.  A report is written to stderr
+// when the program exits.  Without PROFILE_DICT these compile to nothing.
+
+#ifdef PROFILE_DICT
+
+void ProfileDictChain(DWORD dwIndex);
+void ProfileDictFinal(DWORD dwIndex);
+void ProfileDictSeed(BYTE bSeed);
+
+#define PROFILE_DICT_CHAIN(X) ProfileDictChain((DWORD)(X))
+#define PROFILE_DICT_FINAL(X) ProfileDictFinal((DWORD)(X))
+#define PROFILE_DICT_SEED(X) ProfileDictSeed(X)
+
+#else // PROFILE_DICT
+
+#define PROFILE_DICT_CHAIN(X)
+#define PROFILE_DICT_FINAL(X)
+#define PROFILE_DICT_SEED(X)
+
+#endif // PROFILE_DICT
+
+int GetEncryptionKey(LPCSTR szKey, BOOL bPhrase, BOOL bPhraseEcho,
+                     LPCSTR szPrompt, DWORD *pdwKey);
+LPBYTE BuildKeyDictionary(const DWORD *pdwKey, BYTE *pbSeed);
+
+int GetDefaultThreadCount(void);
+void DecryptDataParallel(const BYTE *lpDict, LPBYTE lpData, UINT cbData,
+                         BYTE *pbSeed, UINT cbKeySize, int nThreads,
+                         BYTE bTableSize = 0);
+
+typedef struct tagREKEY_INFO
+{
+  const BYTE *lpDictOld, *lpDictNew;
+  BYTE pbSeedOld[16], pbSeedNew[16];  // initial seeds for each key
+  int nThreads;
+  BOOL bStats;
+  double dTotal;  // total bytes, for statistics
+  UINT nFiles, nErrors;
+} REKEY_INFO;
+
+int RekeyStream(FILE *pIN, FILE *pOUT, REKEY_INFO *pInfo);
+int RekeyTree(LPCSTR szPath, REKEY_INFO *pInfo);
+
+LPBYTE AllocAlignedBuffer(UINT cbSize);
+void FreeAlignedBuffer(LPBYTE pBuf, UINT cbSize);
+long GetPageCacheKB(void);
+int DirectDataTransfer(const BYTE *lpDict, LPCSTR szIn, LPCSTR szOut,
+                       BYTE *pbSeed, UINT cbKeySize, BOOL bDecryptFlag,
+                       UINT cbBufSize, BOOL bStats);
+
+// I/O scheduling for the main loop - the read size is chosen from the type
+// of input (a file's size, a pipe, a tty) and then doubled as long as the
+// throughput keeps up, to 'cbCap'.  Or fixed, with '--bufsize'
+#define IO_BATCH_MIN 512
+#define IO_BATCH_MAX 0x4000000 /* 64Mb, for '--bufsize' */
+
+typedef struct tagIO_SCHEDULE
+{
+  UINT cbBatch;    // bytes per read (all of the buffers)
+  UINT cbStart;    // what it started with
+  UINT cbPrev;     // the size before the last change, to go back to
+  UINT cbCap;      // the most it can grow to
+  BOOL bFixed;     // '--bufsize', or done growing
+  LPCSTR szInput;  // type of input, for '--stats'
+  double dStart, dBytes, dLastRate;  // the current measurement
+  int nBatches;
+} IO_SCHEDULE;
+
+void IoScheduleInit(IO_SCHEDULE *pS, int iIn, UINT cbFixed);
+BOOL IoScheduleUpdate(IO_SCHEDULE *pS, UINT cbData);
+int IovecDataTransfer(const BYTE *lpDict, int iIn, int iOut,
+                      BYTE *pbSeed, UINT cbKeySize, BOOL bDecryptFlag,
+                      IO_SCHEDULE *pSched, PERF_COUNTERS *pPerf, double *pdTotal);
+void BenchmarkBufferSizes(const BYTE *lpDict, const BYTE *pbSeed0, UINT cbMB);
+int TeeDataTransfer(const BYTE *lpDict, int iIn, LPCSTR *pszOut, int nOut,
+                    BYTE *pbSeed, UINT cbKeySize, BOOL bDecryptFlag, BOOL bStats);
+
+// encrypted shared memory ring (Linux) - one producer, one consumer, in
+// different processes.  Data is encrypted by 'ShmRingWrite()' and decrypted
+// by 'ShmRingRead()', each with its own copy of the seed state, using the
+// cipher given to 'ShmRingOpen()' (version 2 unless you say otherwise).
+typedef struct tagSHM_RING SHM_RING;
+
+int ShmRingCreate(LPCSTR szPath, UINT cbRing);
+SHM_RING *ShmRingOpen(int iFile, BOOL bProducer, const BYTE *lpDict,
+                      const BYTE *pbSeed, UINT cbKeySize,
+                      LPENCRYPTDATASTREAM lpfnCipher = EncryptDataStream2);
+int ShmRingWrite(SHM_RING *pR, const BYTE *pData, UINT cbData);
+int ShmRingRead(SHM_RING *pR, LPBYTE pData, UINT cbMax);
+void ShmRingClose(SHM_RING *pR);
+int ShmSendStream(const BYTE *lpDict, FILE *pIN, LPCSTR szName,
+                  const BYTE *pbSeed, UINT cbKeySize, BOOL bStats);
+int ShmRecvStream(const BYTE *lpDict, FILE *pOUT, LPCSTR szName,
+                  const BYTE *pbSeed, UINT cbKeySize, BOOL bStats);
+int ShmBenchmark(const BYTE *lpDict, const BYTE *pbSeed0, UINT cbKeySize, UINT cbMsg);
+int RelayConnections(const BYTE *lpDict, LPCSTR szRelay,
+                     const BYTE *pbSeed, UINT cbKeySize, BOOL bDecryptFlag,
+                     int nThreads, BOOL bStats);
+int RelayLoadTest(LPCSTR szSpec, int nClients, BOOL bStats);
+int GitFilterProcess(const BYTE *lpDict, const BYTE *pbSeed0, UINT cbKeySize,
+                     int nThreads, BOOL bStats);
+int BackupToStore(const BYTE *lpDict, FILE *pIN, FILE *pOUT, LPCSTR szStore,
+                  const BYTE *pbSeed0, int nThreads, BOOL bStats);
+int RestoreFromStore(const BYTE *lpDict, FILE *pIN, FILE *pOUT, LPCSTR szStore,
+                     const BYTE *pbSeed0, int nThreads, BOOL bStats);
+int VerifyStream(const BYTE *lpDict, FILE *pIN, FILE *pPlain,
+                 BYTE *pbSeed, UINT cbKeySize, int nThreads, BOOL bStats);
+int ArmorEncodeStream(const BYTE *lpDict, FILE *pIN, FILE *pOUT,
+                      BYTE *pbSeed, UINT cbKeySize, BOOL bStats);
+int ArmorDecodeStream(const BYTE *lpDict, FILE *pIN, FILE *pOUT,
+                      BYTE *pbSeed, UINT cbKeySize, BOOL bStats);
+void BenchmarkArmor(const BYTE *pData, UINT cbData);
+void BenchmarkIovec(const BYTE *lpDict, const BYTE *pbSeed0);
+
+double GetElapsedSeconds(void);
+void ReportLatencyStats(LPCSTR szWhat, double *pdSamples, UINT nSamples);
+int StreamDataLowLatency(const BYTE *lpDict, int iIn, int iOut,
+                         BYTE *pbSeed, UINT cbKeySize, BOOL bDecryptFlag,
+                         int iMaxLatency, UINT cbMinBatch, BOOL bFlushNL,
+                         BOOL bStats);
+
 
 void do_help()
 {
   fprintf(stderr, "SFTCRYPT - Encryption/Decryption technology "
                   "(c) 1998 by SFT Inc.\n\n"
-                  "COMMAND LINE:  SFTCRYPT [-h] [-d] [[-p] key|-P[-]] [input file [output file]]\n"
+                  "COMMAND LINE:  SFTCRYPT [-h] [-d] [-1] [-a] [[-p] key|-P[-]] [input file [output file ...]]\n"
                   "    where      'key' is a 128-bit key defined by a binary hex literal\n"
                   "               or a quoted 'key phrase' [if '-p' specified]\n"
                   "     and       -P prompts for a pass phrase (via console)\n"
                   "               specifying '-P-' will echo the passphrase; use with discretion\n"
                   "     and       'input file' is an optional input file (default is STDIN)\n"
                   "     and       'output file' is the default output file (default is STDOUT)\n"
+                  "               ('-' is STDOUT).  With more than one, the output is written\n"
+                  "               to all of them.  '--stats' shows each one's throughput\n"
                   "     and       '-d' indicates \"decrypt\"\n"
+                  "     and       '-1' selects the legacy 'version 1' format - faster, but\n"
+                  "               weaker.  Use it for bulk, non-sensitive data only\n"
+                  "     and       '-a' writes 'armored' (base64) text when encrypting, and\n"
+                  "               reads it when decrypting ('--armor' does the same)\n"
                   "     and       '-h' prints this message\n"
+                  "\n"
+                  "  additional options:\n"
+                  "    --stream            encrypt and write input as soon as it arrives\n"
+                  "                        (for pipes carrying live logs, etc.)\n"
+                  "    --max-latency=MS    [--stream] longest time to hold pending data (default 0)\n"
+                  "    --min-batch=BYTES   [--stream] write once this many bytes are pending (default 1)\n"
+                  "    --line              [--stream] always write on a newline in the plain text\n"
+                  "    --rekey[=newkey]    decrypt with 'key' and re-encrypt with 'newkey' in one pass\n"
+                  "                        (prompts for it with '-P').  If 'input file' is a\n"
+                  "                        directory, every file under it is re-keyed in place\n"
+                  "    --threads=N         number of threads to use (default is # of CPUs, POSIX only)\n"
+                  "    --numa              give each NUMA node its own copy of the dictionary,\n"
+                  "                        for the threads running on it\n"
+                  "    --direct[=SIZE]     use O_DIRECT file I/O (bypassing the page cache) with\n"
+                  "                        'SIZE' byte buffers, i.e. 4M or 512k (default 1M).\n"
+                  "                        Requires input and output file names.\n"
+                  "    --bufsize=SIZE      read 'SIZE' bytes at a time, i.e. 64k or 4M (default is\n"
+                  "                        chosen from the input, and grows with the throughput)\n"
+                  "    --relay=[BIND:]PORT:HOST:HPORT\n"
+                  "                        TCP relay - listen on PORT (localhost unless 'BIND' is\n"
+                  "                        specified) and connect each client to HOST:HPORT.  Data\n"
+                  "                        from the client is encrypted, data from HOST decrypted.\n"
+                  "                        '-d' reverses this (for the other end)\n"
+                  "    --relay-load=[ECHOPORT:]HOST:PORT\n"
+                  "                        load test a relay - connections/s and throughput\n"
+                  "    --git-filter        run as a git long-running filter process ('clean'\n"
+                  "                        encrypts, 'smudge' decrypts).  See README\n"
+                  "    --backup=STORE      split the input into chunks and add the new ones to\n"
+                  "                        the chunk store 'STORE'.  The (encrypted) manifest\n"
+                  "                        is written to the output\n"
+                  "    --restore=STORE     re-assemble a backup from its manifest (the input)\n"
+                  "    --verify=PLAINTEXT  decrypt the input in memory and compare it with the\n"
+                  "                        file 'PLAINTEXT'.  Exit code 0 if it matches, 1 if not\n"
+                  "    --shm-send=NAME     send the input to another sftcrypt, encrypted, via a\n"
+                  "                        shared memory ring (/dev/shm/NAME, Linux only)\n"
+                  "    --shm-recv=NAME     receive from '--shm-send=NAME' and write the output\n"
+                  "    --shm-bench[=SIZE]  measure latency of 'SIZE' byte messages (default 64)\n"
+                  "                        and throughput between two processes, ring vs pipe\n"
+                  "    --stats             report throughput (and latency) on stderr when done\n"
+                  "    --bench[=MB]        measure dictionary and cipher speed in memory (default 64)\n"
+                  "    --perf              report CPU performance counters for the dictionary and\n"
+                  "                        the cipher (cycles/byte, cache and branch misses)\n"
                   "\n\n");
 }
 
 
 
 BOOL bDebug = FALSE;
+LPENCRYPTDATASTREAM lpfnEncryptDataStream = EncryptDataStream2;
+
+
+// buffer size option, i.e. '65536', '64k' or '4M'.  returns 0 if it's
+// not valid, or not within 'cbMin' to 'cbMax'
+
+static UINT ParseBufferSize(LPCSTR szVal, UINT cbMin, UINT cbMax)
+{
+  char *pEnd;
+  unsigned long ul1 = strtoul(szVal, &pEnd, 0);
+
+  if(*pEnd == 'k' || *pEnd == 'K')
+    ul1 *= 1024, pEnd++;
+  else if(*pEnd == 'm' || *pEnd == 'M')
+    ul1 *= 0x100000, pEnd++;
+
+  if(*pEnd || ul1 < cbMin || ul1 > cbMax)
+    return(0);
+
+  return((UINT)ul1);
+}
+
+// whole number option.  returns -1 if it's not a number, or not within
+// 'nMin' to 'nMax' (which can't be negative)
+
+static int ParseNumber(LPCSTR szVal, int nMin, int nMax)
+{
+  char *pEnd;
+  long l1 = strtol(szVal, &pEnd, 10);
+
+  if(!*szVal || *pEnd || l1 < nMin || l1 > nMax)
+    return(-1);
+
+  return((int)l1);
+}
+
+// long option helper - returns the option's value ("" if it has none)
+// or NULL if 'szArg' isn't this option.  Accepts '--name' and '--name=value'
+
+static LPCSTR LongOption(LPCSTR szArg, LPCSTR szName)
+{
+  int i1 = strlen(szName);
+
+  if(szArg[0] != '-' || szArg[1] != '-' || strncmp(szArg + 2, szName, i1))
+    return(NULL);
+
+  if(!szArg[i1 + 2])
+    return("");
+  else if(szArg[i1 + 2] == '=')
+    return(szArg + i1 + 3);
+
+  return(NULL);
+}
+
 
 int main(int nArg, char *aszArgList[])
 {
 FILE *pIN = stdin, *pOUT = stdout;
 int i1, iArg=1, iKeyArg = -1;
 BOOL bDecrypt = FALSE, bPhrase = FALSE, bPhraseEcho = FALSE, bPrompt = FALSE;
+BOOL bStream = FALSE, bFlushNL = FALSE, bStats = FALSE, bPerf = FALSE;
+BOOL bNuma = FALSE, bGitFilter = FALSE, bArmor = FALSE;
+int iMaxLatency = 0;  // milliseconds, for '--stream'
+UINT cbMinBatch = 1;  // bytes, for '--stream'
+LPCSTR szVal, szRekey = NULL;
+int nThreads = 0;     // zero for 'default'
+UINT cbDirect = 0;    // non-zero for '--direct' buffer size
+UINT cbBufSize = 0;   // non-zero for a fixed '--bufsize'
+UINT cbBench = 0;     // non-zero for '--bench' size in Mb
+LPCSTR szRelay = NULL, szRelayLoad = NULL;
+LPCSTR szBackup = NULL, szRestore = NULL, szVerify = NULL;
+LPCSTR szShmSend = NULL, szShmRecv = NULL;
+UINT cbShmBench = 0;  // non-zero for '--shm-bench' message size
 BYTE pbSeed[16];  // 16 byte "seed"
 DWORD dwKey[4]={0,0,0,0};
 
@@ -158,6 +477,14 @@ DWORD dwKey[4]={0,0,0,0};
     {
       bDecrypt = TRUE;
     }
+    else if(aszArgList[iArg][1] == '1')
+    {
+      lpfnEncryptDataStream = EncryptDataStream;
+    }
+    else if(aszArgList[iArg][1] == 'a')
+    {
+      bArmor = TRUE;
+    }
     else if(toupper(aszArgList[iArg][1]) == 'P')
     {
       bPhrase = TRUE;
@@ -175,6 +502,139 @@ DWORD dwKey[4]={0,0,0,0};
       else
         iKeyArg = ++iArg;
     }
+    else if(aszArgList[iArg][1] == '-' && aszArgList[iArg][2]) // long options
+    {
+      if((szVal = LongOption(aszArgList[iArg], "stream")) && !*szVal)
+      {
+        bStream = TRUE;
+      }
+      else if((szVal = LongOption(aszArgList[iArg], "max-latency")) && *szVal)
+      {
+        iMaxLatency = ParseNumber(szVal, 0, 3600000);
+
+        if(iMaxLatency < 0)
+        {
+          fprintf(stderr, "INVALID latency '%s' (0 to 3600000 msec)\n", szVal);
+          return(2);
+        }
+      }
+      else if((szVal = LongOption(aszArgList[iArg], "min-batch")) && *szVal)
+      {
+        cbMinBatch = ParseBufferSize(szVal, 1, 0x40000000);
+
+        if(!cbMinBatch)
+        {
+          fprintf(stderr, "INVALID batch size '%s'\n", szVal);
+          return(2);
+        }
+      }
+      else if((szVal = LongOption(aszArgList[iArg], "line")) && !*szVal)
+      {
+        bFlushNL = TRUE;
+      }
+      else if((szVal = LongOption(aszArgList[iArg], "rekey")))
+      {
+        szRekey = szVal;
+      }
+      else if((szVal = LongOption(aszArgList[iArg], "direct")))
+      {
+        cbDirect = *szVal ? ParseBufferSize(szVal, 1, 0x40000000) : 0x100000;
+
+        if(!cbDirect)
+        {
+          fprintf(stderr, "INVALID buffer size '%s'\n", szVal);
+          return(2);
+        }
+      }
+      else if((szVal = LongOption(aszArgList[iArg], "bufsize")) && *szVal)
+      {
+        cbBufSize = ParseBufferSize(szVal, IO_BATCH_MIN, IO_BATCH_MAX);
+
+        if(!cbBufSize)
+        {
+          fprintf(stderr, "INVALID buffer size '%s' (%u to %uM)\n", szVal,
+                  IO_BATCH_MIN, IO_BATCH_MAX / 0x100000);
+          return(2);
+        }
+      }
+      else if((szVal = LongOption(aszArgList[iArg], "relay")) && *szVal)
+      {
+        szRelay = szVal;
+      }
+      else if((szVal = LongOption(aszArgList[iArg], "relay-load")) && *szVal)
+      {
+        szRelayLoad = szVal;
+      }
+      else if((szVal = LongOption(aszArgList[iArg], "git-filter")) && !*szVal)
+      {
+        bGitFilter = TRUE;
+      }
+      else if((szVal = LongOption(aszArgList[iArg], "backup")) && *szVal)
+      {
+        szBackup = szVal;
+      }
+      else if((szVal = LongOption(aszArgList[iArg], "restore")) && *szVal)
+      {
+        szRestore = szVal;
+      }
+      else if((szVal = LongOption(aszArgList[iArg], "verify")) && *szVal)
+      {
+        szVerify = szVal;
+      }
+      else if((szVal = LongOption(aszArgList[iArg], "shm-send")) && *szVal)
+      {
+        szShmSend = szVal;
+      }
+      else if((szVal = LongOption(aszArgList[iArg], "shm-recv")) && *szVal)
+      {
+        szShmRecv = szVal;
+      }
+      else if((szVal = LongOption(aszArgList[iArg], "shm-bench")))
+      {
+        cbShmBench = *szVal ? (UINT)atoi(szVal) : 64;
+
+        if(!cbShmBench)
+          cbShmBench = 1;
+      }
+      else if((szVal = LongOption(aszArgList[iArg], "threads")) && *szVal)
+      {
+        nThreads = ParseNumber(szVal, 1, 1024);
+
+        if(nThreads < 0)
+        {
+          fprintf(stderr, "INVALID thread count '%s' (1 to 1024)\n", szVal);
+          return(2);
+        }
+      }
+      else if((szVal = LongOption(aszArgList[iArg], "bench")))
+      {
+        cbBench = *szVal ? (UINT)atoi(szVal) : 64;
+
+        if(!cbBench)
+          cbBench = 1;
+      }
+      else if((szVal = LongOption(aszArgList[iArg], "armor")) && !*szVal)
+      {
+        bArmor = TRUE;
+      }
+      else if((szVal = LongOption(aszArgList[iArg], "numa")) && !*szVal)
+      {
+        bNuma = TRUE;
+      }
+      else if((szVal = LongOption(aszArgList[iArg], "perf")) && !*szVal)
+      {
+        bPerf = TRUE;
+      }
+      else if((szVal = LongOption(aszArgList[iArg], "stats")) && !*szVal)
+      {
+        bStats = TRUE;
+      }
+      else
+      {
+        fprintf(stderr, "INVALID SWITCH '%s' in command line\n", aszArgList[iArg]);
+        return(2);
+      }
+    }
     else if(aszArgList[iArg][1] != aszArgList[iArg][0])
     {
       fprintf(stderr, "INVALID SWITCH in command line\n");
@@ -184,6 +644,18 @@ DWORD dwKey[4]={0,0,0,0};
     iArg++;
   }
 
+  if(bArmor && (bStream || szRekey || szRelay || cbDirect || bGitFilter ||
+                szBackup || szRestore || szVerify || szShmSend || szShmRecv))
+  {
+    fprintf(stderr, "'-a' only works for normal encryption and decryption\n");
+    return(2);
+  }
+
+  if(szRelayLoad)  // doesn't need a key
+  {
+    return(RelayLoadTest(szRelayLoad, nThreads, bStats));
+  }
+
   if(iKeyArg <= 0 && !bPrompt)
   {
     iKeyArg = iArg++;
@@ -198,257 +670,379 @@ DWORD dwKey[4]={0,0,0,0};
     return 2;
   }
 
-  if(bPhrase)
-  {
-    // generate a key from this by encrypting the data with the
-    // following key:  533EA24D0B164864.  Note that this is a lot
-    // like hashing but less effective unless the phrase is long.
+  // the counters only cover the dictionary and the normal encrypt/decrypt
+  // loop (and '--bench')
 
-    dwKey[0] = 0x533ea24d; // so what if it's well known, I'm just using it
-    dwKey[1] = 0x0b164864; // to hash the pass phrase as a legit key
-    dwKey[2] = 0xd6073e8a; // however unlike other hashes, it DOES open the
-    dwKey[3] = 0x463d72b5; // passphrase up to brute-force cracking if it's short
+  if(bPerf && (bStream || bArmor || szRekey || szRelay || cbDirect || bGitFilter ||
+               szBackup || szRestore || szVerify || szShmSend || szShmRecv ||
+               cbShmBench || nArg > iArg + 2))
+  {
+    fprintf(stderr, "'--perf' only works for normal encryption and decryption (one output file) and '--bench'\n");
+    return(2);
+  }
 
-    char *p1;
+  i1 = GetEncryptionKey(bPrompt ? NULL : aszArgList[iKeyArg],
+                        bPhrase, bPhraseEcho, "Enter pass-phrase:", dwKey);
+  if(i1)
+  {
+    return(i1);
+  }
 
-    if(bPrompt)
-    {
-      FILE *pTTY = NULL;
-#ifdef WIN32
-      // Win32 version - do something!
+  if(cbBench)
+  {
+    return(RunBenchmark(dwKey, cbBench, bPerf, bNuma));
+  }
 
-#else // WIN32
-      struct termios sIOS0;
+  PERF_COUNTERS *pPerf = bPerf ? PerfCountersOpen() : NULL;
 
-      // NOTE:  if win32 code is significantly different, use 'readpasswphrase()' instead
-      pTTY = fopen("/dev/tty", "r"); // read from  console directly
+  PerfCountersStart(pPerf);
 
-      if(pTTY && !bPhraseEcho)
-      {
-        struct termios sIOS;
-        int iFile = fileno(pTTY);
+  LPBYTE pDict = BuildKeyDictionary(dwKey, pbSeed);
 
-        if(tcgetattr(iFile, &sIOS))
-        {
-          fprintf(stderr, "error %d getting attributes\n", errno);
+  PerfCountersStop(pPerf);
+  PerfCountersReport(pPerf, "dictionary", 0);
 
-          fclose(pTTY);
-          pTTY = NULL;
-        }
-        else
-        {
-          memcpy(&sIOS0, &sIOS, sizeof(sIOS0)); // cache it so I can restore it
+  if(!pDict)
+  {
+    fprintf(stderr, "  Internal error - unable to create dictionary\n");
+    PerfCountersClose(pPerf);
+    return(-1);
+  }
 
-          // make sure echoing is disabled and control chars aren't translated or omitted
-#if defined(__FreeBSD__)
-          sIOS.c_lflag &= ~(ECHO | ECHOKE | ECHOE | ECHONL | ECHOPRT | ECHOCTL | ICANON | IEXTEN | ISIG | ALTWERASE);
-#else // Linux? YMMV
-          sIOS.c_lflag &= ~(ECHO | ECHOKE | ECHOE | ECHONL
-#ifdef ECHOPRT
-                        | ECHOPRT
-#else
-#warning no 'ECHOPRT'
-#endif // ECHOPRT
-                        | ECHOCTL | ICANON | IEXTEN | ISIG);
-#endif // FBSD vs Linux
+  if(nThreads <= 0)
+  {
+    nThreads = GetDefaultThreadCount();
+  }
 
-          if(tcsetattr(iFile, TCSANOW, &sIOS))
-          {
-            fprintf(stderr, "error %d setting attributes\n", errno);
-          }
-        }
-      }
+  if(bNuma)  // a local copy for each node's threads (--rekey, --relay)
+  {
+    i1 = ReplicateDictionary(pDict);
 
-#endif // WIN32
+    if(bStats || bDebug)
+      fprintf(stderr, "dictionary copied to %d NUMA node(s)\n", i1);
+  }
 
-      if(!pTTY)
-      {
-        fprintf(stderr, "unable to read console for pass phrase\n");
-        do_help();
-        return 4;
-      }
+  if(cbShmBench) // producer and consumer processes, ring vs pipe
+  {
+    i1 = ShmBenchmark(pDict, pbSeed, sizeof(pbSeed), cbShmBench);
 
-      p1 = new char[65536];
-      if(!p1)
-      {
-        fclose(pTTY);
-        goto null_p1;
-      }
+    FreeDictionary(pDict);
 
-      memset(p1, 0, 65536);
-      fputs("Enter pass-phrase:", stderr);
-      fflush(stderr); // make sure
-      fgets(p1 +  sizeof(pbSeed), 65534 - sizeof(pbSeed), pTTY);
-      fflush(stderr);
+    return(i1);
+  }
 
-#ifdef WIN32
-      // Win32 version - do something!
+  if(bGitFilter) // one process for all of the blobs in a git command
+  {
+    if(nArg > iArg || bDecrypt || bStream || szRekey || szRelay || cbDirect)
+    {
+      fprintf(stderr, "'--git-filter' does not use input or output files, '-d' or other modes\n");
+      FreeDictionary(pDict);
+      return(2);
+    }
 
-#else // WIN32
-      if(!bPhraseEcho)
-      {
-        if(tcsetattr(fileno(pTTY), TCSANOW, &sIOS0)) // restore terminal state
-        {
-          fprintf(stderr, "error %d setting attributes\n", errno);
-        }
-      }
-#endif // WIN32
-      fclose(pTTY);
-      fputs("\n", stderr);
+    i1 = GitFilterProcess(pDict, pbSeed, sizeof(pbSeed), nThreads, bStats);
 
-      char *p2;
-      p2 = p1 + sizeof(pbSeed) + strlen(p1 + sizeof(pbSeed));
+    FreeDictionary(pDict);
 
-      while(p2 > (p1 + sizeof(pbSeed)) && *(p2 - 1) <= ' ') // trailing white space not allowed
-        *(--p2) = 0;
+    return(i1);
+  }
 
-      i1 = p2 - (p1 + sizeof(pbSeed)); // the length of the string
+  if(szRekey) // re-key mode - decrypt with 'dwKey', encrypt with new key
+  {
+    REKEY_INFO sInfo;
+    DWORD dwNewKey[4];
 
-      if(!*(p1 + sizeof(pbSeed)))
-      {
-        fprintf(stderr, "Blank pass phrase not allowed\n");
-        do_help();
-        return 3;
-      }
+    if(bDecrypt || bStream)
+    {
+      fprintf(stderr, "'--rekey' cannot be combined with '-d' or '--stream'\n");
+      FreeDictionary(pDict);
+      return(2);
     }
-    else
+
+    if(!*szRekey && !bPrompt)
     {
-      p1 = new char[strlen(aszArgList[iKeyArg]) + 1 + sizeof(pbSeed)];
-      if(!p1)
-      {
-null_p1:
-        fprintf(stderr, "Not enough memory to complete the desired operation.\n");
-        return(-1);
-      }
+      fprintf(stderr, "Illegal pass phrase / key - blank not allowed.\n");
+      do_help();
+      FreeDictionary(pDict);
+      return(2);
+    }
 
-      char *p2 = p1 + sizeof(pbSeed);
-      i1 = strlen(aszArgList[iKeyArg]);
-      memcpy(p2, aszArgList[iKeyArg], i1);
+    i1 = GetEncryptionKey(*szRekey ? szRekey : NULL,
+                          bPhrase, bPhraseEcho, "Enter NEW pass-phrase:", dwNewKey);
+    if(i1)
+    {
+      FreeDictionary(pDict);
+      return(i1);
     }
 
+    memset(&sInfo, 0, sizeof(sInfo));
 
-    // NOTE:  code forced to "low endian" initial key
+    sInfo.lpDictOld = pDict;
+    sInfo.lpDictNew = BuildKeyDictionary(dwNewKey, sInfo.pbSeedNew);
+    memcpy(sInfo.pbSeedOld, pbSeed, sizeof(sInfo.pbSeedOld));
+    sInfo.nThreads = nThreads;
+    sInfo.bStats = bStats;
 
-    for(i1=0; i1 < 16; i1++)
+    if(!sInfo.lpDictNew)
     {
-      DWORD dw1 = dwKey[i1 >> 2];
-
-      if(i1 & 3)
-        pbSeed[i1] = (BYTE)((dw1 >> (4 * (i1 & 3))) & 0xff);
-      else
-        pbSeed[i1] = (BYTE)(dw1 & 0xff);
+      fprintf(stderr, "  Internal error - unable to create dictionary\n");
+      FreeDictionary(pDict);
+      return(-1);
     }
 
-    memcpy(p1, pbSeed, sizeof(pbSeed));
-
-
-    // build a special crypto key thingy for this
+    fprintf(stderr, "\n");
 
-    WORD w1a = (WORD)(dwKey[3] & 0xffff);
-    WORD w2a = (WORD)((dwKey[3] >> 16) & 0xffff);
+    double dStart = GetElapsedSeconds();
+    struct stat sStat;
 
-    LPBYTE pDict0 = BuildEncryptionDictionary(dwKey[0], dwKey[1],
-                                              dwKey[2], w1a, w2a);
+    if(nArg > iArg && !stat(aszArgList[iArg], &sStat) && S_ISDIR(sStat.st_mode))
+    {
+      if(nArg > iArg + 1)
+      {
+        fprintf(stderr, "no output file allowed when re-keying a directory\n");
+        i1 = 2;
+      }
+      else
+      {
+        i1 = RekeyTree(aszArgList[iArg], &sInfo);
+      }
+    }
+    else
+    {
+      if(nArg > iArg)
+      {
+        pIN = fopen(aszArgList[iArg++],"rb");
 
-    if(!pDict0)
+        if(!pIN)
+        {
+          fprintf(stderr, "Unable to open input file '%s'\n",
+                  aszArgList[iArg - 1]);
+
+          pIN = stdin;
+          i1 = -1;
+        }
+      }
+      else
+      {
+        _setmode(_fileno(stdin), _O_BINARY);
+      }
+
+      if(!i1 && nArg > iArg)
+      {
+        unlink(aszArgList[iArg]);  // just in case
+
+        pOUT = fopen(aszArgList[iArg++],"wb");
+
+        if(!pOUT)
+        {
+          fprintf(stderr, "Unable to open output file '%s'\n",
+                  aszArgList[iArg - 1]);
+
+          pOUT = stdout;
+          i1 = -1;
+        }
+      }
+      else
+      {
+        _setmode(_fileno(stdout), _O_BINARY);
+      }
+
+      if(!i1)
+        i1 = RekeyStream(pIN, pOUT, &sInfo);
+
+      if(pIN != stdin)
+        fclose(pIN);
+
+      if(pOUT != stdout && fclose(pOUT) && !i1)
+      {
+        fprintf(stderr, "Write error on output file\n");
+        i1 = 3;
+      }
+    }
+
+    if(bStats)
     {
-      fprintf(stderr, "  Internal error - unable to create dictionary\n");
-      return(-1);
+      dStart = GetElapsedSeconds() - dStart;
+
+      fprintf(stderr, "re-keyed %.0f bytes (%u files, %u errors) in %.3f sec, %.2f MB/s\n",
+              sInfo.dTotal, sInfo.nFiles, sInfo.nErrors, dStart,
+              dStart > 0 ? sInfo.dTotal / dStart / 1048576.0 : 0.0);
     }
 
-    char *p2 = p1 + sizeof(pbSeed);
+    FreeDictionary(pDict);
+    FreeDictionary((LPBYTE)sInfo.lpDictNew);
 
-    EncryptDataStream2(pDict0, (LPBYTE)p2, i1, pbSeed, sizeof(pbSeed), FALSE);
+    return(i1);
+  }
 
-    // next, grab the last 16 bytes of 'p1' and I'm done!
-    p2 += i1 - 16;  // do all 16 bytes for this one (32 'digits')
+  fprintf(stderr, "\n");
 
-    for(i1=0; i1 < 4; i1++)
+  if(szRelay)
+  {
+    if(nArg > iArg || bStream || cbDirect)
     {
-      dwKey[i1] = (BYTE)p2[i1 * 4 + 0] * 0x1000000L
-                + (BYTE)p2[i1 * 4 + 1] * 0x10000L
-                + (BYTE)p2[i1 * 4 + 2] * 0x100L
-                + (BYTE)p2[i1 * 4 + 3];
+      fprintf(stderr, "'--relay' does not use input or output files\n");
+      FreeDictionary(pDict);
+      return(2);
     }
 
-#ifdef DEBUG
-    fprintf(stderr, " [KEY=%08x%08x%08x%08x] ",
-            dwKey[0], dwKey[1], dwKey[2], dwKey[3]);
-#endif // DEBUG
+    i1 = RelayConnections(pDict, szRelay, pbSeed, sizeof(pbSeed), bDecrypt,
+                          nThreads, bStats);
 
-    delete [] p1;
-    delete [] pDict0;
+    FreeDictionary(pDict);
+
+    return(i1);
   }
-  else
+
+  if(cbDirect)
+  {
+    if(nArg < iArg + 2 || bStream)
+    {
+      fprintf(stderr, "'--direct' requires input and output file names (and no '--stream')\n");
+      FreeDictionary(pDict);
+      return(2);
+    }
+
+    i1 = DirectDataTransfer(pDict, aszArgList[iArg], aszArgList[iArg + 1],
+                            pbSeed, sizeof(pbSeed), bDecrypt, cbDirect, bStats);
+
+    FreeDictionary(pDict);
+
+    return(i1);
+  }
+
+  if(szVerify)
   {
-    dwKey[0] = 0;
-    dwKey[1] = 0;
-    dwKey[2] = 0;
-    dwKey[3] = 0;
+    FILE *pPlain;
 
-    for(i1=0; i1 < strlen(aszArgList[iKeyArg]); i1++)
+    if(nArg > iArg + 1 || bDecrypt || bStream || szBackup || szRestore)
     {
-      unsigned char c = toupper(aszArgList[iKeyArg][i1]);
+      fprintf(stderr, "'--verify' has no output file, and cannot be combined with '-d' or other modes\n");
+      FreeDictionary(pDict);
+      return(2);
+    }
 
-      if(c >= '0' && c <= '9')
-      {
-        c -= '0';
-      }
-      else if(c >= 'A' && c <= 'F')
-      {
-        c -= 'A' - '\xa';
-      }
-      else
+    if(nArg > iArg)
+    {
+      pIN = fopen(aszArgList[iArg],"rb");
+
+      if(!pIN)
       {
-        fprintf(stderr, "Illegal character in key\n");
-        return(2);
+        fprintf(stderr, "Unable to open input file '%s'\n", aszArgList[iArg]);
+        FreeDictionary(pDict);
+        return(-1);
       }
+    }
+    else
+    {
+      _setmode(_fileno(stdin), _O_BINARY);
+    }
+
+    pPlain = fopen(szVerify, "rb");
+
+    if(!pPlain)
+    {
+      fprintf(stderr, "Unable to open plain text file '%s'\n", szVerify);
 
-      dwKey[i1 >> 3] *= 16;
-      dwKey[i1 >> 3] += c;
+      if(pIN != stdin)
+        fclose(pIN);
+
+      FreeDictionary(pDict);
+      return(-1);
     }
+
+    i1 = VerifyStream(pDict, pIN, pPlain, pbSeed, sizeof(pbSeed), nThreads, bStats);
+
+    fclose(pPlain);
+
+    if(pIN != stdin)
+      fclose(pIN);
+
+    FreeDictionary(pDict);
+
+    return(i1);
   }
 
-  if(bDebug)
+  if(szShmSend || szShmRecv) // to or from another process, via /dev/shm
   {
-    fprintf(stderr, "dwKey[] = {%lx,%lx,%lx,%lx}\n",
-            (unsigned long)dwKey[0],
-            (unsigned long)dwKey[1],
-            (unsigned long)dwKey[2],
-            (unsigned long)dwKey[3]);
-  }
+    if(nArg > iArg + 1 || (szShmSend && szShmRecv) || bDecrypt || bStream ||
+       szBackup || szRestore)
+    {
+      fprintf(stderr, "'--shm-send' takes only an input file, '--shm-recv' only an output file,\n"
+                      "and neither can be combined with '-d' or other modes\n");
+      FreeDictionary(pDict);
+      return(2);
+    }
 
+    LPCSTR szName = szShmSend ? szShmSend : szShmRecv;
 
-  // now, get the bytes for the key
-  // NOTE:  code forced to "low endian" initial key
+    if(strchr(szName, '/') || !strcmp(szName, ".") || !strcmp(szName, ".."))
+    {
+      fprintf(stderr, "INVALID shared memory ring name '%s' (a file name in /dev/shm)\n", szName);
+      FreeDictionary(pDict);
+      return(2);
+    }
 
-  for(i1=0; i1 < 16; i1++)
-  {
-    DWORD dw1 = dwKey[i1 >> 2];
+    if(szShmSend)
+    {
+      if(nArg > iArg)
+        pIN = fopen(aszArgList[iArg],"rb");
+      else
+        _setmode(_fileno(stdin), _O_BINARY);
 
-    if(i1 & 3)
-      pbSeed[i1] = (BYTE)((dw1 >> (4 * (i1 & 3))) & 0xff);
+      if(!pIN)
+      {
+        fprintf(stderr, "Unable to open input file '%s'\n", aszArgList[iArg]);
+        FreeDictionary(pDict);
+        return(-1);
+      }
+
+      i1 = ShmSendStream(pDict, pIN, szShmSend, pbSeed, sizeof(pbSeed), bStats);
+    }
     else
-      pbSeed[i1] = (BYTE)(dw1 & 0xff);
-  }
+    {
+      if(nArg > iArg && strcmp(aszArgList[iArg], "-"))  // '-' is stdout
+      {
+        unlink(aszArgList[iArg]);  // just in case
+        pOUT = fopen(aszArgList[iArg],"wb");
+      }
+      else
+      {
+        _setmode(_fileno(stdout), _O_BINARY);
+      }
 
-  // next, I need to build the crypto key
+      if(!pOUT)
+      {
+        fprintf(stderr, "Unable to open output file '%s'\n", aszArgList[iArg]);
+        FreeDictionary(pDict);
+        return(-1);
+      }
+
+      i1 = ShmRecvStream(pDict, pOUT, szShmRecv, pbSeed, sizeof(pbSeed), bStats);
+    }
 
-  WORD w1 = (WORD)(dwKey[3] & 0xffff);
-  WORD w2 = (WORD)((dwKey[3] >> 16) & 0xffff);
+    if(pIN != stdin)
+      fclose(pIN);
 
-  LPBYTE pDict = BuildEncryptionDictionary(dwKey[0], dwKey[1],
-                                           dwKey[2], w1, w2);
+    if(pOUT != stdout)
+      fclose(pOUT);
+    else
+      fflush(pOUT);
 
-  if(!pDict)
-  {
-    fprintf(stderr, "  Internal error - unable to create dictionary\n");
-    return(-1);
-  }
+    FreeDictionary(pDict);
 
-  fprintf(stderr, "\n");
+    return(i1);
+  }
 
   BOOL bInFile = FALSE, bOutFile = FALSE;
+  long lCache0 = bStats ? GetPageCacheKB() : -1;
+
+  if(nArg > iArg + 2 && (bStream || bArmor || szBackup || szRestore))
+  {
+    fprintf(stderr, "only one output file is allowed with '--stream', '-a', '--backup' or '--restore'\n");
+    FreeDictionary(pDict);
+    return(2);
+  }
 
   if(nArg > iArg)
   {
@@ -459,6 +1053,8 @@ null_p1:
       fprintf(stderr, "Unable to open input file '%s'\n",
               aszArgList[iArg - 1]);
 
+      PerfCountersClose(pPerf);
+      FreeDictionary(pDict);
       return(-1);
     }
 
@@ -469,7 +1065,20 @@ null_p1:
     _setmode(_fileno(stdin), _O_BINARY);
   }
 
-  if(nArg > iArg)
+  if(nArg > iArg + 1) // more than one output - encrypt once, write to all of them
+  {
+    _setmode(_fileno(stdout), _O_BINARY);
+
+    i1 = TeeDataTransfer(pDict, _fileno(pIN), (LPCSTR *)aszArgList + iArg, nArg - iArg,
+                         pbSeed, sizeof(pbSeed), bDecrypt, bStats);
+
+    fclose(pIN);
+    FreeDictionary(pDict);
+
+    return(i1);
+  }
+
+  if(nArg > iArg && strcmp(aszArgList[iArg], "-"))  // '-' is stdout, as for several
   {
     unlink(aszArgList[iArg]);  // just in case
 
@@ -481,6 +1090,8 @@ null_p1:
               aszArgList[iArg - 1]);
 
       fclose(pIN);
+      PerfCountersClose(pPerf);
+      FreeDictionary(pDict);
       return(-1);
     }
 
@@ -491,92 +1102,465 @@ null_p1:
     _setmode(_fileno(stdout), _O_BINARY);
   }
 
-  BYTE cBuf[32768];
   int iRval = 0;
+  double dStart = GetElapsedSeconds(), dTotal = 0;
+  IO_SCHEDULE sSched;
 
-  while(!feof(pIN))
+  IoScheduleInit(&sSched, _fileno(pIN), cbBufSize);
+
+  if(szBackup || szRestore)
+  {
+    if(bDecrypt || bStream || (szBackup && szRestore) ||
+       lpfnEncryptDataStream != EncryptDataStream2)
+    {
+      fprintf(stderr, "'--backup' and '--restore' cannot be combined with each other,\n"
+                      "or with '-d', '-1' or '--stream'\n");
+      iRval = 2;
+    }
+    else if(szBackup)
+    {
+      iRval = BackupToStore(pDict, pIN, pOUT, szBackup, pbSeed, nThreads, bStats);
+    }
+    else
+    {
+      iRval = RestoreFromStore(pDict, pIN, pOUT, szRestore, pbSeed, nThreads, bStats);
+    }
+  }
+  else if(bArmor)
+  {
+    if(bDecrypt)
+      iRval = ArmorDecodeStream(pDict, pIN, pOUT, pbSeed, sizeof(pbSeed), bStats);
+    else
+      iRval = ArmorEncodeStream(pDict, pIN, pOUT, pbSeed, sizeof(pbSeed), bStats);
+  }
+  else if(bStream)
   {
-    DWORD cb1 = fread(cBuf, 1, sizeof(cBuf), pIN);
+    // low latency mode - bypass stdio buffering entirely
 
-    if(!cb1)
-      break;
+    iRval = StreamDataLowLatency(pDict, _fileno(pIN), _fileno(pOUT),
+                                 pbSeed, sizeof(pbSeed), bDecrypt,
+                                 iMaxLatency, cbMinBatch, bFlushNL, bStats);
+  }
+  else
+  {
+#ifndef WIN32
+    // 'readv()' and 'writev()' straight to and from the buffers
+
+    iRval = IovecDataTransfer(pDict, _fileno(pIN), _fileno(pOUT),
+                              pbSeed, sizeof(pbSeed), bDecrypt, &sSched, pPerf, &dTotal);
+#else // WIN32
+    UINT cbBuf = sSched.cbBatch;
+    LPBYTE cBuf = AllocAlignedBuffer(cbBuf);
+
+    while(cBuf && !feof(pIN))
+    {
+      DWORD cb1 = fread(cBuf, 1, sSched.cbBatch, pIN);
+
+      if(!cb1)
+        break;
+
+      // encrypt the buffer, 'cb1' items
+
+      PerfCountersStart(pPerf);
 
-    // encrypt the buffer, 'cb1' items
+      lpfnEncryptDataStream(pDict, cBuf, cb1, pbSeed, sizeof(pbSeed), bDecrypt, 0);
 
-    EncryptDataStream2(pDict, cBuf, cb1, pbSeed, sizeof(pbSeed), bDecrypt);
+      PerfCountersStop(pPerf);
 
-    // now, write it
+      // now, write it
 
-    if(fwrite(cBuf, 1, cb1, pOUT) != cb1)
+      if(fwrite(cBuf, 1, cb1, pOUT) != cb1)
+      {
+        fprintf(stderr, "Write error on output file\n");
+        iRval = 3;
+        break;
+      }
+
+      dTotal += cb1;
+
+      if(IoScheduleUpdate(&sSched, cb1))  // a new size
+      {
+        memset(cBuf, 0, cbBuf);
+        FreeAlignedBuffer(cBuf, cbBuf);
+
+        cbBuf = sSched.cbBatch;
+        cBuf = AllocAlignedBuffer(cbBuf);
+      }
+    }
+
+    if(!cBuf)
     {
-      fprintf(stderr, "Write error on output file\n");
-      iRval = 3;
-      break;
+      fprintf(stderr, "Not enough memory to complete the desired operation.\n");
+      iRval = -1;
+    }
+    else
+    {
+      memset(cBuf, 0, cbBuf);
+      FreeAlignedBuffer(cBuf, cbBuf);
+    }
+#endif // WIN32
+
+    if(bStats)
+    {
+      fflush(pOUT);
+      dStart = GetElapsedSeconds() - dStart;
+
+      fprintf(stderr, "%.0f bytes in %.3f sec, %.2f MB/s\n",
+              dTotal, dStart, dStart > 0 ? dTotal / dStart / 1048576.0 : 0.0);
+
+      if(cbBufSize)
+        fprintf(stderr, "%s input, %u byte reads\n", sSched.szInput, sSched.cbBatch);
+      else
+        fprintf(stderr, "%s input, %u byte reads (started with %u)\n",
+                sSched.szInput, sSched.cbBatch, sSched.cbStart);
+
+      if(lCache0 >= 0)
+        fprintf(stderr, "page cache grew by %ld kB\n", GetPageCacheKB() - lCache0);
     }
+
+    PerfCountersReport(pPerf, "cipher", dTotal);
   }
 
+  PerfCountersClose(pPerf);
+
   if(bInFile)
     fclose(pIN);
 
   if(bOutFile)
     fclose(pOUT);
 
-  delete [] pDict;
+  FreeDictionary(pDict);
 
   return(iRval);
 }
 
 
-static int __CDECL__ EncryptionDictionarySortCompare(const void *p1, const void *p2)
-{
-  DWORD *pdw1 = *((DWORD **)p1);
-  DWORD *pdw2 = *((DWORD **)p2);
+// obtain the 128-bit key in 'pdwKey' from a hex literal or a pass phrase.
+// When 'szKey' is NULL the pass phrase is read from the console, using
+// 'szPrompt' as the prompt.  Returns 0 on success, or the program's exit
+// code (after printing an error message) on failure
 
-  /*register*/ DWORD dw1 = *pdw1;
-  /*register*/ DWORD dw2 = *pdw2;
+int GetEncryptionKey(LPCSTR szKey, BOOL bPhrase, BOOL bPhraseEcho,
+                     LPCSTR szPrompt, DWORD *pdwKey)
+{
+int i1;
+BYTE pbSeed[16];
 
-  if(dw1 < dw2)
-    return(-1);
-  else if(dw1 > dw2)
-    return(1);
-  else
+  if(bPhrase)
   {
-    // values are equal - use their relative position to reverse
-    // the original order.  This will ensure consistency even if
-    // the 'random sequence' were to contain all identical values.
+    // generate a key from this by encrypting the data with the
+    // following key:  533EA24D0B164864.  Note that this is a lot
+    // like hashing but less effective unless the phrase is long.
 
-    // NOTE:  this part may behave differently with different compilers and OSs
-    //        most likely due to differing qsort implementations...
+    pdwKey[0] = 0x533ea24d; // so what if it's well known, I'm just using it
+    pdwKey[1] = 0x0b164864; // to hash the pass phrase as a legit key
+    pdwKey[2] = 0xd6073e8a; // however unlike other hashes, it DOES open the
+    pdwKey[3] = 0x463d72b5; // passphrase up to brute-force cracking if it's short
 
-    if(p1 < p2)
-      return(1);        // reverse
-    else if(p1 > p2)
-      return(-1);       // reverse
-    else
-      return(0);        // unlikely
+    char *p1;
 
-  }
-}
+    if(!szKey)
+    {
+      FILE *pTTY = NULL;
+#ifdef WIN32
+      // Win32 version - do something!
 
-// 128-bit key random encryption dictionary table generator
-// table size must be consistent for encrypt/decrypt to work
-// fastest table generation is a small 'bTableSize' (non-zero)
-// fastest encryption is a zero 'bTableSize' (max table size)
+#else // WIN32
+      struct termios sIOS0;
 
-LPBYTE BuildEncryptionDictionary(DWORD dw1, DWORD dw2, DWORD dwMask,
-                                 WORD w1, WORD w2,
-                                 BYTE bTableSize /* = 0 */)
-{
-  if(bDebug)
-  {
-    fprintf(stderr, "BuildEncryptionDictionary(%lx,%lx,%lx,%x,%x,%u)\n",
-            (unsigned long)dw1,
-            (unsigned long)dw2,
-            (unsigned long)dwMask,
-            w1, w2, bTableSize);
-  }
+      // NOTE:  if win32 code is significantly different, use 'readpasswphrase()' instead
+      pTTY = fopen("/dev/tty", "r"); // read from  console directly
 
-  // build an encrypt and a decrypt dictionary.  Encrypt dictionary
+      if(pTTY && !bPhraseEcho)
+      {
+        struct termios sIOS;
+        int iFile = fileno(pTTY);
+
+        if(tcgetattr(iFile, &sIOS))
+        {
+          fprintf(stderr, "error %d getting attributes\n", errno);
+
+          fclose(pTTY);
+          pTTY = NULL;
+        }
+        else
+        {
+          memcpy(&sIOS0, &sIOS, sizeof(sIOS0)); // cache it so I can restore it
+
+          // make sure echoing is disabled and control chars aren't translated or omitted
+#if defined(__FreeBSD__)
+          sIOS.c_lflag &= ~(ECHO | ECHOKE | ECHOE | ECHONL | ECHOPRT | ECHOCTL | ICANON | IEXTEN | ISIG | ALTWERASE);
+#else // Linux? YMMV
+          sIOS.c_lflag &= ~(ECHO | ECHOKE | ECHOE | ECHONL
+#ifdef ECHOPRT
+                        | ECHOPRT
+#else
+#warning no 'ECHOPRT'
+#endif // ECHOPRT
+                        | ECHOCTL | ICANON | IEXTEN | ISIG);
+#endif // FBSD vs Linux
+
+          if(tcsetattr(iFile, TCSANOW, &sIOS))
+          {
+            fprintf(stderr, "error %d setting attributes\n", errno);
+          }
+        }
+      }
+
+#endif // WIN32
+
+      if(!pTTY)
+      {
+        fprintf(stderr, "unable to read console for pass phrase\n");
+        do_help();
+        return 4;
+      }
+
+      p1 = new char[65536];
+      if(!p1)
+      {
+        fclose(pTTY);
+        goto null_p1;
+      }
+
+      memset(p1, 0, 65536);
+      fputs(szPrompt, stderr);
+      fflush(stderr); // make sure
+      fgets(p1 +  sizeof(pbSeed), 65534 - sizeof(pbSeed), pTTY);
+      fflush(stderr);
+
+#ifdef WIN32
+      // Win32 version - do something!
+
+#else // WIN32
+      if(!bPhraseEcho)
+      {
+        if(tcsetattr(fileno(pTTY), TCSANOW, &sIOS0)) // restore terminal state
+        {
+          fprintf(stderr, "error %d setting attributes\n", errno);
+        }
+      }
+#endif // WIN32
+      fclose(pTTY);
+      fputs("\n", stderr);
+
+      char *p2;
+      p2 = p1 + sizeof(pbSeed) + strlen(p1 + sizeof(pbSeed));
+
+      while(p2 > (p1 + sizeof(pbSeed)) && *(p2 - 1) <= ' ') // trailing white space not allowed
+        *(--p2) = 0;
+
+      if(!*(p1 + sizeof(pbSeed)))
+      {
+        fprintf(stderr, "Blank pass phrase not allowed\n");
+        do_help();
+        delete [] p1;
+        return 3;
+      }
+    }
+    else
+    {
+      // NOTE:  always at least 16 bytes of phrase, zero padded, exactly
+      //        like the console buffer (see below)
+
+      i1 = strlen(szKey);
+      p1 = new char[i1 + 1 + 2 * sizeof(pbSeed)];
+      if(!p1)
+      {
+null_p1:
+        fprintf(stderr, "Not enough memory to complete the desired operation.\n");
+        return(-1);
+      }
+
+      memset(p1, 0, i1 + 1 + 2 * sizeof(pbSeed));
+      memcpy(p1 + sizeof(pbSeed), szKey, i1);
+    }
+
+
+    // NOTE:  code forced to "low endian" initial key
+
+    for(i1=0; i1 < 16; i1++)
+    {
+      DWORD dw1 = pdwKey[i1 >> 2];
+
+      if(i1 & 3)
+        pbSeed[i1] = (BYTE)((dw1 >> (4 * (i1 & 3))) & 0xff);
+      else
+        pbSeed[i1] = (BYTE)(dw1 & 0xff);
+    }
+
+    memcpy(p1, pbSeed, sizeof(pbSeed));
+
+
+    // build a special crypto key thingy for this
+
+    WORD w1a = (WORD)(pdwKey[3] & 0xffff);
+    WORD w2a = (WORD)((pdwKey[3] >> 16) & 0xffff);
+
+    LPBYTE pDict0 = BuildEncryptionDictionary(pdwKey[0], pdwKey[1],
+                                              pdwKey[2], w1a, w2a);
+
+    if(!pDict0)
+    {
+      fprintf(stderr, "  Internal error - unable to create dictionary\n");
+      delete [] p1;
+      return(-1);
+    }
+
+    char *p2 = p1 + sizeof(pbSeed);
+
+    // NOTE:  historically only the first 16 bytes of the phrase are
+    //        encrypted here (the loop above re-used the length variable)
+    //        and existing files depend on it, so it stays that way.
+    //        The result is then all 16 bytes (32 'digits') of the key
+
+    EncryptDataStream2(pDict0, (LPBYTE)p2, 16, pbSeed, sizeof(pbSeed), FALSE);
+
+    for(i1=0; i1 < 4; i1++)
+    {
+      pdwKey[i1] = (BYTE)p2[i1 * 4 + 0] * 0x1000000L
+                 + (BYTE)p2[i1 * 4 + 1] * 0x10000L
+                 + (BYTE)p2[i1 * 4 + 2] * 0x100L
+                 + (BYTE)p2[i1 * 4 + 3];
+    }
+
+#ifdef DEBUG
+    fprintf(stderr, " [KEY=%08x%08x%08x%08x] ",
+            pdwKey[0], pdwKey[1], pdwKey[2], pdwKey[3]);
+#endif // DEBUG
+
+    delete [] p1;
+    FreeDictionary(pDict0);
+  }
+  else
+  {
+    pdwKey[0] = 0;
+    pdwKey[1] = 0;
+    pdwKey[2] = 0;
+    pdwKey[3] = 0;
+
+    if(!szKey || strlen(szKey) > 32)
+    {
+      fprintf(stderr, "Illegal key - must be 32 hex digits or less\n");
+      return(2);
+    }
+
+    for(i1=0; i1 < strlen(szKey); i1++)
+    {
+      unsigned char c = toupper(szKey[i1]);
+
+      if(c >= '0' && c <= '9')
+      {
+        c -= '0';
+      }
+      else if(c >= 'A' && c <= 'F')
+      {
+        c -= 'A' - '\xa';
+      }
+      else
+      {
+        fprintf(stderr, "Illegal character in key\n");
+        return(2);
+      }
+
+      pdwKey[i1 >> 3] *= 16;
+      pdwKey[i1 >> 3] += c;
+    }
+  }
+
+  if(bDebug)
+  {
+    fprintf(stderr, "dwKey[] = {%lx,%lx,%lx,%lx}\n",
+            (unsigned long)pdwKey[0],
+            (unsigned long)pdwKey[1],
+            (unsigned long)pdwKey[2],
+            (unsigned long)pdwKey[3]);
+  }
+
+  return(0);
+}
+
+
+// build the encryption dictionary for the key, and get the initial 16 byte
+// seed for it in 'pbSeed'.  Returns NULL on error.  Free it with 'FreeDictionary()'
+
+LPBYTE BuildKeyDictionary(const DWORD *pdwKey, BYTE *pbSeed)
+{
+int i1;
+
+  // now, get the bytes for the key
+  // NOTE:  code forced to "low endian" initial key
+
+  for(i1=0; i1 < 16; i1++)
+  {
+    DWORD dw1 = pdwKey[i1 >> 2];
+
+    if(i1 & 3)
+      pbSeed[i1] = (BYTE)((dw1 >> (4 * (i1 & 3))) & 0xff);
+    else
+      pbSeed[i1] = (BYTE)(dw1 & 0xff);
+  }
+
+  // next, I need to build the crypto key
+
+  WORD w1 = (WORD)(pdwKey[3] & 0xffff);
+  WORD w2 = (WORD)((pdwKey[3] >> 16) & 0xffff);
+
+  return(BuildEncryptionDictionary(pdwKey[0], pdwKey[1],
+                                   pdwKey[2], w1, w2));
+}
+
+
+static int __CDECL__ EncryptionDictionarySortCompare(const void *p1, const void *p2)
+{
+  DWORD *pdw1 = *((DWORD **)p1);
+  DWORD *pdw2 = *((DWORD **)p2);
+
+  /*register*/ DWORD dw1 = *pdw1;
+  /*register*/ DWORD dw2 = *pdw2;
+
+  if(dw1 < dw2)
+    return(-1);
+  else if(dw1 > dw2)
+    return(1);
+  else
+  {
+    // values are equal - use their relative position to reverse
+    // the original order.  This will ensure consistency even if
+    // the 'random sequence' were to contain all identical values.
+
+    // NOTE:  this part may behave differently with different compilers and OSs
+    //        most likely due to differing qsort implementations...
+
+    if(p1 < p2)
+      return(1);        // reverse
+    else if(p1 > p2)
+      return(-1);       // reverse
+    else
+      return(0);        // unlikely
+
+  }
+}
+
+// 128-bit key random encryption dictionary table generator
+// table size must be consistent for encrypt/decrypt to work
+// fastest table generation is a small 'bTableSize' (non-zero)
+// fastest encryption is a zero 'bTableSize' (max table size)
+
+LPBYTE BuildEncryptionDictionary(DWORD dw1, DWORD dw2, DWORD dwMask,
+                                 WORD w1, WORD w2,
+                                 BYTE bTableSize /* = 0 */)
+{
+  if(bDebug)
+  {
+    fprintf(stderr, "BuildEncryptionDictionary(%lx,%lx,%lx,%x,%x,%u)\n",
+            (unsigned long)dw1,
+            (unsigned long)dw2,
+            (unsigned long)dwMask,
+            w1, w2, bTableSize);
+  }
+
+  // build an encrypt and a decrypt dictionary.  Encrypt dictionary
   // is at offset 0 in resulting pointer.  Decrypt dictionary is at
   // offset 0x10000 (bytes) in resulting pointer.  Memory block
   // contains 512 256-byte lookup tables, one set of 256 for
@@ -591,7 +1575,10 @@ LPBYTE BuildEncryptionDictionary(DWORD dw1, DWORD dw2, DWORD dwMask,
 
   int iTableSize = (bTableSize ? bTableSize : 256);  // max index
   DWORD dwTableSize = 256 * (DWORD)iTableSize;       // # of bytes
-  LPBYTE pRval = new BYTE[(int)(dwTableSize * 2)];
+  LPBYTE pRval = AllocDictionary(dwTableSize * 2);
+
+  if(!pRval)
+    return(NULL);
 
   DWORD *pIndex0[256], *pIndex[256];  // index pointers
   BYTE bIndex0[256], bIndex[256];
@@ -798,7 +1785,9 @@ void EncryptDataStream(const BYTE *lpDict, LPBYTE lpData, UINT cbData,
   int iTableSize = (bTableSize ? bTableSize : 256);  // max index
   DWORD dwTableSize = 256 * (DWORD)iTableSize;       // # of bytes
 
-  BYTE *pbSeed = new BYTE[(int)(cbKeySize * 2)];
+  BYTE abSeedBuf[64];  // the usual key sizes don't need the heap
+  BYTE *pbSeed = cbKeySize * 2 <= sizeof(abSeedBuf) ? abSeedBuf
+               : new BYTE[(int)(cbKeySize * 2)];
 
 
 
@@ -807,20 +1796,31 @@ void EncryptDataStream(const BYTE *lpDict, LPBYTE lpData, UINT cbData,
 
 
   int i1;
+  UINT uSum = 0;
 
   for(i1=0; i1 < cbKeySize; i1++)
   {
     pbSeed[i1] = pbSeed0[i1];
     pbSeed[i1 + cbKeySize] = pbSeed0[i1];
+
+    uSum += pbSeed0[i1];
   }
 
+  // '_calc_crc16()' over the window is an end-around carry sum, which works
+  // out to zero if the sum of the bytes is zero, or '((sum - 1) % 255) + 1'
+  // otherwise.  Every window is a rotation of the same ring of bytes, so
+  // the sum is kept up to date as each byte is replaced, rather than
+  // re-calculating the checksum over all of them for every byte.
+
+#define ROLLING_CRC16(X) ((BYTE)((X) ? (((X) - 1) % 255) + 1 : 0))
+
   if(bDecryptFlag)
   {
     for(cb1=0; cb1 < cbData; cb1++)
     {
       i1 = (int)(cb1 % cbKeySize);
 
-      BYTE bSeed = (BYTE)_calc_crc16((LPCSTR)pbSeed + i1, cbKeySize);
+      BYTE bSeed = ROLLING_CRC16(uSum);
       BYTE bVal = lpData[cb1];
 
       if(bTableSize)
@@ -828,6 +1828,8 @@ void EncryptDataStream(const BYTE *lpDict, LPBYTE lpData, UINT cbData,
       else
         lpData[cb1] = lpDict[dwTableSize + (int)bSeed * 256 + bVal];
 
+      uSum += bVal - pbSeed[i1];
+
       pbSeed[i1] = bVal;  // NOTE:  encrypted value
       pbSeed[cbKeySize + i1] = bVal;
     }
@@ -838,7 +1840,7 @@ void EncryptDataStream(const BYTE *lpDict, LPBYTE lpData, UINT cbData,
     {
       i1 = (int)(cb1 % cbKeySize);
 
-      BYTE bSeed = (BYTE)_calc_crc16((LPCSTR)pbSeed + i1, cbKeySize);
+      BYTE bSeed = ROLLING_CRC16(uSum);
       BYTE bVal;
 
       if(bTableSize)
@@ -848,11 +1850,14 @@ void EncryptDataStream(const BYTE *lpDict, LPBYTE lpData, UINT cbData,
 
       lpData[cb1] = bVal;  // encrypted
 
+      uSum += bVal - pbSeed[i1];
+
       pbSeed[i1] = bVal;  // NOTE:  encrypted value
       pbSeed[cbKeySize + i1] = bVal;
     }
   }
 
+#undef ROLLING_CRC16
 
   // now, fix up "pbSeed"
 
@@ -863,7 +1868,8 @@ void EncryptDataStream(const BYTE *lpDict, LPBYTE lpData, UINT cbData,
     pbSeed0[i1] = pbSeed[i1 + i2];
   }
 
-  delete[] pbSeed;
+  if(pbSeed != abSeedBuf)
+    delete[] pbSeed;
 }
 
 
@@ -939,7 +1945,9 @@ void EncryptDataStream2(const BYTE *lpDict, LPBYTE lpData, UINT cbData,
   DWORD dwTableSize = 256 * (DWORD)iTableSize;       // # of bytes
 
 
-  BYTE *pbSeed = new BYTE[(int)(cbKeySize * 2)];
+  BYTE abSeedBuf[64];  // the usual key sizes don't need the heap
+  BYTE *pbSeed = cbKeySize * 2 <= sizeof(abSeedBuf) ? abSeedBuf
+               : new BYTE[(int)(cbKeySize * 2)];
 
   if(!pbSeed)
   {
@@ -992,6 +2000,8 @@ void EncryptDataStream2(const BYTE *lpDict, LPBYTE lpData, UINT cbData,
       else
         iIndex = (unsigned int)bSeed * 256 + pbSeed[i1 + i2];
 
+      PROFILE_DICT_CHAIN(iIndex);
+
       bSeed = lpDict[iIndex];
 
       i3 += bSeed;
@@ -999,14 +2009,22 @@ void EncryptDataStream2(const BYTE *lpDict, LPBYTE lpData, UINT cbData,
 
     bSeed = (BYTE)((i3 & 0xff) + ((i3 >> 8) & 0xff));
 
+    PROFILE_DICT_SEED(bSeed);
+
     if(bDecryptFlag)
     {
       BYTE bVal = lpData[cb1];
 
       if(bTableSize)
+      {
+        PROFILE_DICT_FINAL(dwTableSize + ((int)bSeed % bTableSize) * 256 + bVal);
         lpData[cb1] = lpDict[dwTableSize + ((int)bSeed % bTableSize) * 256 + bVal];
+      }
       else
+      {
+        PROFILE_DICT_FINAL(dwTableSize + (int)bSeed * 256 + bVal);
         lpData[cb1] = lpDict[dwTableSize + (int)bSeed * 256 + bVal];
+      }
 
       pbSeed[i1] = bVal;  // NOTE:  encrypted value
       pbSeed[cbKeySize + i1] = bVal;
@@ -1014,9 +2032,15 @@ void EncryptDataStream2(const BYTE *lpDict, LPBYTE lpData, UINT cbData,
     else
     {
       if(bTableSize)
+      {
+        PROFILE_DICT_FINAL(((int)bSeed % bTableSize) * 256 + lpData[cb1]);
         bVal = lpDict[((int)bSeed % bTableSize) * 256 + lpData[cb1]];
+      }
       else
+      {
+        PROFILE_DICT_FINAL((int)bSeed * 256 + lpData[cb1]);
         bVal = lpDict[(int)bSeed * 256 + lpData[cb1]];
+      }
 
       lpData[cb1] = bVal;  // encrypted
 
@@ -1034,6 +2058,6707 @@ void EncryptDataStream2(const BYTE *lpDict, LPBYTE lpData, UINT cbData,
     pbSeed0[i1] = pbSeed[i1 + i2];
   }
 
-  delete[] pbSeed;
+  if(pbSeed != abSeedBuf)
+    delete[] pbSeed;
+}
+
+
+
+
+// monotonic elapsed time in seconds (arbitrary origin), for statistics
+
+double GetElapsedSeconds(void)
+{
+#ifdef WIN32
+  return((double)clock() / CLOCKS_PER_SEC);
+#else // WIN32
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return((double)ts.tv_sec + (double)ts.tv_nsec / 1e9);
+#endif // WIN32
+}
+
+
+static int __CDECL__ LatencySortCompare(const void *p1, const void *p2)
+{
+  double d1 = *((const double *)p1);
+  double d2 = *((const double *)p2);
+
+  if(d1 < d2)
+    return(-1);
+  else if(d1 > d2)
+    return(1);
+
+  return(0);
+}
+
+// sorts the samples (in seconds) and prints p50/p99/max in microseconds
+
+void ReportLatencyStats(LPCSTR szWhat, double *pdSamples, UINT nSamples)
+{
+  if(!nSamples)
+  {
+    fprintf(stderr, "%s latency:  no samples\n", szWhat);
+    return;
+  }
+
+  qsort(pdSamples, nSamples, sizeof(*pdSamples), LatencySortCompare);
+
+  fprintf(stderr, "%s latency (usec):  p50 %.1f  p99 %.1f  max %.1f  (%u samples)\n",
+          szWhat,
+          pdSamples[(nSamples - 1) / 2] * 1e6,
+          pdSamples[(UINT)((nSamples - 1) * 0.99)] * 1e6,
+          pdSamples[nSamples - 1] * 1e6,
+          nSamples);
+}
+
+
+// low-latency streaming mode.  Rather than waiting on 'fread()' to fill a
+// 32k buffer, this uses 'poll()' and 'read()' to process whatever bytes are
+// available as soon as they arrive.  Data is encrypted/decrypted on arrival
+// (the seed state carries over between calls) and held in 'cBuf' until the
+// 'flush policy' says to write it:
+//
+//   pending bytes >= 'cbMinBatch', or
+//   the oldest pending byte has waited 'iMaxLatency' milliseconds, or
+//   'bFlushNL' and a newline was seen in the plain text, or
+//   the buffer is full, or end of input
+//
+// with the defaults (1 byte, 0 msec) everything is written immediately.
+// 'bStats' collects the latency of every write (measured from the arrival
+// of the oldest byte in it) and reports p50/p99 along with throughput.
+
+int StreamDataLowLatency(const BYTE *lpDict, int iIn, int iOut,
+                         BYTE *pbSeed, UINT cbKeySize, BOOL bDecryptFlag,
+                         int iMaxLatency, UINT cbMinBatch, BOOL bFlushNL,
+                         BOOL bStats)
+{
+#ifdef WIN32
+
+  fprintf(stderr, "'--stream' is not supported on this platform\n");
+  return(2);
+
+#else // WIN32
+
+  BYTE cBuf[32768];
+  UINT cbPending = 0, nSamples = 0, nMaxSamples = 0;
+  double dFirst = 0, dStart = GetElapsedSeconds(), dTotal = 0;
+  double *pdSamples = NULL;
+  BOOL bEOF = FALSE, bNL = FALSE;
+  int iRval = 0;
+
+  if(cbMinBatch < 1)
+    cbMinBatch = 1;
+  else if(cbMinBatch > sizeof(cBuf))
+    cbMinBatch = sizeof(cBuf);
+
+  if(iMaxLatency < 0)
+    iMaxLatency = 0;
+
+  while(!bEOF || cbPending)
+  {
+    if(!bEOF && cbPending < sizeof(cBuf))
+    {
+      struct pollfd pfd;
+      int iTimeout = -1; // nothing pending, wait forever
+
+      if(cbPending)
+      {
+        iTimeout = (int)((dFirst + iMaxLatency / 1000.0
+                          - GetElapsedSeconds()) * 1000.0 + 0.999);
+        if(iTimeout < 0)
+          iTimeout = 0;
+      }
+
+      pfd.fd = iIn;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+
+      int i1 = poll(&pfd, 1, iTimeout);
+
+      if(i1 < 0)
+      {
+        if(errno == EINTR)
+          continue;
+
+        fprintf(stderr, "error %d waiting for input\n", errno);
+        iRval = 3;
+        break;
+      }
+
+      if(i1 > 0)  // POLLIN, POLLHUP, or POLLERR - 'read()' sorts it out
+      {
+        ssize_t cb1 = read(iIn, cBuf + cbPending, sizeof(cBuf) - cbPending);
+
+        if(cb1 < 0)
+        {
+          if(errno == EINTR || errno == EAGAIN)
+            continue;
+
+          fprintf(stderr, "Read error on input file\n");
+          iRval = 3;
+          break;
+        }
+        else if(!cb1)
+        {
+          bEOF = TRUE;
+        }
+        else
+        {
+          LPBYTE pData = cBuf + cbPending;
+
+          if(!cbPending)
+            dFirst = GetElapsedSeconds();
+
+          // check for newlines in the PLAIN text, before or after
+
+          if(bFlushNL && !bDecryptFlag && memchr(pData, '\n', cb1))
+            bNL = TRUE;
+
+          lpfnEncryptDataStream(lpDict, pData, (UINT)cb1, pbSeed, cbKeySize,
+                                bDecryptFlag, 0);
+
+          if(bFlushNL && bDecryptFlag && memchr(pData, '\n', cb1))
+            bNL = TRUE;
+
+          cbPending += (UINT)cb1;
+        }
+      }
+    }
+
+    if(!cbPending)
+      continue;
+
+    double dNow = GetElapsedSeconds();
+
+    if(!bEOF && !bNL && cbPending < cbMinBatch && cbPending < sizeof(cBuf) &&
+       dNow - dFirst < iMaxLatency / 1000.0)
+    {
+      continue;  // keep collecting
+    }
+
+    // write everything that's pending
+
+    UINT cb2 = 0;
+
+    while(cb2 < cbPending)
+    {
+      ssize_t cb3 = write(iOut, cBuf + cb2, cbPending - cb2);
+
+      if(cb3 <= 0)
+      {
+        if(cb3 < 0 && errno == EINTR)
+          continue;
+
+        break;
+      }
+
+      cb2 += (UINT)cb3;
+    }
+
+    if(cb2 < cbPending)
+    {
+      fprintf(stderr, "Write error on output file\n");
+      iRval = 3;
+      break;
+    }
+
+    if(bStats)
+    {
+      if(nSamples >= nMaxSamples)
+      {
+        UINT nNew = nMaxSamples ? nMaxSamples * 2 : 4096;
+        double *pdNew = (double *)realloc(pdSamples, nNew * sizeof(*pdSamples));
+
+        if(!pdNew)
+        {
+          fprintf(stderr, "Not enough memory to complete the desired operation.\n");
+          free(pdSamples);
+          return(-1);
+        }
+
+        pdSamples = pdNew;
+        nMaxSamples = nNew;
+      }
+
+      pdSamples[nSamples++] = GetElapsedSeconds() - dFirst;
+    }
+
+    dTotal += cbPending;
+    cbPending = 0;
+    bNL = FALSE;
+  }
+
+  if(bStats)
+  {
+    dStart = GetElapsedSeconds() - dStart;
+
+    fprintf(stderr, "%.0f bytes in %u writes, %.3f sec, %.2f MB/s\n",
+            dTotal, nSamples, dStart,
+            dStart > 0 ? dTotal / dStart / 1048576.0 : 0.0);
+
+    ReportLatencyStats("record", pdSamples, nSamples);
+
+    free(pdSamples);
+  }
+
+  return(iRval);
+
+#endif // WIN32
+}
+
+
+
+// number of CPUs that are online, for the default thread count
+
+int GetDefaultThreadCount(void)
+{
+#ifdef WIN32
+  return(1);
+#else // WIN32
+  long lRval = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if(lRval < 1)
+    return(1);
+  else if(lRval > 64)
+    return(64);
+
+  return((int)lRval);
+#endif // WIN32
+}
+
+
+// parallel decryption.  Decrypting a byte only depends on the 16 preceding
+// bytes of CIPHER text (the seed ring, in either format), which are known,
+// so the data can be split into chunks and each one decrypted independently.
+// The seed for a chunk at offset 'o' is the 'cbKeySize' bytes that precede
+// it, taken from the initial seed when 'o' is less than that.  The seeds
+// must be captured before any chunk is decrypted in place.
+
+typedef struct tagDECRYPT_CHUNK
+{
+  const BYTE *lpDict;
+  LPBYTE lpData;
+  UINT cbData;
+  BYTE *pbSeed;
+  UINT cbKeySize;
+  BYTE bTableSize;
+} DECRYPT_CHUNK;
+
+#define MIN_PARALLEL_CHUNK 32768 /* smaller than this isn't worth a thread */
+
+static void DecryptChunk(DECRYPT_CHUNK *pC)
+{
+  lpfnEncryptDataStream(GetLocalDictionary(pC->lpDict), pC->lpData, pC->cbData, pC->pbSeed,
+                        pC->cbKeySize, TRUE, pC->bTableSize);
+}
+
+#ifndef WIN32
+
+// the worker threads are started the first time they're needed and kept
+// for the life of the process, so a long stream doesn't start and join
+// them for every buffer.  The caller takes chunks from the same list as
+// the workers, so it all gets done even if no worker could be started.
+// One caller at a time.
+
+static struct
+{
+  pthread_mutex_t mtxCaller;  // one caller at a time
+  pthread_mutex_t mtx;
+  pthread_cond_t cndWork, cndDone;
+  int nWorkers;               // started so far
+  DECRYPT_CHUNK *pChunks;     // the current job
+  int nChunks, iNext, nPending;
+} sDecryptPool = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+                   PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, NULL, 0, 0, 0 };
+
+// take the next chunk and decrypt it, with 'mtx' held (it's released while
+// decrypting).  returns FALSE if there are none left
+
+static BOOL DecryptPoolNext(void)
+{
+  if(sDecryptPool.iNext >= sDecryptPool.nChunks)
+    return(FALSE);
+
+  DECRYPT_CHUNK *pC = sDecryptPool.pChunks + sDecryptPool.iNext++;
+
+  pthread_mutex_unlock(&sDecryptPool.mtx);
+  DecryptChunk(pC);
+  pthread_mutex_lock(&sDecryptPool.mtx);
+
+  if(!--sDecryptPool.nPending)
+    pthread_cond_signal(&sDecryptPool.cndDone);
+
+  return(TRUE);
+}
+
+static void * DecryptWorkerThread(void *pArg)
+{
+  pthread_mutex_lock(&sDecryptPool.mtx);
+
+  while(1)
+  {
+    if(!DecryptPoolNext())
+      pthread_cond_wait(&sDecryptPool.cndWork, &sDecryptPool.mtx);
+  }
+
+  return(NULL);
+}
+
+#endif // WIN32
+
+void DecryptDataParallel(const BYTE *lpDict, LPBYTE lpData, UINT cbData,
+                         BYTE *pbSeed, UINT cbKeySize, int nThreads,
+                         BYTE bTableSize /* = 0 */)
+{
+  if(nThreads > 64)
+    nThreads = 64;
+
+  if(nThreads > 1 && cbData / nThreads < MIN_PARALLEL_CHUNK)
+    nThreads = cbData / MIN_PARALLEL_CHUNK;
+
+#ifdef WIN32
+  nThreads = 1;  // the worker pool uses POSIX threads, so '--threads' is ignored here
+#endif // WIN32
+
+  if(nThreads <= 1 || cbData < 2 * cbKeySize)
+  {
+    lpfnEncryptDataStream(lpDict, lpData, cbData, pbSeed, cbKeySize, TRUE, bTableSize);
+    return;
+  }
+
+  DECRYPT_CHUNK aChunk[64];
+  BYTE *pbSeeds = new BYTE[nThreads * cbKeySize];
+  UINT cbChunk = cbData / nThreads;
+  UINT i2;
+  int i1;
+
+  if(!pbSeeds)
+  {
+    lpfnEncryptDataStream(lpDict, lpData, cbData, pbSeed, cbKeySize, TRUE, bTableSize);
+    return;
+  }
+
+  for(i1=0; i1 < nThreads; i1++)
+  {
+    UINT cbOffset = i1 * cbChunk;
+
+    aChunk[i1].lpDict = lpDict;
+    aChunk[i1].lpData = lpData + cbOffset;
+    aChunk[i1].cbData = (i1 == nThreads - 1) ? cbData - cbOffset : cbChunk;
+    aChunk[i1].pbSeed = pbSeeds + i1 * cbKeySize;
+    aChunk[i1].cbKeySize = cbKeySize;
+    aChunk[i1].bTableSize = bTableSize;
+
+    // seed ring = the 'cbKeySize' bytes before the chunk, in order
+
+    for(i2=0; i2 < cbKeySize; i2++)
+    {
+      UINT cb1 = cbOffset + i2;  // position in 'initial seed + data'
+
+      if(cb1 < cbKeySize)
+        aChunk[i1].pbSeed[i2] = pbSeed[cb1];
+      else
+        aChunk[i1].pbSeed[i2] = lpData[cb1 - cbKeySize];
+    }
+  }
+
+  // the seed to return is the last 'cbKeySize' bytes of cipher text
+
+  memcpy(pbSeed, lpData + cbData - cbKeySize, cbKeySize);
+
+#ifndef WIN32
+  pthread_mutex_lock(&sDecryptPool.mtxCaller);
+  pthread_mutex_lock(&sDecryptPool.mtx);
+
+  while(sDecryptPool.nWorkers < nThreads - 1)  // the caller is the other one
+  {
+    pthread_t thread;
+
+    if(pthread_create(&thread, NULL, DecryptWorkerThread, NULL))
+      break;
+
+    pthread_detach(thread);
+    sDecryptPool.nWorkers++;
+  }
+
+  sDecryptPool.pChunks = aChunk;
+  sDecryptPool.nChunks = sDecryptPool.nPending = nThreads;
+  sDecryptPool.iNext = 0;
+
+  pthread_cond_broadcast(&sDecryptPool.cndWork);
+
+  while(DecryptPoolNext())  // help out
+    { }
+
+  while(sDecryptPool.nPending)
+    pthread_cond_wait(&sDecryptPool.cndDone, &sDecryptPool.mtx);
+
+  sDecryptPool.nChunks = sDecryptPool.iNext = 0;
+
+  pthread_mutex_unlock(&sDecryptPool.mtx);
+  pthread_mutex_unlock(&sDecryptPool.mtxCaller);
+#endif // WIN32
+
+  delete[] pbSeeds;
+}
+
+
+// fused re-key.  Each buffer is decrypted with the old key (in parallel)
+// and immediately re-encrypted with the new key while it's still in the
+// cache, so the plain text never leaves this process.
+
+#define REKEY_BUFFER_SIZE 0x100000 /* 1Mb */
+
+int RekeyStream(FILE *pIN, FILE *pOUT, REKEY_INFO *pInfo)
+{
+  BYTE pbSeedOld[16], pbSeedNew[16];
+  int iRval = 0;
+  LPBYTE pBuf = new BYTE[REKEY_BUFFER_SIZE];
+
+  if(!pBuf)
+  {
+    fprintf(stderr, "Not enough memory to complete the desired operation.\n");
+    return(-1);
+  }
+
+  memcpy(pbSeedOld, pInfo->pbSeedOld, sizeof(pbSeedOld));
+  memcpy(pbSeedNew, pInfo->pbSeedNew, sizeof(pbSeedNew));
+
+  while(!feof(pIN))
+  {
+    DWORD cb1 = fread(pBuf, 1, REKEY_BUFFER_SIZE, pIN);
+
+    if(!cb1)
+      break;
+
+    DecryptDataParallel(pInfo->lpDictOld, pBuf, cb1, pbSeedOld,
+                        sizeof(pbSeedOld), pInfo->nThreads);
+
+    lpfnEncryptDataStream(pInfo->lpDictNew, pBuf, cb1, pbSeedNew,
+                          sizeof(pbSeedNew), FALSE, 0);
+
+    if(fwrite(pBuf, 1, cb1, pOUT) != cb1)
+    {
+      fprintf(stderr, "Write error on output file\n");
+      iRval = 3;
+      break;
+    }
+
+    pInfo->dTotal += cb1;
+  }
+
+  if(!iRval && ferror(pIN))
+  {
+    fprintf(stderr, "Read error on input file\n");
+    iRval = 3;
+  }
+
+  pInfo->nFiles++;
+
+  memset(pBuf, 0, REKEY_BUFFER_SIZE);  // don't leave plain text lying around
+  delete[] pBuf;
+
+  return(iRval);
 }
 
+
+// re-key every regular file under 'szPath' in place.  Each file is written
+// to a temporary file alongside it and renamed over the original when it
+// completes, so an interrupted run never leaves a half re-keyed file.
+// Symbolic links are not followed.  Returns non-zero if any file failed.
+
+static int RekeyFileInPlace(LPCSTR szPath, const struct stat *pStat,
+                            REKEY_INFO *pInfo)
+{
+#ifdef WIN32
+
+  fprintf(stderr, "re-keying a directory is not supported on this platform\n");
+  return(2);
+
+#else // WIN32
+
+  char *pTemp = new char[strlen(szPath) + 16];
+  FILE *pIN, *pOUT;
+  int iRval;
+
+  if(!pTemp)
+  {
+    fprintf(stderr, "Not enough memory to complete the desired operation.\n");
+    return(-1);
+  }
+
+  strcpy(pTemp, szPath);
+  strcat(pTemp, ".rekey~");
+
+  pIN = fopen(szPath, "rb");
+
+  if(!pIN)
+  {
+    fprintf(stderr, "Unable to open input file '%s'\n", szPath);
+    delete[] pTemp;
+    return(-1);
+  }
+
+  int iOut = open(pTemp, O_WRONLY | O_CREAT | O_EXCL, pStat->st_mode & 07777);
+
+  if(iOut < 0 || !(pOUT = fdopen(iOut, "wb")))
+  {
+    fprintf(stderr, "Unable to open output file '%s'\n", pTemp);
+
+    if(iOut >= 0)
+    {
+      close(iOut);
+      unlink(pTemp);
+    }
+
+    fclose(pIN);
+    delete[] pTemp;
+    return(-1);
+  }
+
+  iRval = RekeyStream(pIN, pOUT, pInfo);
+
+  fclose(pIN);
+
+  if(fflush(pOUT) || fsync(fileno(pOUT)))
+  {
+    if(!iRval)
+    {
+      fprintf(stderr, "Write error on output file '%s'\n", pTemp);
+      iRval = 3;
+    }
+  }
+
+  fclose(pOUT);
+
+  if(!iRval && rename(pTemp, szPath))
+  {
+    fprintf(stderr, "Unable to replace '%s' (error %d)\n", szPath, errno);
+    iRval = 3;
+  }
+
+  if(iRval)
+    unlink(pTemp);
+
+  delete[] pTemp;
+
+  return(iRval);
+
+#endif // WIN32
+}
+
+int RekeyTree(LPCSTR szPath, REKEY_INFO *pInfo)
+{
+#ifdef WIN32
+
+  fprintf(stderr, "re-keying a directory is not supported on this platform\n");
+  return(2);
+
+#else // WIN32
+
+  struct stat sStat;
+  int iRval = 0;
+
+  if(lstat(szPath, &sStat))
+  {
+    fprintf(stderr, "Unable to stat '%s' (error %d)\n", szPath, errno);
+    pInfo->nErrors++;
+    return(3);
+  }
+
+  if(S_ISREG(sStat.st_mode))
+  {
+    iRval = RekeyFileInPlace(szPath, &sStat, pInfo);
+
+    if(iRval)
+      pInfo->nErrors++;
+    else if(pInfo->bStats)
+      fprintf(stderr, "  %s\n", szPath);
+
+    return(iRval);
+  }
+
+  if(!S_ISDIR(sStat.st_mode))
+    return(0);  // links, devices, etc. are left alone
+
+  DIR *pDir = opendir(szPath);
+
+  if(!pDir)
+  {
+    fprintf(stderr, "Unable to open directory '%s' (error %d)\n", szPath, errno);
+    pInfo->nErrors++;
+    return(3);
+  }
+
+  // collect the names first, since re-keying adds and renames entries
+
+  struct dirent *pEnt;
+  char **ppNames = NULL;
+  int i1, nNames = 0, nMaxNames = 0, cbPath = strlen(szPath);
+
+  while((pEnt = readdir(pDir)))
+  {
+    int cbName = strlen(pEnt->d_name);
+
+    if(!strcmp(pEnt->d_name, ".") || !strcmp(pEnt->d_name, "..") ||
+       (cbName > 7 && !strcmp(pEnt->d_name + cbName - 7, ".rekey~")))
+    {
+      continue;
+    }
+
+    if(nNames >= nMaxNames)
+    {
+      char **ppNew = (char **)realloc(ppNames, (nMaxNames ? nMaxNames * 2 : 64) * sizeof(*ppNames));
+
+      if(ppNew)
+      {
+        ppNames = ppNew;
+        nMaxNames = nMaxNames ? nMaxNames * 2 : 64;
+      }
+    }
+
+    if(nNames >= nMaxNames || !(ppNames[nNames] = new char[cbPath + cbName + 2]))
+    {
+      fprintf(stderr, "Not enough memory to complete the desired operation.\n");
+      closedir(pDir);
+
+      while(nNames-- > 0)
+        delete[] ppNames[nNames];
+
+      free(ppNames);
+      return(-1);
+    }
+
+    strcpy(ppNames[nNames], szPath);
+    if(cbPath && szPath[cbPath - 1] != '/')
+      strcat(ppNames[nNames], "/");
+    strcat(ppNames[nNames], pEnt->d_name);
+
+    nNames++;
+  }
+
+  closedir(pDir);
+
+  for(i1=0; i1 < nNames; i1++)
+  {
+    if(RekeyTree(ppNames[i1], pInfo))
+      iRval = 3;
+
+    delete[] ppNames[i1];
+  }
+
+  free(ppNames);
+
+  return(iRval);
+
+#endif // WIN32
+}
+
+
+
+// page-aligned buffers with a small reusable pool, so that repeated
+// allocations of the same size (one per file, per thread, etc.) don't go
+// back to the heap.  Required for O_DIRECT I/O.  Thread safe.
+
+#define ALIGNED_BUFFER_ALIGN 4096
+#define ALIGNED_POOL_SIZE 16
+
+static struct
+{
+  LPBYTE pBuf;
+  UINT cbSize;
+} aAlignedPool[ALIGNED_POOL_SIZE];
+
+#ifndef WIN32
+static pthread_mutex_t mtxAlignedPool = PTHREAD_MUTEX_INITIALIZER;
+#endif // WIN32
+
+LPBYTE AllocAlignedBuffer(UINT cbSize)
+{
+  LPBYTE pRval = NULL;
+  int i1;
+
+#ifndef WIN32
+  pthread_mutex_lock(&mtxAlignedPool);
+#endif // WIN32
+
+  for(i1=0; i1 < ALIGNED_POOL_SIZE; i1++)
+  {
+    if(aAlignedPool[i1].pBuf && aAlignedPool[i1].cbSize == cbSize)
+    {
+      pRval = aAlignedPool[i1].pBuf;
+      aAlignedPool[i1].pBuf = NULL;
+      break;
+    }
+  }
+
+#ifndef WIN32
+  pthread_mutex_unlock(&mtxAlignedPool);
+#endif // WIN32
+
+  if(pRval)
+    return(pRval);
+
+#ifdef WIN32
+  pRval = (LPBYTE)_aligned_malloc(cbSize, ALIGNED_BUFFER_ALIGN);
+#else // WIN32
+  if(posix_memalign((void **)&pRval, ALIGNED_BUFFER_ALIGN, cbSize))
+    pRval = NULL;
+#endif // WIN32
+
+  return(pRval);
+}
+
+void FreeAlignedBuffer(LPBYTE pBuf, UINT cbSize)
+{
+  int i1;
+
+  if(!pBuf)
+    return;
+
+#ifndef WIN32
+  pthread_mutex_lock(&mtxAlignedPool);
+#endif // WIN32
+
+  for(i1=0; i1 < ALIGNED_POOL_SIZE; i1++)
+  {
+    if(!aAlignedPool[i1].pBuf)
+    {
+      aAlignedPool[i1].pBuf = pBuf;
+      aAlignedPool[i1].cbSize = cbSize;
+      pBuf = NULL;
+      break;
+    }
+  }
+
+#ifndef WIN32
+  pthread_mutex_unlock(&mtxAlignedPool);
+#endif // WIN32
+
+  if(pBuf) // pool is full
+  {
+#ifdef WIN32
+    _aligned_free(pBuf);
+#else // WIN32
+    free(pBuf);
+#endif // WIN32
+  }
+}
+
+
+// size of the page cache from /proc/meminfo, in kB, or -1 if unknown
+
+long GetPageCacheKB(void)
+{
+  long lRval = -1;
+  char tbuf[256];
+  FILE *pF = fopen("/proc/meminfo", "r");
+
+  if(!pF)
+    return(-1);
+
+  while(fgets(tbuf, sizeof(tbuf), pF))
+  {
+    if(!strncmp(tbuf, "Cached:", 7))
+    {
+      lRval = atol(tbuf + 7);
+      break;
+    }
+  }
+
+  fclose(pF);
+
+  return(lRval);
+}
+
+
+// O_DIRECT file I/O, for files that are larger than RAM and would otherwise
+// flush everything else out of the page cache.  Buffers are page aligned
+// and a multiple of the page size.  A short read means end of file; the
+// unaligned tail of the output is written after O_DIRECT is turned off.
+// If the file system refuses O_DIRECT (EINVAL), normal I/O is used instead,
+// with 'posix_fadvise()' to drop the pages once they're no longer needed.
+
+#ifndef WIN32
+static void DropCachedPages(int iFile, BOOL bDirty)
+{
+#ifdef POSIX_FADV_DONTNEED
+  if(bDirty)
+    fdatasync(iFile); // dirty pages can't be dropped
+
+  posix_fadvise(iFile, 0, 0, POSIX_FADV_DONTNEED);
+#endif // POSIX_FADV_DONTNEED
+}
+
+static int SetDirectIO(int iFile, BOOL bDirect)
+{
+  int iFlags = fcntl(iFile, F_GETFL);
+
+  if(iFlags == -1)
+    return(-1);
+
+  return(fcntl(iFile, F_SETFL, bDirect ? (iFlags | O_DIRECT) : (iFlags & ~O_DIRECT)));
+}
+#endif // WIN32
+
+int DirectDataTransfer(const BYTE *lpDict, LPCSTR szIn, LPCSTR szOut,
+                       BYTE *pbSeed, UINT cbKeySize, BOOL bDecryptFlag,
+                       UINT cbBufSize, BOOL bStats)
+{
+#if defined(WIN32) || !defined(O_DIRECT)
+
+  fprintf(stderr, "'--direct' is not supported on this platform\n");
+  return(2);
+
+#else // WIN32, O_DIRECT
+
+  int iIn, iOut, iRval = 0;
+  BOOL bDirectIn = TRUE, bDirectOut = TRUE, bEOF = FALSE;
+  double dStart = GetElapsedSeconds(), dTotal = 0, dSinceDrop = 0;
+  long lCache0 = bStats ? GetPageCacheKB() : -1;
+
+  cbBufSize = (cbBufSize + ALIGNED_BUFFER_ALIGN - 1) & ~(ALIGNED_BUFFER_ALIGN - 1);
+
+  iIn = open(szIn, O_RDONLY | O_DIRECT);
+
+  if(iIn < 0 && errno == EINVAL)
+  {
+    bDirectIn = FALSE;
+    iIn = open(szIn, O_RDONLY);
+  }
+
+  if(iIn < 0)
+  {
+    fprintf(stderr, "Unable to open input file '%s'\n", szIn);
+    return(-1);
+  }
+
+  unlink(szOut);  // just in case
+
+  iOut = open(szOut, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0666);
+
+  if(iOut < 0 && errno == EINVAL)
+  {
+    bDirectOut = FALSE;
+    iOut = open(szOut, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  }
+
+  if(iOut < 0)
+  {
+    fprintf(stderr, "Unable to open output file '%s'\n", szOut);
+    close(iIn);
+    return(-1);
+  }
+
+  if(bStats || bDebug)
+  {
+    fprintf(stderr, "O_DIRECT input:%s output:%s buffer:%u\n",
+            bDirectIn ? "yes" : "no", bDirectOut ? "yes" : "no", cbBufSize);
+  }
+
+#ifdef POSIX_FADV_SEQUENTIAL
+  if(!bDirectIn)
+    posix_fadvise(iIn, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif // POSIX_FADV_SEQUENTIAL
+
+  LPBYTE pBuf = AllocAlignedBuffer(cbBufSize);
+
+  if(!pBuf)
+  {
+    fprintf(stderr, "Not enough memory to complete the desired operation.\n");
+    close(iIn);
+    close(iOut);
+    return(-1);
+  }
+
+  while(!bEOF)
+  {
+    UINT cb1 = 0;
+
+    // fill the buffer.  With O_DIRECT the offset must stay aligned, so
+    // anything short of a full block is the end of the file
+
+    while(cb1 < cbBufSize)
+    {
+      ssize_t cb2 = read(iIn, pBuf + cb1, cbBufSize - cb1);
+
+      if(cb2 < 0)
+      {
+        if(errno == EINTR)
+          continue;
+
+        if(errno == EINVAL && bDirectIn) // refused after all
+        {
+          bDirectIn = FALSE;
+          SetDirectIO(iIn, FALSE);
+          continue;
+        }
+
+        fprintf(stderr, "Read error on input file\n");
+        iRval = 3;
+        break;
+      }
+      else if(!cb2)
+      {
+        bEOF = TRUE;
+        break;
+      }
+
+      cb1 += (UINT)cb2;
+
+      if(bDirectIn && (cb1 & (ALIGNED_BUFFER_ALIGN - 1)))
+      {
+        // unaligned tail - turn off O_DIRECT to confirm the EOF
+
+        bDirectIn = FALSE;
+        SetDirectIO(iIn, FALSE);
+      }
+    }
+
+    if(iRval || !cb1)
+      break;
+
+    lpfnEncryptDataStream(lpDict, pBuf, cb1, pbSeed, cbKeySize, bDecryptFlag, 0);
+
+    UINT cb2 = 0;
+
+    while(cb2 < cb1)
+    {
+      UINT cb3 = cb1 - cb2;
+
+      if(bDirectOut && (cb3 & (ALIGNED_BUFFER_ALIGN - 1)))
+      {
+        // the unaligned tail (only at EOF).  Write the aligned part with
+        // O_DIRECT and the rest without it.
+
+        cb3 &= ~(ALIGNED_BUFFER_ALIGN - 1);
+
+        if(!cb3)
+        {
+          bDirectOut = FALSE;
+          SetDirectIO(iOut, FALSE);
+          continue;
+        }
+      }
+
+      ssize_t cb4 = write(iOut, pBuf + cb2, cb3);
+
+      if(cb4 < 0 && errno == EINVAL && bDirectOut) // refused after all
+      {
+        bDirectOut = FALSE;
+        SetDirectIO(iOut, FALSE);
+        continue;
+      }
+      else if(cb4 < 0 && errno == EINTR)
+      {
+        continue;
+      }
+      else if(cb4 <= 0)
+      {
+        break;
+      }
+
+      cb2 += (UINT)cb4;
+    }
+
+    if(cb2 < cb1)
+    {
+      fprintf(stderr, "Write error on output file\n");
+      iRval = 3;
+      break;
+    }
+
+    dTotal += cb1;
+    dSinceDrop += cb1;
+
+    if(dSinceDrop >= 64.0 * 1048576.0) // every 64Mb or so
+    {
+      if(!bDirectIn)
+        DropCachedPages(iIn, FALSE);
+      if(!bDirectOut)
+        DropCachedPages(iOut, TRUE);
+
+      dSinceDrop = 0;
+    }
+  }
+
+  memset(pBuf, 0, cbBufSize);  // plain text, one way or the other
+  FreeAlignedBuffer(pBuf, cbBufSize);
+
+  if(fsync(iOut) && !iRval)
+  {
+    fprintf(stderr, "Write error on output file\n");
+    iRval = 3;
+  }
+
+  if(!bDirectIn)  // includes the unaligned tail, if any
+    DropCachedPages(iIn, FALSE);
+  if(!bDirectOut)
+    DropCachedPages(iOut, FALSE);
+
+  close(iIn);
+
+  if(close(iOut) && !iRval)
+  {
+    fprintf(stderr, "Write error on output file\n");
+    iRval = 3;
+  }
+
+  if(bStats)
+  {
+    dStart = GetElapsedSeconds() - dStart;
+
+    fprintf(stderr, "%.0f bytes in %.3f sec, %.2f MB/s\n",
+            dTotal, dStart, dStart > 0 ? dTotal / dStart / 1048576.0 : 0.0);
+
+    if(lCache0 >= 0)
+      fprintf(stderr, "page cache grew by %ld kB\n", GetPageCacheKB() - lCache0);
+  }
+
+  return(iRval);
+
+#endif // WIN32, O_DIRECT
+}
+
+
+
+// encrypting TCP relay.  Each accepted connection is paired with a new
+// connection to the upstream host.  Data read from the client is encrypted
+// and sent upstream; data from upstream is decrypted and sent to the client
+// ('-d' reverses that, for the other end of the link).  Every direction of
+// every connection has its own seed ring, starting from the key's seed,
+// and all of them share the one (read-only) dictionary.
+//
+// The listening thread accepts and starts a non-blocking connect, then
+// queues the pair of sockets for one of 'nThreads' workers (round robin)
+// and pokes its eventfd.  Each worker runs an edge-triggered epoll loop,
+// and adds the sockets to its own epoll set, so a connection belongs to
+// exactly one worker from the start and no locking is needed.  Nothing is
+// relayed until the upstream connect completes.  If the destination socket
+// can't keep up, the direction stops reading until its pending data has
+// been written.
+
+#ifdef __linux__
+
+#define RELAY_BUFFER_SIZE 16384
+
+struct tagRELAY_CONN;
+
+typedef struct tagRELAY_END
+{
+  struct tagRELAY_CONN *pConn;
+  int iSide;                    // 0 for the client, 1 for upstream
+} RELAY_END;
+
+typedef struct tagRELAY_DIR     // data read from side N, written to side !N
+{
+  BYTE pbSeed[16];
+  BOOL bDecrypt, bEOF, bShut;
+  UINT cbPending, cbOffset;
+  BYTE cBuf[RELAY_BUFFER_SIZE];
+} RELAY_DIR;
+
+typedef struct tagRELAY_CONN
+{
+  int aFD[2];
+  BOOL bConnecting;             // upstream connect() still in progress
+  RELAY_END aEnd[2];
+  RELAY_DIR aDir[2];
+  struct tagRELAY_CONN *pNext;  // in the worker's queue of new connections
+} RELAY_CONN;
+
+typedef struct tagRELAY_WORKER
+{
+  const BYTE *lpDict;
+  int iEpoll;
+  int iEvent;                   // eventfd - new connections are queued
+  pthread_mutex_t mtx;          // protects 'pNew'
+  RELAY_CONN *pNew;
+  pthread_t thread;
+  volatile BOOL bQuit;          // set (and 'iEvent' signalled) to stop it
+  volatile BOOL bFailed;        // it stopped on an error
+} RELAY_WORKER;
+
+static volatile sig_atomic_t bRelayQuit = FALSE;
+static volatile unsigned long long qwRelayBytes = 0, qwRelayConns = 0,
+                                   qwRelayActive = 0;
+
+static void RelaySignalHandler(int iSig)
+{
+  bRelayQuit = TRUE;
+}
+
+static void RelayClose(RELAY_CONN *pConn)
+{
+  close(pConn->aFD[0]);  // also removes them from epoll
+  close(pConn->aFD[1]);
+
+  __sync_fetch_and_sub(&qwRelayActive, 1);
+
+  memset(pConn, 0, sizeof(*pConn));  // no stray plain text
+  delete pConn;
+}
+
+// move as much data as possible in one direction.  Returns FALSE on error
+
+static BOOL RelayPump(const BYTE *lpDict, RELAY_CONN *pConn, int iSide)
+{
+  RELAY_DIR *pD = pConn->aDir + iSide;
+  int iSrc = pConn->aFD[iSide], iDest = pConn->aFD[!iSide];
+
+  for(;;)
+  {
+    while(pD->cbPending)
+    {
+      ssize_t cb1 = send(iDest, pD->cBuf + pD->cbOffset, pD->cbPending, MSG_NOSIGNAL);
+
+      if(cb1 < 0)
+      {
+        if(errno == EINTR)
+          continue;
+
+        return(errno == EAGAIN || errno == EWOULDBLOCK); // wait for EPOLLOUT
+      }
+
+      pD->cbOffset += (UINT)cb1;
+      pD->cbPending -= (UINT)cb1;
+
+      __sync_fetch_and_add(&qwRelayBytes, (unsigned long long)cb1);
+    }
+
+    if(pD->bEOF)
+    {
+      if(!pD->bShut)
+      {
+        shutdown(iDest, SHUT_WR);  // pass the EOF along
+        pD->bShut = TRUE;
+      }
+
+      return(TRUE);
+    }
+
+    ssize_t cb2 = recv(iSrc, pD->cBuf, sizeof(pD->cBuf), 0);
+
+    if(cb2 < 0)
+    {
+      if(errno == EINTR)
+        continue;
+
+      return(errno == EAGAIN || errno == EWOULDBLOCK); // wait for EPOLLIN
+    }
+    else if(!cb2)
+    {
+      pD->bEOF = TRUE;
+      continue;
+    }
+
+    lpfnEncryptDataStream(lpDict, pD->cBuf, (UINT)cb2, pD->pbSeed,
+                          sizeof(pD->pbSeed), pD->bDecrypt, 0);
+
+    pD->cbOffset = 0;
+    pD->cbPending = (UINT)cb2;
+  }
+}
+
+// add the queued connections to this worker's epoll set
+
+static void RelayAddNew(RELAY_WORKER *pW)
+{
+  RELAY_CONN *pConn;
+  uint64_t qw1;
+  int i1;
+
+  if(read(pW->iEvent, &qw1, sizeof(qw1)) < 0 && errno != EAGAIN)
+    return;
+
+  pthread_mutex_lock(&pW->mtx);
+  pConn = pW->pNew;
+  pW->pNew = NULL;
+  pthread_mutex_unlock(&pW->mtx);
+
+  while(pConn)
+  {
+    RELAY_CONN *pNext = pConn->pNext;
+    BOOL bOK = TRUE;
+
+    for(i1=0; i1 < 2; i1++)
+    {
+      struct epoll_event sEv;
+
+      sEv.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+      sEv.data.ptr = pConn->aEnd + i1;
+
+      if(epoll_ctl(pW->iEpoll, EPOLL_CTL_ADD, pConn->aFD[i1], &sEv))
+        bOK = FALSE;
+    }
+
+    if(!bOK)
+      RelayClose(pConn);
+
+    pConn = pNext;
+  }
+}
+
+// has the upstream connect() finished?  returns FALSE if it failed
+
+static BOOL RelayConnected(RELAY_CONN *pConn, const struct epoll_event *pEv)
+{
+  RELAY_END *pE = (RELAY_END *)pEv->data.ptr;
+  int iErr = 0;
+  socklen_t cbErr = sizeof(iErr);
+
+  if(pE->iSide == 0)  // the client - only an error matters, for now
+    return(!(pEv->events & EPOLLERR));
+
+  if(!(pEv->events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+    return(TRUE);
+
+  if(getsockopt(pConn->aFD[1], SOL_SOCKET, SO_ERROR, &iErr, &cbErr) || iErr)
+  {
+    if(bDebug)
+      fprintf(stderr, "relay:  unable to connect upstream (error %d)\n", iErr);
+
+    return(FALSE);
+  }
+
+  pConn->bConnecting = FALSE;
+
+  return(TRUE);
+}
+
+static void * RelayWorkerThread(void *pArg)
+{
+  RELAY_WORKER *pW = (RELAY_WORKER *)pArg;
+  struct epoll_event aEv[64];
+  int i1, i2, nEv;
+
+  for(;;)
+  {
+    nEv = epoll_wait(pW->iEpoll, aEv, sizeof(aEv) / sizeof(*aEv), -1);
+
+    if(nEv < 0)
+    {
+      if(errno == EINTR)
+        continue;
+
+      fprintf(stderr, "relay:  epoll error %d\n", errno);
+      pW->bFailed = TRUE;
+      break;
+    }
+
+    // the thread may have moved to another node since the last batch
+
+    const BYTE *lpDict = GetLocalDictionary(pW->lpDict);
+
+    for(i1=0; i1 < nEv; i1++)
+    {
+      RELAY_END *pE = (RELAY_END *)aEv[i1].data.ptr;
+
+      if(!pE)  // connection was closed earlier in this batch
+        continue;
+
+      if(pE == (RELAY_END *)pW)  // the eventfd
+      {
+        RelayAddNew(pW);
+        continue;
+      }
+
+      RELAY_CONN *pConn = pE->pConn;
+      BOOL bOK = !pConn->bConnecting || RelayConnected(pConn, aEv + i1);
+
+      if(bOK && pConn->bConnecting)  // not yet
+        continue;
+
+      // events on either socket can unblock either direction, so pump both
+
+      if(!bOK || !RelayPump(lpDict, pConn, 0) || !RelayPump(lpDict, pConn, 1) ||
+         (pConn->aDir[0].bShut && pConn->aDir[1].bShut) ||
+         (aEv[i1].events & EPOLLERR))
+      {
+        // the other socket may also be in this batch; forget about it
+
+        for(i2=i1 + 1; i2 < nEv; i2++)
+        {
+          if(aEv[i2].data.ptr && aEv[i2].data.ptr != (void *)pW &&
+             ((RELAY_END *)aEv[i2].data.ptr)->pConn == pConn)
+          {
+            aEv[i2].data.ptr = NULL;
+          }
+        }
+
+        RelayClose(pConn);
+      }
+    }
+
+    if(pW->bQuit)
+      break;
+  }
+
+  return(NULL);
+}
+
+int RelayConnections(const BYTE *lpDict, LPCSTR szRelay,
+                     const BYTE *pbSeed, UINT cbKeySize, BOOL bDecryptFlag,
+                     int nThreads, BOOL bStats)
+{
+  char tbuf[512], *p1, *p2, *p3;
+  LPCSTR szBind = "127.0.0.1";
+  struct addrinfo sHints, *pUp = NULL, *pBind = NULL;
+  unsigned long long qwLastBytes = 0, qwLastConns = 0;
+  double dStart, dLast;
+  int i1, iListen, nStarted, iNext = 0, iRval = 0;
+
+  if(cbKeySize != sizeof(((RELAY_DIR *)0)->pbSeed))
+    return(-1);
+
+  // parse [BIND:]PORT:HOST:HPORT, from the right
+
+  strncpy(tbuf, szRelay, sizeof(tbuf) - 1);
+  tbuf[sizeof(tbuf) - 1] = 0;
+
+  p3 = strrchr(tbuf, ':');
+  if(p3)
+  {
+    *(p3++) = 0;
+    p2 = strrchr(tbuf, ':');
+  }
+
+  if(!p3 || !p2)
+  {
+    fprintf(stderr, "INVALID relay specification '%s'\n", szRelay);
+    return(2);
+  }
+
+  *(p2++) = 0;
+  p1 = strrchr(tbuf, ':');
+
+  if(p1)
+  {
+    *(p1++) = 0;
+    szBind = tbuf;
+  }
+  else
+  {
+    p1 = tbuf;
+  }
+
+  memset(&sHints, 0, sizeof(sHints));
+  sHints.ai_family = AF_UNSPEC;
+  sHints.ai_socktype = SOCK_STREAM;
+
+  if((i1 = getaddrinfo(p2, p3, &sHints, &pUp)))
+  {
+    fprintf(stderr, "Unable to resolve '%s:%s' - %s\n", p2, p3, gai_strerror(i1));
+    return(2);
+  }
+
+  sHints.ai_flags = AI_PASSIVE;
+
+  if((i1 = getaddrinfo(*szBind ? szBind : NULL, p1, &sHints, &pBind)))
+  {
+    fprintf(stderr, "Unable to resolve '%s:%s' - %s\n", szBind, p1, gai_strerror(i1));
+    freeaddrinfo(pUp);
+    return(2);
+  }
+
+  iListen = socket(pBind->ai_family, SOCK_STREAM, 0);
+  i1 = 1;
+
+  if(iListen < 0 ||
+     setsockopt(iListen, SOL_SOCKET, SO_REUSEADDR, &i1, sizeof(i1)) ||
+     bind(iListen, pBind->ai_addr, pBind->ai_addrlen) ||
+     listen(iListen, 1024))
+  {
+    fprintf(stderr, "Unable to listen on '%s:%s' (error %d)\n", szBind, p1, errno);
+    freeaddrinfo(pUp);
+    freeaddrinfo(pBind);
+    return(3);
+  }
+
+  freeaddrinfo(pBind);
+
+  // start the workers
+
+  if(nThreads < 1)
+    nThreads = 1;
+
+  RELAY_WORKER *pW = new RELAY_WORKER[nThreads];
+
+  for(nStarted=0; nStarted < nThreads; nStarted++)
+  {
+    RELAY_WORKER *pW1 = pW + nStarted;
+    struct epoll_event sEv;
+
+    pW1->lpDict = lpDict;
+    pW1->iEpoll = epoll_create1(EPOLL_CLOEXEC);
+    pW1->iEvent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pW1->pNew = NULL;
+    pW1->bQuit = FALSE;
+    pW1->bFailed = FALSE;
+    pthread_mutex_init(&pW1->mtx, NULL);
+
+    sEv.events = EPOLLIN;
+    sEv.data.ptr = pW1;  // (not a RELAY_END)
+
+    if(pW1->iEpoll < 0 || pW1->iEvent < 0 ||
+       epoll_ctl(pW1->iEpoll, EPOLL_CTL_ADD, pW1->iEvent, &sEv) ||
+       pthread_create(&(pW1->thread), NULL, RelayWorkerThread, pW1))
+    {
+      fprintf(stderr, "Unable to start relay thread (error %d)\n", errno);
+
+      if(pW1->iEpoll >= 0)
+        close(pW1->iEpoll);
+
+      if(pW1->iEvent >= 0)
+        close(pW1->iEvent);
+
+      pthread_mutex_destroy(&pW1->mtx);
+      iRval = -1;
+      break;
+    }
+  }
+
+  if(iRval)
+    goto done;
+
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, RelaySignalHandler);
+  signal(SIGTERM, RelaySignalHandler);
+
+  dStart = dLast = GetElapsedSeconds();
+
+  while(!bRelayQuit)
+  {
+    struct pollfd pfd;
+
+    pfd.fd = iListen;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    poll(&pfd, 1, 1000);  // wake up regularly for stats and signals
+
+    if(bStats && GetElapsedSeconds() - dLast >= 10.0)
+    {
+      double dNow = GetElapsedSeconds();
+
+      fprintf(stderr, "relay:  %llu active, %.1f conn/s, %.2f MB/s\n",
+              qwRelayActive,
+              (qwRelayConns - qwLastConns) / (dNow - dLast),
+              (qwRelayBytes - qwLastBytes) / (dNow - dLast) / 1048576.0);
+
+      qwLastBytes = qwRelayBytes;
+      qwLastConns = qwRelayConns;
+      dLast = dNow;
+    }
+
+    for(i1=0; i1 < nThreads && !pW[i1].bFailed; i1++)
+      { }
+
+    if(i1 < nThreads)  // its connections would never be served
+    {
+      iRval = 3;
+      break;
+    }
+
+    if(!(pfd.revents & POLLIN))
+      continue;
+
+    int iClient = accept(iListen, NULL, NULL);
+
+    if(iClient < 0)
+      continue;
+
+    // the worker finishes the connect, so a slow upstream host doesn't
+    // hold up the next accept
+
+    int iUp = socket(pUp->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+
+    if(iUp < 0 ||
+       (connect(iUp, pUp->ai_addr, pUp->ai_addrlen) && errno != EINPROGRESS))
+    {
+      if(bDebug)
+        fprintf(stderr, "relay:  unable to connect upstream (error %d)\n", errno);
+
+      if(iUp >= 0)
+        close(iUp);
+
+      close(iClient);
+      continue;
+    }
+
+    RELAY_CONN *pConn = new RELAY_CONN;
+
+    if(!pConn)
+    {
+      close(iUp);
+      close(iClient);
+      continue;
+    }
+
+    memset(pConn, 0, sizeof(*pConn));
+
+    pConn->aFD[0] = iClient;
+    pConn->aFD[1] = iUp;
+    pConn->bConnecting = TRUE;
+
+    for(i1=0; i1 < 2; i1++)
+    {
+      int iOne = 1;
+
+      memcpy(pConn->aDir[i1].pbSeed, pbSeed, sizeof(pConn->aDir[i1].pbSeed));
+
+      // client -> upstream encrypts, unless '-d'
+      pConn->aDir[i1].bDecrypt = i1 ? !bDecryptFlag : bDecryptFlag;
+
+      pConn->aEnd[i1].pConn = pConn;
+      pConn->aEnd[i1].iSide = i1;
+
+      fcntl(pConn->aFD[i1], F_SETFL, fcntl(pConn->aFD[i1], F_GETFL) | O_NONBLOCK);
+      setsockopt(pConn->aFD[i1], IPPROTO_TCP, TCP_NODELAY, &iOne, sizeof(iOne));
+    }
+
+    __sync_fetch_and_add(&qwRelayConns, 1);
+    __sync_fetch_and_add(&qwRelayActive, 1);
+
+    // hand it off - the worker adds both sockets to its epoll set
+
+    uint64_t qwOne = 1;
+
+    pthread_mutex_lock(&pW[iNext].mtx);
+    pConn->pNext = pW[iNext].pNew;
+    pW[iNext].pNew = pConn;
+    pthread_mutex_unlock(&pW[iNext].mtx);
+
+    if(write(pW[iNext].iEvent, &qwOne, sizeof(qwOne)) < 0 && bDebug)
+      fprintf(stderr, "relay:  eventfd error %d\n", errno);
+
+    iNext = (iNext + 1) % nThreads;
+  }
+
+  if(bStats)
+  {
+    dStart = GetElapsedSeconds() - dStart;
+
+    fprintf(stderr, "relay:  %llu connections, %llu bytes in %.3f sec, "
+                    "%.1f conn/s, %.2f MB/s\n",
+            qwRelayConns, qwRelayBytes, dStart,
+            dStart > 0 ? qwRelayConns / dStart : 0.0,
+            dStart > 0 ? qwRelayBytes / dStart / 1048576.0 : 0.0);
+  }
+
+done:
+
+  // stop the workers.  Connections that are still open are closed when the
+  // process exits; the ones that are only queued are closed here
+
+  for(i1=0; i1 < nStarted; i1++)
+  {
+    uint64_t qwOne = 1;
+
+    pW[i1].bQuit = TRUE;
+
+    if(write(pW[i1].iEvent, &qwOne, sizeof(qwOne)) < 0 && bDebug)
+      fprintf(stderr, "relay:  eventfd error %d\n", errno);
+  }
+
+  for(i1=0; i1 < nStarted; i1++)
+  {
+    pthread_join(pW[i1].thread, NULL);
+
+    while(pW[i1].pNew)
+    {
+      RELAY_CONN *pConn = pW[i1].pNew;
+
+      pW[i1].pNew = pConn->pNext;
+      RelayClose(pConn);
+    }
+
+    close(pW[i1].iEpoll);
+    close(pW[i1].iEvent);
+    pthread_mutex_destroy(&pW[i1].mtx);
+  }
+
+  delete[] pW;
+
+  close(iListen);
+  freeaddrinfo(pUp);
+
+  return(iRval);
+}
+
+// relay load test ('--relay-load=[ECHOPORT:]HOST:PORT').  'nClients'
+// threads each connect to HOST:PORT, send a RELAY_LOAD_MESSAGE byte
+// message, shut down their side, and read until EOF, over and over for
+// RELAY_LOAD_SECONDS.  What comes back must be the same message, so the
+// chain should end in an echo server; with 'ECHOPORT' there's one built
+// in, on localhost:ECHOPORT.  Typically
+//
+//   sftcrypt --relay=9001:localhost:9002 -d -p x &
+//   sftcrypt --relay=9000:localhost:9001 -p x &
+//   sftcrypt --relay-load=9002:localhost:9000 -p x
+//
+// Reports connections/s and throughput (both directions) every second
+// with '--stats', and the totals at the end.
+
+#define RELAY_LOAD_MESSAGE 16384
+#define RELAY_LOAD_SECONDS 10
+
+typedef struct tagECHO_CONN
+{
+  int iFD;
+  BOOL bEOF;
+  UINT cbPending, cbOffset;
+  BYTE cBuf[RELAY_BUFFER_SIZE];
+} ECHO_CONN;
+
+static volatile BOOL bRelayLoadQuit = FALSE;
+static volatile unsigned long long qwLoadConns = 0, qwLoadBytes = 0, qwLoadErrors = 0;
+
+// returns FALSE when it's done (EOF and everything echoed) or on error
+
+static BOOL EchoPump(ECHO_CONN *pE)
+{
+  for(;;)
+  {
+    while(pE->cbPending)
+    {
+      ssize_t cb1 = send(pE->iFD, pE->cBuf + pE->cbOffset, pE->cbPending, MSG_NOSIGNAL);
+
+      if(cb1 < 0)
+        return(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+
+      pE->cbOffset += (UINT)cb1;
+      pE->cbPending -= (UINT)cb1;
+    }
+
+    if(pE->bEOF)
+      return(FALSE);
+
+    ssize_t cb2 = recv(pE->iFD, pE->cBuf, sizeof(pE->cBuf), 0);
+
+    if(cb2 < 0)
+      return(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+
+    if(!cb2)
+      pE->bEOF = TRUE;
+
+    pE->cbOffset = 0;
+    pE->cbPending = (UINT)cb2;
+  }
+}
+
+static void * EchoServerThread(void *pArg)
+{
+  int iListen = (int)(intptr_t)pArg, i1, nEv;
+  int iEpoll = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event sEv, aEv[64];
+
+  sEv.events = EPOLLIN;
+  sEv.data.ptr = NULL;  // the listening socket
+
+  if(iEpoll < 0 || epoll_ctl(iEpoll, EPOLL_CTL_ADD, iListen, &sEv))
+    return(NULL);
+
+  for(;;)
+  {
+    nEv = epoll_wait(iEpoll, aEv, sizeof(aEv) / sizeof(*aEv), -1);
+
+    for(i1=0; i1 < nEv; i1++)
+    {
+      ECHO_CONN *pE = (ECHO_CONN *)aEv[i1].data.ptr;
+
+      if(!pE)
+      {
+        int iFD = accept4(iListen, NULL, NULL, SOCK_NONBLOCK);
+
+        if(iFD < 0)
+          continue;
+
+        pE = new ECHO_CONN;
+        memset(pE, 0, sizeof(*pE));
+        pE->iFD = iFD;
+
+        sEv.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        sEv.data.ptr = pE;
+
+        if(!epoll_ctl(iEpoll, EPOLL_CTL_ADD, iFD, &sEv) && EchoPump(pE))
+          continue;  // (events are edge triggered, so start it now)
+      }
+      else if(!(aEv[i1].events & EPOLLERR) && EchoPump(pE))
+      {
+        continue;
+      }
+
+      close(pE->iFD);  // done, or an error
+      delete pE;
+    }
+  }
+
+  return(NULL);
+}
+
+static void * RelayLoadThread(void *pArg)
+{
+  const struct addrinfo *pAddr = (const struct addrinfo *)pArg;
+  LPBYTE pSend = new BYTE[RELAY_LOAD_MESSAGE];
+  LPBYTE pRecv = new BYTE[2 * RELAY_LOAD_MESSAGE];  // room to notice too much
+  struct timeval tv = { 5, 0 };  // don't wait forever for a lost reply
+  UINT u1, uSeq = 0;
+
+  while(!bRelayLoadQuit)
+  {
+    int iFD = socket(pAddr->ai_family, SOCK_STREAM, 0);
+    UINT cbSent = 0, cbRecv = 0;
+    BOOL bOK = FALSE;
+
+    for(u1=0; u1 < RELAY_LOAD_MESSAGE; u1++)  // different every time
+      pSend[u1] = (BYTE)(u1 * 31 + uSeq);
+
+    uSeq++;
+
+    if(iFD >= 0 &&
+       !setsockopt(iFD, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) &&
+       !connect(iFD, pAddr->ai_addr, pAddr->ai_addrlen))
+    {
+      while(cbSent < RELAY_LOAD_MESSAGE)
+      {
+        ssize_t cb1 = send(iFD, pSend + cbSent, RELAY_LOAD_MESSAGE - cbSent, MSG_NOSIGNAL);
+
+        if(cb1 <= 0)
+          break;
+
+        cbSent += (UINT)cb1;
+      }
+
+      shutdown(iFD, SHUT_WR);
+
+      for(;;)
+      {
+        ssize_t cb1 = recv(iFD, pRecv + cbRecv, 2 * RELAY_LOAD_MESSAGE - cbRecv, 0);
+
+        if(cb1 <= 0)
+        {
+          bOK = !cb1 && cbRecv == RELAY_LOAD_MESSAGE &&
+                !memcmp(pSend, pRecv, RELAY_LOAD_MESSAGE);
+          break;
+        }
+
+        cbRecv += (UINT)cb1;
+
+        if(cbRecv >= 2 * RELAY_LOAD_MESSAGE)
+          break;
+      }
+    }
+
+    if(iFD >= 0)
+      close(iFD);
+
+    if(bOK)
+    {
+      __sync_fetch_and_add(&qwLoadConns, 1);
+      __sync_fetch_and_add(&qwLoadBytes, (unsigned long long)cbSent + cbRecv);
+    }
+    else
+    {
+      __sync_fetch_and_add(&qwLoadErrors, 1);
+      usleep(10000);  // (don't spin if the relay isn't there)
+    }
+  }
+
+  delete[] pSend;
+  delete[] pRecv;
+
+  return(NULL);
+}
+
+int RelayLoadTest(LPCSTR szSpec, int nClients, BOOL bStats)
+{
+  char tbuf[512], *pEcho = NULL, *pHost, *pPort;
+  struct addrinfo sHints, *pAddr = NULL;
+  pthread_t aThread[256];
+  int i1, nStarted = 0;
+
+  // parse [ECHOPORT:]HOST:PORT, from the right
+
+  strncpy(tbuf, szSpec, sizeof(tbuf) - 1);
+  tbuf[sizeof(tbuf) - 1] = 0;
+
+  pPort = strrchr(tbuf, ':');
+
+  if(!pPort)
+  {
+    fprintf(stderr, "INVALID load test specification '%s'\n", szSpec);
+    return(2);
+  }
+
+  *(pPort++) = 0;
+  pHost = strrchr(tbuf, ':');
+
+  if(pHost)
+  {
+    *(pHost++) = 0;
+    pEcho = tbuf;
+  }
+  else
+  {
+    pHost = tbuf;
+  }
+
+  memset(&sHints, 0, sizeof(sHints));
+  sHints.ai_family = AF_UNSPEC;
+  sHints.ai_socktype = SOCK_STREAM;
+
+  if((i1 = getaddrinfo(pHost, pPort, &sHints, &pAddr)))
+  {
+    fprintf(stderr, "Unable to resolve '%s:%s' - %s\n", pHost, pPort, gai_strerror(i1));
+    return(2);
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  if(pEcho)  // the built-in echo server
+  {
+    struct sockaddr_in sAddr;
+    pthread_t thread;
+    int iListen = socket(AF_INET, SOCK_STREAM, 0);
+
+    i1 = 1;
+    memset(&sAddr, 0, sizeof(sAddr));
+    sAddr.sin_family = AF_INET;
+    sAddr.sin_port = htons((unsigned short)atoi(pEcho));
+    sAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if(iListen < 0 ||
+       setsockopt(iListen, SOL_SOCKET, SO_REUSEADDR, &i1, sizeof(i1)) ||
+       bind(iListen, (struct sockaddr *)&sAddr, sizeof(sAddr)) ||
+       listen(iListen, 1024) ||
+       pthread_create(&thread, NULL, EchoServerThread, (void *)(intptr_t)iListen))
+    {
+      fprintf(stderr, "Unable to start the echo server on port '%s' (error %d)\n", pEcho, errno);
+      freeaddrinfo(pAddr);
+      return(3);
+    }
+  }
+
+  if(nClients < 1)
+    nClients = 8;
+  else if(nClients > (int)(sizeof(aThread) / sizeof(*aThread)))
+    nClients = sizeof(aThread) / sizeof(*aThread);
+
+  fprintf(stderr, "load test:  %d clients, %u byte messages, %d seconds\n",
+          nClients, RELAY_LOAD_MESSAGE, RELAY_LOAD_SECONDS);
+
+  double dStart = GetElapsedSeconds(), dLast = dStart;
+  unsigned long long qwLastBytes = 0, qwLastConns = 0;
+
+  for(nStarted=0; nStarted < nClients; nStarted++)
+  {
+    if(pthread_create(aThread + nStarted, NULL, RelayLoadThread, pAddr))
+      break;
+  }
+
+  while(GetElapsedSeconds() - dStart < RELAY_LOAD_SECONDS)
+  {
+    usleep(100000);
+
+    double dNow = GetElapsedSeconds();
+
+    if(bStats && dNow - dLast >= 1.0)
+    {
+      fprintf(stderr, "load:  %.1f conn/s, %.2f MB/s\n",
+              (qwLoadConns - qwLastConns) / (dNow - dLast),
+              (qwLoadBytes - qwLastBytes) / (dNow - dLast) / 1048576.0);
+
+      qwLastBytes = qwLoadBytes;
+      qwLastConns = qwLoadConns;
+      dLast = dNow;
+    }
+  }
+
+  bRelayLoadQuit = TRUE;
+
+  for(i1=0; i1 < nStarted; i1++)
+    pthread_join(aThread[i1], NULL);
+
+  dStart = GetElapsedSeconds() - dStart;
+
+  fprintf(stderr, "load test:  %llu connections (%llu failed), %llu bytes in %.3f sec, "
+                  "%.1f conn/s, %.2f MB/s\n",
+          qwLoadConns, qwLoadErrors, qwLoadBytes, dStart,
+          qwLoadConns / dStart, qwLoadBytes / dStart / 1048576.0);
+
+  freeaddrinfo(pAddr);
+
+  return(qwLoadErrors || !qwLoadConns ? 1 : 0);
+}
+
+#else // __linux__
+
+int RelayConnections(const BYTE *lpDict, LPCSTR szRelay,
+                     const BYTE *pbSeed, UINT cbKeySize, BOOL bDecryptFlag,
+                     int nThreads, BOOL bStats)
+{
+  fprintf(stderr, "'--relay' is not supported on this platform\n");
+  return(2);
+}
+
+int RelayLoadTest(LPCSTR szSpec, int nClients, BOOL bStats)
+{
+  fprintf(stderr, "'--relay-load' is not supported on this platform\n");
+  return(2);
+}
+
+#endif // __linux__
+
+
+
+// NUMA benchmark ('--bench --numa').  For every pair of nodes, a thread
+// running on the CPUs of one node encrypts with the copy of the dictionary
+// on the other, which shows the cost of a cross-socket dictionary.
+
+#define BENCH_BUFFER_SIZE 0x100000 /* 1Mb, for all of the benchmarks */
+
+#ifdef __linux__
+
+#define BENCH_MAX_CPUS 1024
+
+typedef struct tagNUMA_BENCH
+{
+  const BYTE *lpDict;
+  int iNode;      // run on this node's CPUs
+  LPBYTE pBuf;
+  UINT cbMB;
+  double dSeconds;
+} NUMA_BENCH;
+
+static void * NumaBenchThread(void *pArg)
+{
+  NUMA_BENCH *pB = (NUMA_BENCH *)pArg;
+  BOOL abCPU[BENCH_MAX_CPUS];
+  char tbuf[256];
+  cpu_set_t sSet;
+  BYTE pbSeed[16];
+  int i1, nCPU;
+  UINT cb1;
+
+  snprintf(tbuf, sizeof(tbuf), "/sys/devices/system/node/node%d/cpulist", pB->iNode);
+  nCPU = ParseSysList(tbuf, abCPU, BENCH_MAX_CPUS);
+
+  CPU_ZERO(&sSet);
+
+  for(i1=0; i1 < nCPU; i1++)
+  {
+    if(abCPU[i1])
+      CPU_SET(i1, &sSet);
+  }
+
+  if(nCPU)
+    pthread_setaffinity_np(pthread_self(), sizeof(sSet), &sSet);
+
+  memset(pbSeed, 0x5a, sizeof(pbSeed));
+
+  double dStart = GetElapsedSeconds();
+
+  for(cb1=0; cb1 < pB->cbMB; cb1++)
+  {
+    EncryptDataStream2(pB->lpDict, pB->pBuf + cb1 * BENCH_BUFFER_SIZE, BENCH_BUFFER_SIZE,
+                       pbSeed, sizeof(pbSeed), FALSE, 0);
+  }
+
+  pB->dSeconds = GetElapsedSeconds() - dStart;
+
+  return(NULL);
+}
+
+static void BenchmarkNuma(LPBYTE pDict, LPBYTE pBuf, UINT cbMB)
+{
+  BOOL abOnline[64];
+  int i1, i2, nNodes = ParseSysList("/sys/devices/system/node/online", abOnline, 64);
+
+  fprintf(stderr, "NUMA:  %d node(s), %d with a copy of the dictionary\n",
+          nNodes, ReplicateDictionary(pDict));
+
+  fprintf(stderr, "  encrypt MB/s, rows = CPU node, columns = dictionary node\n");
+
+  for(i1=0; i1 < nNodes; i1++)
+  {
+    if(!abOnline[i1])
+      continue;
+
+    fprintf(stderr, "  %3d:", i1);
+
+    for(i2=0; i2 < nNodes; i2++)
+    {
+      NUMA_BENCH sB;
+      pthread_t thread;
+
+      if(!abOnline[i2])
+        continue;
+
+      sB.lpDict = GetNodeDictionary(pDict, i2);
+      sB.iNode = i1;
+      sB.pBuf = pBuf;
+      sB.cbMB = cbMB;
+      sB.dSeconds = 0;
+
+      if(pthread_create(&thread, NULL, NumaBenchThread, &sB))
+        continue;
+
+      pthread_join(thread, NULL);
+
+      fprintf(stderr, " %8.2f", sB.dSeconds > 0 ? cbMB / sB.dSeconds : 0.0);
+    }
+
+    fputs("\n", stderr);
+  }
+}
+
+#else // __linux__
+
+static void BenchmarkNuma(LPBYTE pDict, LPBYTE pBuf, UINT cbMB)
+{
+  fprintf(stderr, "NUMA:  not supported on this platform\n");
+}
+
+#endif // __linux__
+
+
+// in-memory benchmark ('--bench').  Times the dictionary generation, then
+// encrypts and decrypts 'cbMB' megabytes with each of the data formats, 1Mb
+// per call, and checks that the result matches the original.  No I/O.
+
+static const struct
+{
+  LPCSTR szName;
+  LPENCRYPTDATASTREAM lpfn;
+} aBenchCipher[] =
+{
+  { "v2 (EncryptDataStream2)", EncryptDataStream2 },
+  { "v1 (EncryptDataStream) ", EncryptDataStream },
+};
+
+int RunBenchmark(const DWORD *pdwKey, UINT cbMB, BOOL bPerf, BOOL bNuma)
+{
+  BYTE pbSeed[16], pbSeed0[16];
+  LPBYTE pDict = NULL;
+  int i1, iRval = 0, nDict = 20;
+  UINT cb1;
+  double dStart;
+  PERF_COUNTERS *pPerf = bPerf ? PerfCountersOpen() : NULL;
+
+  // dictionary generation
+
+  PerfCountersStart(pPerf);
+  dStart = GetElapsedSeconds();
+
+  for(i1=0; i1 < nDict; i1++)
+  {
+    FreeDictionary(pDict);
+    pDict = BuildKeyDictionary(pdwKey, pbSeed0);
+
+    if(!pDict)
+    {
+      fprintf(stderr, "  Internal error - unable to create dictionary\n");
+      PerfCountersClose(pPerf);
+      return(-1);
+    }
+  }
+
+  PerfCountersStop(pPerf);
+
+  fprintf(stderr, "dictionary:  %.1f usec each\n",
+          (GetElapsedSeconds() - dStart) / nDict * 1e6);
+
+  PerfCountersReport(pPerf, "dictionary (all)", 0);
+
+  if(cbMB > 1024)
+    cbMB = 1024;
+
+  LPBYTE pBuf = new BYTE[cbMB * BENCH_BUFFER_SIZE];
+  LPBYTE pOrig = new BYTE[BENCH_BUFFER_SIZE];
+
+  if(!pBuf || !pOrig)
+  {
+    fprintf(stderr, "Not enough memory to complete the desired operation.\n");
+    PerfCountersClose(pPerf);
+    FreeDictionary(pDict);
+    return(-1);
+  }
+
+  srand(1);  // repeatable, but not compressible or regular
+
+  for(cb1=0; cb1 < BENCH_BUFFER_SIZE; cb1++)
+    pOrig[cb1] = (BYTE)(rand() >> 4);
+
+  for(i1=0; i1 < (int)(sizeof(aBenchCipher) / sizeof(*aBenchCipher)); i1++)
+  {
+    double dEncrypt, dDecrypt;
+
+    for(cb1=0; cb1 < cbMB; cb1++)
+      memcpy(pBuf + cb1 * BENCH_BUFFER_SIZE, pOrig, BENCH_BUFFER_SIZE);
+
+    memcpy(pbSeed, pbSeed0, sizeof(pbSeed));
+    PerfCountersStart(pPerf);
+    dStart = GetElapsedSeconds();
+
+    for(cb1=0; cb1 < cbMB; cb1++)
+    {
+      aBenchCipher[i1].lpfn(pDict, pBuf + cb1 * BENCH_BUFFER_SIZE, BENCH_BUFFER_SIZE,
+                            pbSeed, sizeof(pbSeed), FALSE, 0);
+    }
+
+    dEncrypt = GetElapsedSeconds() - dStart;
+    PerfCountersStop(pPerf);
+
+    memcpy(pbSeed, pbSeed0, sizeof(pbSeed));
+    dStart = GetElapsedSeconds();
+
+    for(cb1=0; cb1 < cbMB; cb1++)
+    {
+      aBenchCipher[i1].lpfn(pDict, pBuf + cb1 * BENCH_BUFFER_SIZE, BENCH_BUFFER_SIZE,
+                            pbSeed, sizeof(pbSeed), TRUE, 0);
+    }
+
+    dDecrypt = GetElapsedSeconds() - dStart;
+
+    for(cb1=0; cb1 < cbMB; cb1++)
+    {
+      if(memcmp(pBuf + cb1 * BENCH_BUFFER_SIZE, pOrig, BENCH_BUFFER_SIZE))
+      {
+        fprintf(stderr, "%s:  ** DECRYPT MISMATCH **\n", aBenchCipher[i1].szName);
+        iRval = 1;
+        break;
+      }
+    }
+
+    fprintf(stderr, "%s:  encrypt %8.2f MB/s (%6.2f ns/byte)  "
+                    "decrypt %8.2f MB/s (%6.2f ns/byte)\n",
+            aBenchCipher[i1].szName,
+            cbMB / dEncrypt, dEncrypt / cbMB / BENCH_BUFFER_SIZE * 1e9,
+            cbMB / dDecrypt, dDecrypt / cbMB / BENCH_BUFFER_SIZE * 1e9);
+
+    PerfCountersReport(pPerf, "encrypt", (double)cbMB * BENCH_BUFFER_SIZE);
+  }
+
+  // dictionary placement - the same dictionary in ordinary heap memory
+  // (4k pages, deliberately not cache line aligned) vs the huge page one.
+  // '--perf' shows the difference in dTLB misses.
+
+  LPBYTE pHeap = new BYTE[2 * 256 * 256 + 64];
+
+  if(pHeap)
+  {
+    static const LPCSTR aszWhere[2] = { "heap dictionary (4k pages)", "huge page dictionary" };
+    const BYTE *apDict[2];
+
+    memcpy(pHeap + 8, pDict, 2 * 256 * 256);
+
+    apDict[0] = pHeap + 8;
+    apDict[1] = pDict;
+
+    for(i1=0; i1 < 2; i1++)
+    {
+      memcpy(pbSeed, pbSeed0, sizeof(pbSeed));
+      PerfCountersStart(pPerf);
+      dStart = GetElapsedSeconds();
+
+      for(cb1=0; cb1 < cbMB; cb1++)
+      {
+        EncryptDataStream2(apDict[i1], pBuf + cb1 * BENCH_BUFFER_SIZE, BENCH_BUFFER_SIZE,
+                           pbSeed, sizeof(pbSeed), FALSE, 0);
+      }
+
+      dStart = GetElapsedSeconds() - dStart;
+      PerfCountersStop(pPerf);
+
+      fprintf(stderr, "%s:  encrypt %8.2f MB/s\n", aszWhere[i1], cbMB / dStart);
+      PerfCountersReport(pPerf, aszWhere[i1], (double)cbMB * BENCH_BUFFER_SIZE);
+    }
+
+    delete [] pHeap;
+  }
+
+  PerfCountersClose(pPerf);
+
+  BenchmarkArmor(pBuf, cbMB * BENCH_BUFFER_SIZE);
+  BenchmarkIovec(pDict, pbSeed0);
+  BenchmarkBufferSizes(pDict, pbSeed0, cbMB);
+
+  if(bNuma)
+    BenchmarkNuma(pDict, pBuf, cbMB < 16 ? cbMB : 16);
+
+  delete [] pBuf;
+  delete [] pOrig;
+  FreeDictionary(pDict);
+
+  return(iRval);
+}
+
+
+
+#ifdef PROFILE_DICT
+
+// dictionary access profiler (see PROFILE_DICT above).  Offsets are relative
+// to the start of the dictionary, which is 2Mb aligned, so 64 byte blocks
+// from the start of it are real cache lines.  Counters aren't atomic, so with several threads
+// running they're approximate (but still good enough for a heat map).
+
+#define PROFILE_LINES (2 * 256 * 256 / 64)
+
+static unsigned long long aqwProfChainTable[256], aqwProfFinalTable[256];
+static unsigned long long aqwProfChainLine[PROFILE_LINES], aqwProfFinalLine[PROFILE_LINES];
+static unsigned long long aqwProfSeed[256];
+static BOOL bProfRegistered = FALSE;
+
+static void ProfileDictReport(void);
+
+static void ProfileDictRegister(void)
+{
+  if(!bProfRegistered)
+  {
+    bProfRegistered = TRUE;
+    atexit(ProfileDictReport);
+  }
+}
+
+void ProfileDictChain(DWORD dwIndex)
+{
+  ProfileDictRegister();
+
+  aqwProfChainTable[(dwIndex >> 8) & 0xff]++;
+  aqwProfChainLine[(dwIndex >> 6) % PROFILE_LINES]++;
+}
+
+void ProfileDictFinal(DWORD dwIndex)
+{
+  ProfileDictRegister();
+
+  aqwProfFinalTable[(dwIndex >> 8) & 0xff]++;
+  aqwProfFinalLine[(dwIndex >> 6) % PROFILE_LINES]++;
+}
+
+void ProfileDictSeed(BYTE bSeed)
+{
+  aqwProfSeed[bSeed]++;
+}
+
+static int __CDECL__ ProfileSortCompare(const void *p1, const void *p2)
+{
+  unsigned long long qw1 = **((unsigned long long **)p1);
+  unsigned long long qw2 = **((unsigned long long **)p2);
+
+  if(qw1 > qw2)
+    return(-1);  // descending
+  else if(qw1 < qw2)
+    return(1);
+
+  return(0);
+}
+
+// one character per counter, scaled to the largest one
+
+static void ProfileHeatMap(LPCSTR szTitle, const unsigned long long *pqw,
+                           int nCount, int nColumns)
+{
+  static const char szScale[] = " .:-=+*#%@";
+  unsigned long long qwMax = 0;
+  int i1;
+
+  for(i1=0; i1 < nCount; i1++)
+  {
+    if(pqw[i1] > qwMax)
+      qwMax = pqw[i1];
+  }
+
+  fprintf(stderr, "  %s (' ' = none, '@' = %llu)\n", szTitle, qwMax);
+
+  for(i1=0; i1 < nCount; i1++)
+  {
+    if(!(i1 % nColumns))
+      fprintf(stderr, "    %5d |", i1);
+
+    if(!pqw[i1])
+      fputc(' ', stderr);
+    else
+      fputc(szScale[1 + (int)((pqw[i1] * (sizeof(szScale) - 3)) / qwMax)], stderr);
+
+    if((i1 % nColumns) == nColumns - 1)
+      fputs("|\n", stderr);
+  }
+}
+
+// tables sorted by hits; how many it takes to cover 50/90/99%, and the top 16
+
+static void ProfileTableSummary(LPCSTR szTitle, unsigned long long *pqw)
+{
+  unsigned long long *apqw[256], qwTotal = 0, qwSum = 0;
+  int i1, aiCover[3] = {0, 0, 0};
+  static const double adCover[3] = {0.5, 0.9, 0.99};
+
+  for(i1=0; i1 < 256; i1++)
+  {
+    apqw[i1] = pqw + i1;
+    qwTotal += pqw[i1];
+  }
+
+  if(!qwTotal)
+    return;
+
+  qsort(apqw, 256, sizeof(*apqw), ProfileSortCompare);
+
+  for(i1=0; i1 < 256; i1++)
+  {
+    int i2;
+
+    qwSum += *(apqw[i1]);
+
+    for(i2=0; i2 < 3; i2++)
+    {
+      if(!aiCover[i2] && qwSum >= adCover[i2] * qwTotal)
+        aiCover[i2] = i1 + 1;
+    }
+  }
+
+  fprintf(stderr, "  %s:  %llu lookups, tables needed for 50%%/90%%/99%%:  %d/%d/%d\n"
+                  "    hottest:",
+          szTitle, qwTotal, aiCover[0], aiCover[1], aiCover[2]);
+
+  for(i1=0; i1 < 16; i1++)
+  {
+    fprintf(stderr, " %d(%.2f%%)", (int)(apqw[i1] - pqw),
+            100.0 * *(apqw[i1]) / qwTotal);
+  }
+
+  fputs("\n", stderr);
+}
+
+static void ProfileDictReport(void)
+{
+  unsigned long long qwSeeds = 0, qwMin = ~0ULL, qwMax = 0;
+  double dChi = 0;
+  int i1, nChainLines = 0, nFinalLines = 0;
+
+  for(i1=0; i1 < PROFILE_LINES; i1++)
+  {
+    nChainLines += aqwProfChainLine[i1] ? 1 : 0;
+    nFinalLines += aqwProfFinalLine[i1] ? 1 : 0;
+  }
+
+  for(i1=0; i1 < 256; i1++)
+  {
+    qwSeeds += aqwProfSeed[i1];
+
+    if(aqwProfSeed[i1] < qwMin)
+      qwMin = aqwProfSeed[i1];
+    if(aqwProfSeed[i1] > qwMax)
+      qwMax = aqwProfSeed[i1];
+  }
+
+  for(i1=0; qwSeeds && i1 < 256; i1++)
+  {
+    double d1 = aqwProfSeed[i1] - qwSeeds / 256.0;
+
+    dChi += d1 * d1 / (qwSeeds / 256.0);
+  }
+
+  fprintf(stderr, "\nDICTIONARY PROFILE\n\n");
+
+  ProfileTableSummary("seed chain", aqwProfChainTable);
+  ProfileTableSummary("final lookup", aqwProfFinalTable);
+
+  fprintf(stderr, "  cache lines touched (of %d):  seed chain %d, final lookup %d\n",
+          PROFILE_LINES, nChainLines, nFinalLines);
+
+  fprintf(stderr, "  final bSeed:  %llu values, min %llu max %llu per value, "
+                  "chi-square %.1f (255 degrees of freedom)\n\n",
+          qwSeeds, qwMin, qwMax, dChi);
+
+  ProfileHeatMap("seed chain hits by table (16 per row)", aqwProfChainTable, 256, 16);
+  ProfileHeatMap("final lookup hits by table (16 per row)", aqwProfFinalTable, 256, 16);
+  ProfileHeatMap("seed chain hits by cache line (encrypt half, then decrypt)",
+                 aqwProfChainLine, PROFILE_LINES, 64);
+  ProfileHeatMap("final lookup hits by cache line (encrypt half, then decrypt)",
+                 aqwProfFinalLine, PROFILE_LINES, 64);
+  ProfileHeatMap("final bSeed values (16 per row)", aqwProfSeed, 256, 16);
+}
+
+#endif // PROFILE_DICT
+
+
+
+// hardware performance counters, via 'perf_event_open()'.  Each counter is
+// opened on its own (not as a group) so that one the CPU doesn't have
+// doesn't take the rest with it.  They're enabled and disabled around the
+// code being measured, and the counts are accumulated until reported.
+// User space only, so 'perf_event_paranoid' up to 2 is fine.
+
+#ifdef __linux__
+
+#define PERF_HW_CACHE(X,Y,Z) ((X) | ((Y) << 8) | ((Z) << 16))
+
+static const struct
+{
+  LPCSTR szName;
+  DWORD dwType;
+  unsigned long long qwConfig;
+} aPerfEvents[] =
+{
+  { "task-clock (ns)", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+  { "cycles",          PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+  { "instructions",    PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+  { "L1D read misses", PERF_TYPE_HW_CACHE,
+                       PERF_HW_CACHE(PERF_COUNT_HW_CACHE_L1D,
+                                     PERF_COUNT_HW_CACHE_OP_READ,
+                                     PERF_COUNT_HW_CACHE_RESULT_MISS) },
+  { "LLC read misses", PERF_TYPE_HW_CACHE,
+                       PERF_HW_CACHE(PERF_COUNT_HW_CACHE_LL,
+                                     PERF_COUNT_HW_CACHE_OP_READ,
+                                     PERF_COUNT_HW_CACHE_RESULT_MISS) },
+  { "dTLB read misses", PERF_TYPE_HW_CACHE,
+                       PERF_HW_CACHE(PERF_COUNT_HW_CACHE_DTLB,
+                                     PERF_COUNT_HW_CACHE_OP_READ,
+                                     PERF_COUNT_HW_CACHE_RESULT_MISS) },
+  { "branch misses",   PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+#define PERF_EVENT_COUNT ((int)(sizeof(aPerfEvents) / sizeof(*aPerfEvents)))
+
+struct tagPERF_COUNTERS
+{
+  int aFD[PERF_EVENT_COUNT];
+  double adCount[PERF_EVENT_COUNT];  // accumulated, scaled for multiplexing
+};
+
+PERF_COUNTERS *PerfCountersOpen(void)
+{
+  PERF_COUNTERS *pRval = new PERF_COUNTERS;
+  int i1, nOpen = 0, iErr = 0;
+
+  if(!pRval)
+    return(NULL);
+
+  for(i1=0; i1 < PERF_EVENT_COUNT; i1++)
+  {
+    struct perf_event_attr sAttr;
+
+    memset(&sAttr, 0, sizeof(sAttr));
+
+    sAttr.size = sizeof(sAttr);
+    sAttr.type = aPerfEvents[i1].dwType;
+    sAttr.config = aPerfEvents[i1].qwConfig;
+    sAttr.disabled = 1;
+    sAttr.exclude_kernel = 1;
+    sAttr.exclude_hv = 1;
+    sAttr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    pRval->aFD[i1] = (int)syscall(SYS_perf_event_open, &sAttr, 0, -1, -1, 0);
+    pRval->adCount[i1] = 0;
+
+    if(pRval->aFD[i1] >= 0)
+      nOpen++;
+    else if(aPerfEvents[i1].dwType != PERF_TYPE_SOFTWARE && !iErr)
+      iErr = errno;
+  }
+
+  if(iErr)
+  {
+    fprintf(stderr, "perf:  some hardware counters are not available (error %d)%s\n",
+            iErr, iErr == EACCES || iErr == EPERM
+                  ? " - check /proc/sys/kernel/perf_event_paranoid"
+                  : iErr == ENOENT || iErr == EOPNOTSUPP
+                  ? " - no hardware PMU (virtual machine?)" : "");
+  }
+
+  if(!nOpen)
+  {
+    delete pRval;
+    return(NULL);
+  }
+
+  return(pRval);
+}
+
+void PerfCountersStart(PERF_COUNTERS *pPerf)
+{
+  int i1;
+
+  if(!pPerf)
+    return;
+
+  for(i1=0; i1 < PERF_EVENT_COUNT; i1++)
+  {
+    if(pPerf->aFD[i1] >= 0)
+      ioctl(pPerf->aFD[i1], PERF_EVENT_IOC_ENABLE, 0);
+  }
+}
+
+void PerfCountersStop(PERF_COUNTERS *pPerf)
+{
+  int i1;
+
+  if(!pPerf)
+    return;
+
+  for(i1=0; i1 < PERF_EVENT_COUNT; i1++)
+  {
+    if(pPerf->aFD[i1] >= 0)
+      ioctl(pPerf->aFD[i1], PERF_EVENT_IOC_DISABLE, 0);
+  }
+
+  for(i1=0; i1 < PERF_EVENT_COUNT; i1++)
+  {
+    unsigned long long aqw[3];  // value, time enabled, time running
+
+    if(pPerf->aFD[i1] < 0 || read(pPerf->aFD[i1], aqw, sizeof(aqw)) != sizeof(aqw))
+      continue;
+
+    if(aqw[2])
+      pPerf->adCount[i1] += (double)aqw[0] * ((double)aqw[1] / (double)aqw[2]);
+
+    ioctl(pPerf->aFD[i1], PERF_EVENT_IOC_RESET, 0);
+  }
+}
+
+// prints the accumulated counts (per byte, when 'dBytes' isn't zero)
+// and then starts over
+
+void PerfCountersReport(PERF_COUNTERS *pPerf, LPCSTR szWhat, double dBytes)
+{
+  int i1;
+
+  if(!pPerf)
+    return;
+
+  fprintf(stderr, "perf %s:\n", szWhat);
+
+  if(pPerf->aFD[1] >= 0 && pPerf->aFD[2] >= 0 && pPerf->adCount[1] > 0)
+  {
+    fprintf(stderr, "  %-18s %14.2f\n", "instructions/cycle",
+            pPerf->adCount[2] / pPerf->adCount[1]);
+  }
+
+  for(i1=0; i1 < PERF_EVENT_COUNT; i1++)
+  {
+    if(pPerf->aFD[i1] < 0)
+      fprintf(stderr, "  %-18s %14s\n", aPerfEvents[i1].szName, "n/a");
+    else if(dBytes > 0)
+      fprintf(stderr, "  %-18s %14.0f  %10.4f/byte\n", aPerfEvents[i1].szName,
+              pPerf->adCount[i1], pPerf->adCount[i1] / dBytes);
+    else
+      fprintf(stderr, "  %-18s %14.0f\n", aPerfEvents[i1].szName, pPerf->adCount[i1]);
+
+    pPerf->adCount[i1] = 0;
+  }
+}
+
+void PerfCountersClose(PERF_COUNTERS *pPerf)
+{
+  int i1;
+
+  if(!pPerf)
+    return;
+
+  for(i1=0; i1 < PERF_EVENT_COUNT; i1++)
+  {
+    if(pPerf->aFD[i1] >= 0)
+      close(pPerf->aFD[i1]);
+  }
+
+  delete pPerf;
+}
+
+#else // __linux__
+
+PERF_COUNTERS *PerfCountersOpen(void)
+{
+  fprintf(stderr, "perf:  performance counters are not supported on this platform\n");
+  return(NULL);
+}
+
+void PerfCountersStart(PERF_COUNTERS *pPerf) { }
+void PerfCountersStop(PERF_COUNTERS *pPerf) { }
+void PerfCountersReport(PERF_COUNTERS *pPerf, LPCSTR szWhat, double dBytes) { }
+void PerfCountersClose(PERF_COUNTERS *pPerf) { }
+
+#endif // __linux__
+
+
+
+// dictionary memory (see 'AllocDictionary()' prototype).  Each dictionary
+// gets its own 2Mb aligned mapping, with MADV_HUGEPAGE so that the kernel
+// backs it with a single huge page where it can.  A 128k dictionary in
+// 4k pages spreads every lookup over 32 TLB entries.  The mappings are
+// kept in a list along with their size and NUMA replicas.  Entries are
+// never freed, only re-used, so 'GetNodeDictionary()' can walk the list
+// without the lock while another thread adds or frees a dictionary.
+
+#define DICT_ALIGN 0x200000 /* 2Mb */
+#define DICT_MAX_NODES 64
+
+typedef struct tagDICT_MAP
+{
+  LPBYTE volatile pDict;               // NULL when the entry is free
+  size_t cbMap;                        // the mapping
+  size_t cbSize;                       // what's in it (to clear)
+  volatile int nNodes;                 // replicas, indexed by node
+  LPBYTE apReplica[DICT_MAX_NODES];
+  struct tagDICT_MAP *pNext;
+} DICT_MAP;
+
+static DICT_MAP * volatile pDictMap = NULL;
+
+#ifndef WIN32
+static pthread_mutex_t mtxDictMap = PTHREAD_MUTEX_INITIALIZER;
+#endif // WIN32
+
+static DICT_MAP *FindDictionaryMap(const BYTE *pDict)
+{
+  DICT_MAP *pM;
+
+  for(pM = __atomic_load_n(&pDictMap, __ATOMIC_ACQUIRE); pM; pM = pM->pNext)
+  {
+    if(__atomic_load_n(&pM->pDict, __ATOMIC_ACQUIRE) == pDict)
+      return(pM);
+  }
+
+  return(NULL);
+}
+
+static LPBYTE AllocDictionaryMap(size_t cbMap, int iNode)
+{
+#ifdef WIN32
+
+  return((LPBYTE)_aligned_malloc(cbMap, DICT_ALIGN));
+
+#else // WIN32
+
+  // over-allocate so there's a 2Mb boundary to start on, then trim
+
+  LPBYTE p1 = (LPBYTE)mmap(NULL, cbMap + DICT_ALIGN, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if(p1 == (LPBYTE)MAP_FAILED)
+    return(NULL);
+
+  LPBYTE pRval = (LPBYTE)(((size_t)p1 + DICT_ALIGN - 1) & ~(size_t)(DICT_ALIGN - 1));
+
+  if(pRval > p1)
+    munmap(p1, pRval - p1);
+
+  munmap(pRval + cbMap, (p1 + DICT_ALIGN) - pRval);
+
+#ifdef MADV_HUGEPAGE
+  madvise(pRval, cbMap, MADV_HUGEPAGE);
+#endif // MADV_HUGEPAGE
+
+#ifdef __linux__
+  if(iNode >= 0)  // bind BEFORE anything touches it
+  {
+    unsigned long aulMask[DICT_MAX_NODES / (8 * sizeof(unsigned long)) + 1];
+
+    memset(aulMask, 0, sizeof(aulMask));
+    aulMask[iNode / (8 * sizeof(unsigned long))] |= 1UL << (iNode % (8 * sizeof(unsigned long)));
+
+    if(syscall(SYS_mbind, pRval, cbMap, MPOL_BIND, aulMask,
+               (unsigned long)(8 * sizeof(aulMask)), 0) && bDebug)
+    {
+      fprintf(stderr, "mbind to node %d failed (error %d)\n", iNode, errno);
+    }
+  }
+#endif // __linux__
+
+  return(pRval);
+
+#endif // WIN32
+}
+
+// NOTE:  key material, so the part that was used is cleared first.  The
+// rest of the mapping was never touched, and clearing it would only fault
+// it in.
+
+static void FreeDictionaryMap(LPBYTE pDict, size_t cbSize, size_t cbMap)
+{
+  memset(pDict, 0, cbSize);
+
+#ifdef WIN32
+  _aligned_free(pDict);
+#else // WIN32
+  munmap(pDict, cbMap);
+#endif // WIN32
+}
+
+LPBYTE AllocDictionary(DWORD cbSize)
+{
+  size_t cbMap = ((size_t)cbSize + DICT_ALIGN - 1) & ~(size_t)(DICT_ALIGN - 1);
+  LPBYTE pRval = AllocDictionaryMap(cbMap, -1);
+  DICT_MAP *pM;
+
+  if(!pRval)
+    return(NULL);
+
+#ifndef WIN32
+  pthread_mutex_lock(&mtxDictMap);
+#endif // WIN32
+
+  for(pM = pDictMap; pM && pM->pDict; pM = pM->pNext)
+    { }
+
+  if(!pM)  // a new entry, at the front
+  {
+    pM = new DICT_MAP;
+
+    if(pM)
+    {
+      memset(pM, 0, sizeof(*pM));
+      pM->pNext = pDictMap;
+      __atomic_store_n(&pDictMap, pM, __ATOMIC_RELEASE);
+    }
+  }
+
+  if(pM)
+  {
+    pM->cbMap = cbMap;
+    pM->cbSize = cbSize;
+    pM->nNodes = 0;
+    memset(pM->apReplica, 0, sizeof(pM->apReplica));
+
+    __atomic_store_n(&pM->pDict, pRval, __ATOMIC_RELEASE);  // last
+  }
+
+#ifndef WIN32
+  pthread_mutex_unlock(&mtxDictMap);
+#endif // WIN32
+
+  if(!pM)
+  {
+    FreeDictionaryMap(pRval, 0, cbMap);
+    return(NULL);
+  }
+
+  return(pRval);
+}
+
+void FreeDictionary(LPBYTE pDict)
+{
+  DICT_MAP *pM;
+  int i2;
+
+  if(!pDict)
+    return;
+
+#ifndef WIN32
+  pthread_mutex_lock(&mtxDictMap);
+#endif // WIN32
+
+  pM = FindDictionaryMap(pDict);
+
+  if(pM)
+  {
+    __atomic_store_n(&pM->pDict, (LPBYTE)NULL, __ATOMIC_RELEASE);
+
+    FreeDictionaryMap(pDict, pM->cbSize, pM->cbMap);
+
+    for(i2=0; i2 < pM->nNodes; i2++)
+    {
+      if(pM->apReplica[i2] && pM->apReplica[i2] != pDict)
+        FreeDictionaryMap(pM->apReplica[i2], pM->cbSize, pM->cbMap);
+    }
+  }
+
+#ifndef WIN32
+  pthread_mutex_unlock(&mtxDictMap);
+#endif // WIN32
+}
+
+
+// NUMA nodes and CPUs are listed in /sys as '0-3' or '0,2-3' etc.  Returns
+// the highest number + 1, and sets 'pbOnline[n]' for each one listed.
+
+int ParseSysList(LPCSTR szFile, BOOL *pbOnline, int nMax)
+{
+  char tbuf[256], *p1;
+  int iRval = 0;
+  FILE *pF = fopen(szFile, "r");
+
+  memset(pbOnline, 0, nMax * sizeof(*pbOnline));
+
+  if(!pF)
+    return(0);
+
+  if(!fgets(tbuf, sizeof(tbuf), pF))
+    tbuf[0] = 0;
+
+  fclose(pF);
+
+  for(p1=tbuf; *p1 >= '0' && *p1 <= '9'; )
+  {
+    int i1 = strtol(p1, &p1, 10), i2 = i1;
+
+    if(*p1 == '-')
+      i2 = strtol(p1 + 1, &p1, 10);
+
+    for(; i1 <= i2 && i1 < nMax; i1++)
+    {
+      pbOnline[i1] = TRUE;
+
+      if(i1 >= iRval)
+        iRval = i1 + 1;
+    }
+
+    if(*p1 == ',')
+      p1++;
+  }
+
+  return(iRval);
+}
+
+// make a copy of the dictionary on every NUMA node (the original stays
+// wherever it is, and is used for node 0).  Returns the number of nodes
+// that have a copy, which is 1 on a machine without NUMA.
+
+int ReplicateDictionary(LPBYTE pDict)
+{
+#ifdef __linux__
+
+  BOOL abOnline[DICT_MAX_NODES];
+  int i2, nNodes, nRval = 1;
+  DICT_MAP *pM;
+
+  nNodes = ParseSysList("/sys/devices/system/node/online", abOnline, DICT_MAX_NODES);
+
+  if(nNodes <= 1)
+    return(1);
+
+  pthread_mutex_lock(&mtxDictMap);
+
+  pM = FindDictionaryMap(pDict);
+
+  if(pM && !pM->nNodes)
+  {
+    pM->apReplica[0] = pDict;
+
+    for(i2=1; i2 < nNodes; i2++)
+    {
+      if(!abOnline[i2])
+        continue;
+
+      pM->apReplica[i2] = AllocDictionaryMap(pM->cbMap, i2);
+
+      if(pM->apReplica[i2])
+      {
+        memcpy(pM->apReplica[i2], pDict, pM->cbSize);
+        nRval++;
+      }
+    }
+
+    __atomic_store_n(&pM->nNodes, nNodes, __ATOMIC_RELEASE);  // last
+  }
+
+  pthread_mutex_unlock(&mtxDictMap);
+
+  return(nRval);
+
+#else // __linux__
+
+  return(1);
+
+#endif // __linux__
+}
+
+// the copy of the dictionary on NUMA node 'iNode', or 'pDict' if none.
+// No lock - the replicas are all there before 'nNodes' is set, and don't
+// change until the dictionary is freed
+
+const BYTE *GetNodeDictionary(const BYTE *pDict, int iNode)
+{
+  DICT_MAP *pM;
+
+  if(iNode < 0 || iNode >= DICT_MAX_NODES)
+    return(pDict);
+
+  pM = FindDictionaryMap(pDict);
+
+  if(pM && iNode < __atomic_load_n(&pM->nNodes, __ATOMIC_ACQUIRE) && pM->apReplica[iNode])
+    return(pM->apReplica[iNode]);
+
+  return(pDict);
+}
+
+// the copy for the node this thread is running on.  This is called for
+// every chunk, so without replicas (no '--numa') it doesn't ask, and
+// otherwise it asks glibc's 'getcpu()', which uses the vDSO (no system call)
+
+const BYTE *GetLocalDictionary(const BYTE *pDict)
+{
+#ifdef __linux__
+
+  DICT_MAP *pM = FindDictionaryMap(pDict);
+  unsigned int uCPU, uNode;
+  int nNodes;
+
+  if(!pM || (nNodes = __atomic_load_n(&pM->nNodes, __ATOMIC_ACQUIRE)) <= 1)
+    return(pDict);
+
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 29)
+  if(getcpu(&uCPU, &uNode))
+#else // older glibc - no wrapper
+  if(syscall(SYS_getcpu, &uCPU, &uNode, NULL))
+#endif // __GLIBC__
+    return(pDict);
+
+  if((int)uNode < nNodes && pM->apReplica[uNode])
+    return(pM->apReplica[uNode]);
+
+  return(pDict);
+
+#else // __linux__
+
+  return(pDict);
+
+#endif // __linux__
+}
+
+
+// git long-running filter process ('--git-filter').  Configured as
+//
+//   git config filter.sftcrypt.process "sftcrypt --git-filter -p 'phrase'"
+//
+// git starts ONE of these per command and sends every blob through it, so
+// the key and dictionary are only set up once.  The protocol is 'pkt-line':
+// a 4 digit hex length (which includes the 4 digits) followed by the data,
+// and '0000' is a 'flush' that ends a list or the content.  After the
+// handshake, each blob arrives as 'command=clean|smudge', 'pathname=...'
+// (and maybe more), a flush, the content, and a flush.  The reply is
+// 'status=success', a flush, the content, a flush, and an empty list (flush)
+// to say that the status didn't change.
+//
+// 'clean' (into the repository) encrypts, and 'smudge' (into the working
+// tree) decrypts.  Every blob starts with the key's seed, exactly like a
+// separate 'sftcrypt' run for that file, so the output is the same and a
+// 'clean' of an unchanged file always gives the same blob.  git writes all
+// of the content before it reads any of the reply, so the blob is kept in
+// memory:  'clean' encrypts each packet as it arrives, and 'smudge' decrypts
+// the whole thing in parallel once it's complete.
+
+#define PKT_MAX_DATA 65516 /* 65520 byte packets, less the length */
+
+// read a packet into 'pBuf' (which must hold PKT_MAX_DATA + 1 bytes).
+// returns the data length, 0 for a flush, or -1 on EOF or a bad packet.
+// Text packets are zero terminated without the trailing LF.
+
+static int PktRead(FILE *pIN, char *pBuf, BOOL bText)
+{
+  char tbuf[5];
+  char *pEnd;
+  int cb1;
+
+  if(fread(tbuf, 1, 4, pIN) != 4)
+    return(-1);
+
+  tbuf[4] = 0;
+  cb1 = (int)strtol(tbuf, &pEnd, 16);
+
+  if(*pEnd || cb1 == 1 || cb1 == 2 || cb1 == 3 || cb1 > PKT_MAX_DATA + 4)
+    return(-1);
+
+  if(!cb1) // flush
+    return(0);
+
+  cb1 -= 4;
+
+  if(cb1 && fread(pBuf, 1, cb1, pIN) != (size_t)cb1)
+    return(-1);
+
+  if(bText)
+  {
+    if(cb1 && pBuf[cb1 - 1] == '\n')
+      cb1--;
+
+    pBuf[cb1] = 0;
+
+    if(!cb1)
+      cb1 = -1;  // an empty text line isn't allowed
+  }
+
+  return(cb1);
+}
+
+static int PktWrite(FILE *pOUT, const void *pData, UINT cbData)
+{
+  if(fprintf(pOUT, "%04x", cbData + 4) != 4 ||
+     fwrite(pData, 1, cbData, pOUT) != cbData)
+  {
+    return(-1);
+  }
+
+  return(0);
+}
+
+static int PktWriteText(FILE *pOUT, LPCSTR szText)
+{
+  return(fprintf(pOUT, "%04x%s\n", (UINT)strlen(szText) + 5, szText) < 0 ? -1 : 0);
+}
+
+static int PktFlush(FILE *pOUT, BOOL bSend)
+{
+  if(fputs("0000", pOUT) == EOF)
+    return(-1);
+
+  return(bSend && fflush(pOUT) ? -1 : 0);
+}
+
+// read a list of 'key=value' lines up to the flush, returning the value of
+// 'szKey' in 'szVal' (if it's there).  returns -1 on EOF or error
+
+static int PktReadList(FILE *pIN, char *pBuf, LPCSTR szKey, char *szVal, UINT cbVal)
+{
+  int cb1, nLines = 0;
+  UINT cbKey = szKey ? strlen(szKey) : 0;
+
+  while((cb1 = PktRead(pIN, pBuf, TRUE)) > 0)
+  {
+    nLines++;
+
+    if(cbKey && !strncmp(pBuf, szKey, cbKey) && pBuf[cbKey] == '=')
+    {
+      strncpy(szVal, pBuf + cbKey + 1, cbVal - 1);
+      szVal[cbVal - 1] = 0;
+    }
+  }
+
+  return(cb1 < 0 ? -1 : nLines);
+}
+
+int GitFilterProcess(const BYTE *lpDict, const BYTE *pbSeed0, UINT cbKeySize,
+                     int nThreads, BOOL bStats)
+{
+  FILE *pIN = stdin, *pOUT = stdout;
+  char *pBuf = new char[PKT_MAX_DATA + 1];
+  char szCommand[32], szPath[1024];
+  LPBYTE pData = NULL;
+  UINT cbData, cbMax = 0;
+  BYTE pbSeed[16];
+  BOOL bClean, bCanClean = FALSE, bCanSmudge = FALSE;
+  double dStart = GetElapsedSeconds(), dTotal = 0;
+  UINT nBlobs = 0;
+  int cb1, iRval = 0;
+
+  if(!pBuf || cbKeySize > sizeof(pbSeed))
+  {
+    fprintf(stderr, "Not enough memory to complete the desired operation.\n");
+    return(-1);
+  }
+
+  _setmode(_fileno(stdin), _O_BINARY);
+  _setmode(_fileno(stdout), _O_BINARY);
+
+  // handshake - 'git-filter-client' and the versions, then the capabilities
+
+  szCommand[0] = 0;
+
+  if(PktRead(pIN, pBuf, TRUE) < 0 || strcmp(pBuf, "git-filter-client") ||
+     PktReadList(pIN, pBuf, "version", szCommand, sizeof(szCommand)) < 0 ||
+     strcmp(szCommand, "2"))
+  {
+    fprintf(stderr, "sftcrypt:  not a git filter client (version 2)\n");
+    delete[] pBuf;
+    return(2);
+  }
+
+  if(PktWriteText(pOUT, "git-filter-server") || PktWriteText(pOUT, "version=2") ||
+     PktFlush(pOUT, TRUE))
+  {
+    goto write_error;
+  }
+
+  while((cb1 = PktRead(pIN, pBuf, TRUE)) > 0)
+  {
+    if(!strcmp(pBuf, "capability=clean"))
+      bCanClean = TRUE;
+    else if(!strcmp(pBuf, "capability=smudge"))
+      bCanSmudge = TRUE;
+  }
+
+  if(cb1 < 0)
+  {
+    delete[] pBuf;
+    return(2);
+  }
+
+  if((bCanClean && PktWriteText(pOUT, "capability=clean")) ||
+     (bCanSmudge && PktWriteText(pOUT, "capability=smudge")) ||
+     PktFlush(pOUT, TRUE))
+  {
+    goto write_error;
+  }
+
+  // one blob at a time until git closes the pipe
+
+  while(1)
+  {
+    szCommand[0] = szPath[0] = 0;
+
+    cb1 = PktRead(pIN, pBuf, TRUE);
+
+    if(cb1 < 0)  // EOF - we're done
+      break;
+
+    if(cb1 > 0 && !strncmp(pBuf, "command=", 8))
+    {
+      strncpy(szCommand, pBuf + 8, sizeof(szCommand) - 1);
+      szCommand[sizeof(szCommand) - 1] = 0;
+    }
+
+    if(cb1 > 0 &&
+       PktReadList(pIN, pBuf, "pathname", szPath, sizeof(szPath)) < 0)
+    {
+      iRval = 2;
+      break;
+    }
+
+    bClean = !strcmp(szCommand, "clean");
+
+    if(!bClean && strcmp(szCommand, "smudge"))
+    {
+      fprintf(stderr, "sftcrypt:  unknown git filter command '%s'\n", szCommand);
+      iRval = 2;
+      break;
+    }
+
+    memcpy(pbSeed, pbSeed0, cbKeySize);
+    cbData = 0;
+
+    while((cb1 = PktRead(pIN, pBuf, FALSE)) > 0)
+    {
+      if(cbData + cb1 > cbMax)
+      {
+        UINT cbNew = cbMax ? cbMax : 0x10000;
+
+        while(cbNew && cbNew < cbData + cb1)
+          cbNew <<= 1;
+
+        LPBYTE pNew = cbNew ? (LPBYTE)realloc(pData, cbNew) : NULL;
+
+        if(!pNew)
+        {
+          fprintf(stderr, "sftcrypt:  '%s' is too large\n", szPath);
+          iRval = -1;
+          break;
+        }
+
+        pData = pNew;
+        cbMax = cbNew;
+      }
+
+      memcpy(pData + cbData, pBuf, cb1);
+
+      if(bClean)  // while it's still in the cache
+        lpfnEncryptDataStream(lpDict, pData + cbData, cb1, pbSeed, cbKeySize, FALSE, 0);
+
+      cbData += cb1;
+    }
+
+    if(iRval || cb1 < 0)
+    {
+      if(!iRval)
+        iRval = 2;  // git went away in the middle of the content
+
+      break;
+    }
+
+    if(!bClean)
+      DecryptDataParallel(lpDict, pData, cbData, pbSeed, cbKeySize, nThreads);
+
+    if(bDebug)
+      fprintf(stderr, "sftcrypt:  %s '%s' %u bytes\n", szCommand, szPath, cbData);
+
+    if(PktWriteText(pOUT, "status=success") || PktFlush(pOUT, FALSE))
+      goto write_error;
+
+    for(UINT cb2=0; cb2 < cbData; cb2 += PKT_MAX_DATA)
+    {
+      if(PktWrite(pOUT, pData + cb2,
+                  cbData - cb2 > PKT_MAX_DATA ? PKT_MAX_DATA : cbData - cb2))
+      {
+        goto write_error;
+      }
+    }
+
+    if(PktFlush(pOUT, FALSE) || PktFlush(pOUT, TRUE)) // content, then (unchanged) status
+      goto write_error;
+
+    nBlobs++;
+    dTotal += cbData;
+  }
+
+  if(bStats)
+  {
+    dStart = GetElapsedSeconds() - dStart;
+
+    fprintf(stderr, "git filter:  %u blobs, %.0f bytes in %.3f sec, %.2f MB/s\n",
+            nBlobs, dTotal, dStart, dStart > 0 ? dTotal / dStart / 1048576.0 : 0.0);
+  }
+
+  if(pData)
+  {
+    memset(pData, 0, cbMax); // no plain text left lying around
+    free(pData);
+  }
+
+  delete[] pBuf;
+
+  return(iRval);
+
+write_error:
+
+  fprintf(stderr, "sftcrypt:  write error on git filter pipe\n");
+
+  if(pData)
+  {
+    memset(pData, 0, cbMax);
+    free(pData);
+  }
+
+  delete[] pBuf;
+
+  return(3);
+}
+
+
+// content-defined chunking backup ('--backup=STORE', '--restore=STORE').
+// The input is cut into chunks (16k to 256k, 64k on average) where a
+// rolling 'gear' hash of the last 64 bytes has 16 zero bits, so the cut
+// points depend only on the content around them:  an insert or a change
+// only affects the chunks that it touches.  Each chunk is stored in 'STORE'
+// under a name derived from its contents, and is encrypted with a seed
+// derived (with the key) from the SHA-256 of its plain text, so the same
+// chunk always gives the same file and is only stored once.  The manifest,
+// the list of chunks (name, digest and size), is encrypted with the key
+// like any other file and written to the output.  Restoring decrypts the
+// manifest, then each chunk, and checks each one's SHA-256.
+//
+// The work is done 16Mb at a time.  Since a cut point only depends on
+// the 64 bytes before it, the candidate cut points can be found in
+// parallel, with a quick serial pass to apply the min/max sizes.  Then
+// each chunk is hashed, encrypted (in place) and written by 'nThreads'
+// threads, and the manifest entries are added in order.
+
+#define CHUNK_MIN_SIZE  0x4000    /* 16k */
+#define CHUNK_MAX_SIZE  0x40000   /* 256k */
+#define CHUNK_MASK      0xffff000000000000ULL /* 16 bits, 64k average */
+#define CHUNK_BATCH     0x1000000 /* 16Mb */
+#define CHUNK_THREADS   64
+
+#define MANIFEST_HEADER "sftcrypt manifest 1\n"
+
+typedef unsigned long long QWORD;
+
+typedef struct tagSHA256_CTX
+{
+  DWORD adwState[8];
+  BYTE abBuf[64];
+  QWORD cbTotal;
+} SHA256_CTX;
+
+static const DWORD adwSha256K[64] =
+{
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define SHA_ROR(X,N) (((X) >> (N)) | ((X) << (32 - (N))))
+
+static void Sha256Block(DWORD *pdwState, const BYTE *pbBlock)
+{
+  DWORD adwW[64], a, b, c, d, e, f, g, h, t1, t2;
+  int i1;
+
+  for(i1=0; i1 < 16; i1++)
+  {
+    adwW[i1] = ((DWORD)pbBlock[i1 * 4] << 24) | ((DWORD)pbBlock[i1 * 4 + 1] << 16)
+             | ((DWORD)pbBlock[i1 * 4 + 2] << 8) | pbBlock[i1 * 4 + 3];
+  }
+
+  for(; i1 < 64; i1++)
+  {
+    t1 = adwW[i1 - 2];
+    t2 = adwW[i1 - 15];
+
+    adwW[i1] = (SHA_ROR(t1, 17) ^ SHA_ROR(t1, 19) ^ (t1 >> 10)) + adwW[i1 - 7]
+             + (SHA_ROR(t2, 7) ^ SHA_ROR(t2, 18) ^ (t2 >> 3)) + adwW[i1 - 16];
+  }
+
+  a = pdwState[0]; b = pdwState[1]; c = pdwState[2]; d = pdwState[3];
+  e = pdwState[4]; f = pdwState[5]; g = pdwState[6]; h = pdwState[7];
+
+  for(i1=0; i1 < 64; i1++)
+  {
+    t1 = h + (SHA_ROR(e, 6) ^ SHA_ROR(e, 11) ^ SHA_ROR(e, 25)) + ((e & f) ^ (~e & g))
+       + adwSha256K[i1] + adwW[i1];
+    t2 = (SHA_ROR(a, 2) ^ SHA_ROR(a, 13) ^ SHA_ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+
+    h = g; g = f; f = e; e = d + t1;
+    d = c; c = b; b = a; a = t1 + t2;
+  }
+
+  pdwState[0] += a; pdwState[1] += b; pdwState[2] += c; pdwState[3] += d;
+  pdwState[4] += e; pdwState[5] += f; pdwState[6] += g; pdwState[7] += h;
+}
+
+#undef SHA_ROR
+
+static void Sha256Init(SHA256_CTX *pCtx)
+{
+  static const DWORD adwInit[8] =
+  {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+
+  memcpy(pCtx->adwState, adwInit, sizeof(pCtx->adwState));
+  pCtx->cbTotal = 0;
+}
+
+static void Sha256Update(SHA256_CTX *pCtx, const BYTE *pbData, UINT cbData)
+{
+  UINT cbBuf = (UINT)(pCtx->cbTotal & 63);
+
+  pCtx->cbTotal += cbData;
+
+  if(cbBuf)  // finish the partial block first
+  {
+    UINT cb1 = 64 - cbBuf < cbData ? 64 - cbBuf : cbData;
+
+    memcpy(pCtx->abBuf + cbBuf, pbData, cb1);
+    pbData += cb1;
+    cbData -= cb1;
+
+    if(cbBuf + cb1 < 64)
+      return;
+
+    Sha256Block(pCtx->adwState, pCtx->abBuf);
+  }
+
+  for(; cbData >= 64; pbData += 64, cbData -= 64)
+    Sha256Block(pCtx->adwState, pbData);
+
+  if(cbData)
+    memcpy(pCtx->abBuf, pbData, cbData);
+}
+
+static void Sha256Final(SHA256_CTX *pCtx, BYTE *pbDigest)
+{
+  QWORD cbBits = pCtx->cbTotal * 8;
+  BYTE abPad[72];
+  UINT cbPad = 64 - (UINT)((pCtx->cbTotal + 8) & 63), i1;
+
+  memset(abPad, 0, sizeof(abPad));
+  abPad[0] = 0x80;
+
+  for(i1=0; i1 < 8; i1++)
+    abPad[cbPad + i1] = (BYTE)(cbBits >> (56 - 8 * i1));
+
+  Sha256Update(pCtx, abPad, cbPad + 8);
+
+  for(i1=0; i1 < 32; i1++)
+    pbDigest[i1] = (BYTE)(pCtx->adwState[i1 / 4] >> (24 - 8 * (i1 & 3)));
+}
+
+static void Sha256(const BYTE *pbData, UINT cbData, BYTE *pbDigest)
+{
+  SHA256_CTX sCtx;
+
+  Sha256Init(&sCtx);
+  Sha256Update(&sCtx, pbData, cbData);
+  Sha256Final(&sCtx, pbDigest);
+}
+
+static void HexString(const BYTE *pbData, UINT cbData, char *szHex)
+{
+  static const char szDigits[] = "0123456789abcdef";
+
+  while(cbData--)
+  {
+    *(szHex++) = szDigits[*pbData >> 4];
+    *(szHex++) = szDigits[*(pbData++) & 15];
+  }
+
+  *szHex = 0;
+}
+
+static BOOL ParseHexString(LPCSTR szHex, BYTE *pbData, UINT cbData)
+{
+  UINT i1;
+
+  for(i1=0; i1 < cbData * 2; i1++)
+  {
+    char c1 = szHex[i1];
+    int iVal = c1 >= '0' && c1 <= '9' ? c1 - '0' :
+               c1 >= 'a' && c1 <= 'f' ? c1 - 'a' + 10 : -1;
+
+    if(iVal < 0)
+      return(FALSE);
+
+    if(i1 & 1)
+      pbData[i1 / 2] |= (BYTE)iVal;
+    else
+      pbData[i1 / 2] = (BYTE)(iVal << 4);
+  }
+
+  return(TRUE);
+}
+
+// the chunk's seed and its name in the store, from the digest of its plain
+// text.  Encrypting the digest (from the key's seed) leaves the chunk's seed
+// in the seed ring; the name is the SHA-256 of the encrypted digest, so it
+// says nothing about the contents without the key.
+
+static void ChunkSeedAndName(const BYTE *lpDict, const BYTE *pbKeySeed,
+                             const BYTE *pbDigest, BYTE *pbSeed, BYTE *pbName)
+{
+  BYTE abTemp[32];
+
+  memcpy(abTemp, pbDigest, sizeof(abTemp));
+  memcpy(pbSeed, pbKeySeed, 16);
+
+  EncryptDataStream2(lpDict, abTemp, sizeof(abTemp), pbSeed, 16, FALSE, 0);
+
+  Sha256(abTemp, sizeof(abTemp), pbName);
+}
+
+typedef struct tagCHUNK_INFO
+{
+  UINT cbOffset, cbSize;  // within the batch buffer
+  BYTE abDigest[32], abName[32];
+  BOOL bNew;
+  int iError;
+} CHUNK_INFO;
+
+typedef struct tagCHUNK_JOB
+{
+  const BYTE *lpDict;
+  const BYTE *pbKeySeed;
+  LPCSTR szStore;
+  LPBYTE pData;
+  CHUNK_INFO *pChunks;
+  UINT nChunks;
+  BOOL bRestore;
+
+  // candidate cut points for one segment (the first pass)
+  QWORD *pqwGear;
+  UINT cbStart, cbEnd, cbData;
+  UINT *pCuts, nCuts, nMaxCuts;
+
+#ifndef WIN32
+  pthread_mutex_t *pMutex;
+#endif // WIN32
+  UINT *piNext;  // next chunk to process (shared)
+} CHUNK_JOB;
+
+static void GearTable(QWORD *pqwGear)
+{
+  QWORD qw1 = 0x5346542043444300ULL; // any constant will do, but it can't change
+  int i1;
+
+  for(i1=0; i1 < 256; i1++) // 'splitmix64'
+  {
+    QWORD qw2 = (qw1 += 0x9e3779b97f4a7c15ULL);
+
+    qw2 = (qw2 ^ (qw2 >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    qw2 = (qw2 ^ (qw2 >> 27)) * 0x94d049bb133111ebULL;
+    pqwGear[i1] = qw2 ^ (qw2 >> 31);
+  }
+}
+
+// first pass - every position in [cbStart, cbEnd) where the hash matches.
+// The hash shifts left once per byte, so only the last 64 bytes affect it,
+// and starting 64 bytes early gives the same hash a serial pass would
+
+static void * ChunkCandidateThread(void *pArg)
+{
+  CHUNK_JOB *pJ = (CHUNK_JOB *)pArg;
+  const BYTE *pData = pJ->pData;
+  QWORD qwHash = 0;
+  UINT cb1 = pJ->cbStart > 64 ? pJ->cbStart - 64 : 0;
+
+  for(; cb1 < pJ->cbStart; cb1++)
+    qwHash = (qwHash << 1) + pJ->pqwGear[pData[cb1]];
+
+  for(; cb1 < pJ->cbEnd; cb1++)
+  {
+    qwHash = (qwHash << 1) + pJ->pqwGear[pData[cb1]];
+
+    if(!(qwHash & CHUNK_MASK))
+    {
+      if(pJ->nCuts >= pJ->nMaxCuts)
+      {
+        UINT *pNew = (UINT *)realloc(pJ->pCuts, (pJ->nMaxCuts + 256) * sizeof(UINT));
+
+        if(!pNew)
+          break;  // fewer candidates only means bigger chunks
+
+        pJ->pCuts = pNew;
+        pJ->nMaxCuts += 256;
+      }
+
+      pJ->pCuts[pJ->nCuts++] = cb1 + 1;  // the chunk ends after this byte
+    }
+  }
+
+  return(NULL);
+}
+
+static void ChunkPath(LPCSTR szStore, const BYTE *pbName, char *szPath, UINT cbPath, BOOL bDir)
+{
+  char szHex[65];
+
+  HexString(pbName, 32, szHex);
+
+  if(bDir)
+    snprintf(szPath, cbPath, "%s/%.2s", szStore, szHex);
+  else
+    snprintf(szPath, cbPath, "%s/%.2s/%s", szStore, szHex, szHex);
+}
+
+// second pass - hash, encrypt and store chunks (or, to restore, load,
+// decrypt and check them) until there are none left
+
+static void * ChunkStoreThread(void *pArg)
+{
+  CHUNK_JOB *pJ = (CHUNK_JOB *)pArg;
+  char szPath[4096], szTemp[4112];
+  BYTE abSeed[16];
+
+#ifndef WIN32
+
+  while(1)
+  {
+    pthread_mutex_lock(pJ->pMutex);
+    UINT iChunk = (*pJ->piNext)++;
+    pthread_mutex_unlock(pJ->pMutex);
+
+    if(iChunk >= pJ->nChunks)
+      break;
+
+    CHUNK_INFO *pC = pJ->pChunks + iChunk;
+    LPBYTE pData = pJ->pData + pC->cbOffset;
+    const BYTE *lpDict = GetLocalDictionary(pJ->lpDict);
+    struct stat sStat;
+    int iFile;
+
+    if(!pJ->bRestore)
+      Sha256(pData, pC->cbSize, pC->abDigest);
+
+    ChunkSeedAndName(lpDict, pJ->pbKeySeed, pC->abDigest, abSeed, pC->abName);
+    ChunkPath(pJ->szStore, pC->abName, szPath, sizeof(szPath), FALSE);
+
+    if(pJ->bRestore)
+    {
+      BYTE abCheck[32];
+      ssize_t cb1 = -1;
+
+      iFile = open(szPath, O_RDONLY);
+
+      if(iFile >= 0)
+      {
+        cb1 = read(iFile, pData, pC->cbSize);
+        close(iFile);
+      }
+
+      if(cb1 != (ssize_t)pC->cbSize)
+      {
+        pC->iError = ENOENT;
+        continue;
+      }
+
+      EncryptDataStream2(lpDict, pData, pC->cbSize, abSeed, sizeof(abSeed), TRUE, 0);
+      Sha256(pData, pC->cbSize, abCheck);
+
+      if(memcmp(abCheck, pC->abDigest, sizeof(abCheck)))
+        pC->iError = EIO;
+
+      continue;
+    }
+
+    // already in the store?  (a short one is re-written)
+
+    if(!stat(szPath, &sStat) && sStat.st_size == (off_t)pC->cbSize)
+      continue;
+
+    EncryptDataStream2(lpDict, pData, pC->cbSize, abSeed, sizeof(abSeed), FALSE, 0);
+
+    snprintf(szTemp, sizeof(szTemp), "%s.%u~", szPath, iChunk);
+
+    iFile = open(szTemp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+    if(iFile < 0 && errno == ENOENT)  // new subdirectory
+    {
+      ChunkPath(pJ->szStore, pC->abName, szTemp, sizeof(szTemp), TRUE);
+      mkdir(szTemp, 0700);
+
+      snprintf(szTemp, sizeof(szTemp), "%s.%u~", szPath, iChunk);
+      iFile = open(szTemp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    }
+
+    if(iFile < 0 || write(iFile, pData, pC->cbSize) != (ssize_t)pC->cbSize ||
+       close(iFile) || rename(szTemp, szPath))
+    {
+      pC->iError = errno ? errno : EIO;
+
+      if(iFile >= 0)
+        unlink(szTemp);
+
+      continue;
+    }
+
+    pC->bNew = TRUE;
+  }
+
+#endif // WIN32
+
+  return(NULL);
+}
+
+// run 'pfn' on 'nThreads' jobs, the first one on this thread
+
+static void RunChunkThreads(void * (*pfn)(void *), CHUNK_JOB *pJobs, int nThreads)
+{
+#ifndef WIN32
+  pthread_t aThread[CHUNK_THREADS];
+  BOOL abStarted[CHUNK_THREADS];
+  int i1;
+
+  for(i1=1; i1 < nThreads; i1++)
+  {
+    abStarted[i1] = !pthread_create(aThread + i1, NULL, pfn, pJobs + i1);
+
+    if(!abStarted[i1]) // do it myself
+      pfn(pJobs + i1);
+  }
+
+  pfn(pJobs);
+
+  for(i1=1; i1 < nThreads; i1++)
+  {
+    if(abStarted[i1])
+      pthread_join(aThread[i1], NULL);
+  }
+#endif // WIN32
+}
+
+// append to the manifest (which grows as needed).  returns non-zero on error
+
+static int ManifestAppend(char **ppManifest, UINT *pcbManifest, UINT *pcbMax, LPCSTR szText)
+{
+  UINT cb1 = strlen(szText);
+
+  if(*pcbManifest + cb1 > *pcbMax)
+  {
+    UINT cbNew = *pcbMax ? *pcbMax * 2 : 0x10000;
+    char *pNew = (char *)realloc(*ppManifest, cbNew);
+
+    if(!pNew)
+      return(-1);
+
+    *ppManifest = pNew;
+    *pcbMax = cbNew;
+  }
+
+  memcpy(*ppManifest + *pcbManifest, szText, cb1);
+  *pcbManifest += cb1;
+
+  return(0);
+}
+
+int BackupToStore(const BYTE *lpDict, FILE *pIN, FILE *pOUT, LPCSTR szStore,
+                  const BYTE *pbSeed0, int nThreads, BOOL bStats)
+{
+#ifdef WIN32
+
+  fprintf(stderr, "'--backup' is not supported on this platform\n");
+  return(2);
+
+#else // WIN32
+
+  LPBYTE pData = AllocAlignedBuffer(CHUNK_BATCH);
+  CHUNK_INFO *pChunks = new CHUNK_INFO[CHUNK_BATCH / CHUNK_MIN_SIZE + 2];
+  CHUNK_JOB aJobs[CHUNK_THREADS];
+  QWORD aqwGear[256];
+  pthread_mutex_t mtxNext = PTHREAD_MUTEX_INITIALIZER;
+  char *pManifest = NULL, szLine[160], szName[65], szDigest[65];
+  UINT cbManifest = 0, cbMaxManifest = 0, cbData = 0, nChunks, iNext, i1, i2;
+  double dStart = GetElapsedSeconds(), dTotal = 0, dStored = 0;
+  UINT nTotal = 0, nNew = 0;
+  BOOL bEOF = FALSE;
+  BYTE pbSeed[16];
+  int iRval = 0;
+
+  memset(aJobs, 0, sizeof(aJobs));
+
+  if(!pData || !pChunks)
+  {
+    fprintf(stderr, "Not enough memory to complete the desired operation.\n");
+    return(-1);
+  }
+
+  if(mkdir(szStore, 0700) && errno != EEXIST)
+  {
+    fprintf(stderr, "Unable to create chunk store '%s' (error %d)\n", szStore, errno);
+    iRval = -1;
+    goto done;
+  }
+
+  if(nThreads > CHUNK_THREADS)
+    nThreads = CHUNK_THREADS;
+  else if(nThreads < 1)
+    nThreads = 1;
+
+  GearTable(aqwGear);
+
+  for(i1=0; i1 < (UINT)nThreads; i1++)
+  {
+    aJobs[i1].lpDict = lpDict;
+    aJobs[i1].pbKeySeed = pbSeed0;
+    aJobs[i1].szStore = szStore;
+    aJobs[i1].pData = pData;
+    aJobs[i1].pChunks = pChunks;
+    aJobs[i1].pqwGear = aqwGear;
+    aJobs[i1].pMutex = &mtxNext;
+    aJobs[i1].piNext = &iNext;
+  }
+
+  ManifestAppend(&pManifest, &cbManifest, &cbMaxManifest, MANIFEST_HEADER);
+
+  while(!bEOF)
+  {
+    // fill the buffer (after what's left of the previous one)
+
+    while(cbData < CHUNK_BATCH)
+    {
+      size_t cb1 = fread(pData + cbData, 1, CHUNK_BATCH - cbData, pIN);
+
+      if(!cb1)
+      {
+        if(ferror(pIN))
+        {
+          fprintf(stderr, "Read error on input file\n");
+          iRval = -1;
+          goto done;
+        }
+
+        bEOF = TRUE;
+        break;
+      }
+
+      cbData += cb1;
+    }
+
+    // candidate cut points, in parallel (an equal share each)
+
+    for(i1=0; i1 < (UINT)nThreads; i1++)
+    {
+      aJobs[i1].cbStart = (UINT)((QWORD)cbData * i1 / nThreads);
+      aJobs[i1].cbEnd = (UINT)((QWORD)cbData * (i1 + 1) / nThreads);
+      aJobs[i1].nCuts = 0;
+    }
+
+    RunChunkThreads(ChunkCandidateThread, aJobs, nThreads);
+
+    // apply the minimum and maximum chunk sizes
+
+    UINT cbChunk = 0;  // start of the current chunk
+
+    nChunks = 0;
+
+    for(i1=0; i1 < (UINT)nThreads; i1++)
+    {
+      for(i2=0; i2 < aJobs[i1].nCuts; i2++)
+      {
+        UINT cbCut = aJobs[i1].pCuts[i2];
+
+        while(cbCut - cbChunk > CHUNK_MAX_SIZE)
+        {
+          pChunks[nChunks].cbOffset = cbChunk;
+          pChunks[nChunks++].cbSize = CHUNK_MAX_SIZE;
+          cbChunk += CHUNK_MAX_SIZE;
+        }
+
+        if(cbCut - cbChunk >= CHUNK_MIN_SIZE)
+        {
+          pChunks[nChunks].cbOffset = cbChunk;
+          pChunks[nChunks++].cbSize = cbCut - cbChunk;
+          cbChunk = cbCut;
+        }
+      }
+    }
+
+    while(cbData - cbChunk > CHUNK_MAX_SIZE)
+    {
+      pChunks[nChunks].cbOffset = cbChunk;
+      pChunks[nChunks++].cbSize = CHUNK_MAX_SIZE;
+      cbChunk += CHUNK_MAX_SIZE;
+    }
+
+    if(bEOF && cbData > cbChunk)  // the last one can be any size
+    {
+      pChunks[nChunks].cbOffset = cbChunk;
+      pChunks[nChunks++].cbSize = cbData - cbChunk;
+      cbChunk = cbData;
+    }
+
+    // hash, encrypt and store them, in parallel
+
+    for(i1=0; i1 < nChunks; i1++)
+    {
+      pChunks[i1].bNew = FALSE;
+      pChunks[i1].iError = 0;
+    }
+
+    aJobs[0].nChunks = nChunks;
+    iNext = 0;
+
+    for(i1=1; i1 < (UINT)nThreads; i1++)
+      aJobs[i1].nChunks = nChunks;
+
+    RunChunkThreads(ChunkStoreThread, aJobs, nThreads);
+
+    for(i1=0; i1 < nChunks; i1++)
+    {
+      if(pChunks[i1].iError)
+      {
+        fprintf(stderr, "Unable to write chunk to '%s' (error %d)\n",
+                szStore, pChunks[i1].iError);
+        iRval = 3;
+        goto done;
+      }
+
+      HexString(pChunks[i1].abName, 32, szName);
+      HexString(pChunks[i1].abDigest, 32, szDigest);
+      snprintf(szLine, sizeof(szLine), "%s %s %u\n", szName, szDigest, pChunks[i1].cbSize);
+
+      if(ManifestAppend(&pManifest, &cbManifest, &cbMaxManifest, szLine))
+      {
+        fprintf(stderr, "Not enough memory to complete the desired operation.\n");
+        iRval = -1;
+        goto done;
+      }
+
+      if(pChunks[i1].bNew)
+      {
+        nNew++;
+        dStored += pChunks[i1].cbSize;
+      }
+
+      dTotal += pChunks[i1].cbSize;
+    }
+
+    nTotal += nChunks;
+
+    // keep the unfinished chunk for the next pass
+
+    memmove(pData, pData + cbChunk, cbData - cbChunk);
+    cbData -= cbChunk;
+  }
+
+  snprintf(szLine, sizeof(szLine), "end %.0f %u\n", dTotal, nTotal);
+
+  if(!pManifest || ManifestAppend(&pManifest, &cbManifest, &cbMaxManifest, szLine))
+  {
+    fprintf(stderr, "Not enough memory to complete the desired operation.\n");
+    iRval = -1;
+    goto done;
+  }
+
+  memcpy(pbSeed, pbSeed0, sizeof(pbSeed));
+  EncryptDataStream2(lpDict, (LPBYTE)pManifest, cbManifest, pbSeed, sizeof(pbSeed), FALSE, 0);
+
+  if(fwrite(pManifest, 1, cbManifest, pOUT) != cbManifest || fflush(pOUT))
+  {
+    fprintf(stderr, "Write error on output file\n");
+    iRval = 3;
+  }
+
+  if(bStats)
+  {
+    dStart = GetElapsedSeconds() - dStart;
+
+    fprintf(stderr, "%.0f bytes in %u chunks, %u new (%.0f bytes stored), "
+                    "%.3f sec, %.2f MB/s\n",
+            dTotal, nTotal, nNew, dStored, dStart,
+            dStart > 0 ? dTotal / dStart / 1048576.0 : 0.0);
+  }
+
+done:
+
+  for(i1=0; i1 < CHUNK_THREADS; i1++)
+  {
+    if(aJobs[i1].pCuts)
+      free(aJobs[i1].pCuts);
+  }
+
+  if(pManifest)
+    free(pManifest);
+
+  memset(pData, 0, CHUNK_BATCH);
+  FreeAlignedBuffer(pData, CHUNK_BATCH);
+  delete[] pChunks;
+
+  return(iRval);
+
+#endif // WIN32
+}
+
+int RestoreFromStore(const BYTE *lpDict, FILE *pIN, FILE *pOUT, LPCSTR szStore,
+                     const BYTE *pbSeed0, int nThreads, BOOL bStats)
+{
+#ifdef WIN32
+
+  fprintf(stderr, "'--restore' is not supported on this platform\n");
+  return(2);
+
+#else // WIN32
+
+  LPBYTE pData = AllocAlignedBuffer(CHUNK_BATCH);
+  CHUNK_INFO *pChunks = new CHUNK_INFO[CHUNK_BATCH / CHUNK_MIN_SIZE + 2];
+  CHUNK_JOB aJobs[CHUNK_THREADS];
+  pthread_mutex_t mtxNext = PTHREAD_MUTEX_INITIALIZER;
+  char *pManifest = NULL, *p1, *p2;
+  UINT cbManifest = 0, cbMaxManifest = 0, cbData, nChunks, iNext, i1;
+  double dStart = GetElapsedSeconds(), dTotal = 0, dExpected = -1;
+  UINT nTotal = 0, nExpected = 0;
+  BYTE pbSeed[16];
+  int iRval = 0;
+
+  memset(aJobs, 0, sizeof(aJobs));
+
+  if(!pData || !pChunks)
+  {
+    fprintf(stderr, "Not enough memory to complete the desired operation.\n");
+    return(-1);
+  }
+
+  // the whole manifest, decrypted and zero terminated
+
+  while(1)
+  {
+    if(cbMaxManifest - cbManifest < 2)
+    {
+      UINT cbNew = cbMaxManifest ? cbMaxManifest * 2 : 0x10000;
+      char *pNew = (char *)realloc(pManifest, cbNew);
+
+      if(!pNew)
+      {
+        fprintf(stderr, "Not enough memory to complete the desired operation.\n");
+        iRval = -1;
+        goto done;
+      }
+
+      pManifest = pNew;
+      cbMaxManifest = cbNew;
+    }
+
+    size_t cb1 = fread(pManifest + cbManifest, 1, cbMaxManifest - cbManifest - 1, pIN);
+
+    if(!cb1)
+      break;
+
+    cbManifest += cb1;
+  }
+
+  if(!pManifest)
+    pManifest = (char *)malloc(1);
+
+  memcpy(pbSeed, pbSeed0, sizeof(pbSeed));
+  EncryptDataStream2(lpDict, (LPBYTE)pManifest, cbManifest, pbSeed, sizeof(pbSeed), TRUE, 0);
+  pManifest[cbManifest] = 0;
+
+  if(strncmp(pManifest, MANIFEST_HEADER, strlen(MANIFEST_HEADER)) ||
+     strlen(pManifest) != cbManifest)
+  {
+    fprintf(stderr, "Not a backup manifest (or the wrong key)\n");
+    iRval = 2;
+    goto done;
+  }
+
+  if(nThreads > CHUNK_THREADS)
+    nThreads = CHUNK_THREADS;
+  else if(nThreads < 1)
+    nThreads = 1;
+
+  for(i1=0; i1 < (UINT)nThreads; i1++)
+  {
+    aJobs[i1].lpDict = lpDict;
+    aJobs[i1].pbKeySeed = pbSeed0;
+    aJobs[i1].szStore = szStore;
+    aJobs[i1].pData = pData;
+    aJobs[i1].pChunks = pChunks;
+    aJobs[i1].bRestore = TRUE;
+    aJobs[i1].pMutex = &mtxNext;
+    aJobs[i1].piNext = &iNext;
+  }
+
+  // load a buffer full of chunks at a time, then write them in order
+
+  p1 = pManifest + strlen(MANIFEST_HEADER);
+
+  while(*p1)
+  {
+    cbData = 0;
+    nChunks = 0;
+
+    while(*p1 && strncmp(p1, "end ", 4))
+    {
+      CHUNK_INFO *pC = pChunks + nChunks;
+      UINT cbSize;
+
+      p2 = strchr(p1, '\n');
+
+      if(!p2 || p2 - p1 < 131 || p1[64] != ' ' || p1[129] != ' ' ||
+         !ParseHexString(p1 + 65, pC->abDigest, 32) ||
+         !(cbSize = (UINT)strtoul(p1 + 130, NULL, 10)) || cbSize > CHUNK_MAX_SIZE)
+      {
+        fprintf(stderr, "Invalid backup manifest entry\n");
+        iRval = 2;
+        goto done;
+      }
+
+      if(cbData + cbSize > CHUNK_BATCH)
+        break;
+
+      pC->cbOffset = cbData;
+      pC->cbSize = cbSize;
+      pC->iError = 0;
+      cbData += cbSize;
+      nChunks++;
+
+      p1 = p2 + 1;
+    }
+
+    if(!nChunks)  // the end
+    {
+      if(*p1)
+        sscanf(p1 + 4, "%lf %u", &dExpected, &nExpected);
+
+      break;
+    }
+
+    iNext = 0;
+
+    for(i1=0; i1 < (UINT)nThreads; i1++)
+      aJobs[i1].nChunks = nChunks;
+
+    RunChunkThreads(ChunkStoreThread, aJobs, nThreads);
+
+    for(i1=0; i1 < nChunks; i1++)
+    {
+      if(pChunks[i1].iError)
+      {
+        char szName[65];
+
+        HexString(pChunks[i1].abName, 32, szName);
+        fprintf(stderr, "Chunk %s is %s\n", szName,
+                pChunks[i1].iError == EIO ? "damaged" : "missing");
+        iRval = 3;
+        goto done;
+      }
+    }
+
+    if(fwrite(pData, 1, cbData, pOUT) != cbData)
+    {
+      fprintf(stderr, "Write error on output file\n");
+      iRval = 3;
+      goto done;
+    }
+
+    dTotal += cbData;
+    nTotal += nChunks;
+  }
+
+  if(dExpected != dTotal || nExpected != nTotal)
+  {
+    fprintf(stderr, "Backup manifest is incomplete\n");
+    iRval = 2;
+  }
+  else if(fflush(pOUT))
+  {
+    fprintf(stderr, "Write error on output file\n");
+    iRval = 3;
+  }
+
+  if(bStats)
+  {
+    dStart = GetElapsedSeconds() - dStart;
+
+    fprintf(stderr, "restored %.0f bytes from %u chunks in %.3f sec, %.2f MB/s\n",
+            dTotal, nTotal, dStart, dStart > 0 ? dTotal / dStart / 1048576.0 : 0.0);
+  }
+
+done:
+
+  if(pManifest)
+  {
+    memset(pManifest, 0, cbMaxManifest);
+    free(pManifest);
+  }
+
+  memset(pData, 0, CHUNK_BATCH);
+  FreeAlignedBuffer(pData, CHUNK_BATCH);
+  delete[] pChunks;
+
+  return(iRval);
+
+#endif // WIN32
+}
+
+
+// verify ('--verify=PLAINTEXT').  The cipher text (the input) is decrypted
+// in memory, in parallel, and compared with the plain text file, with
+// nothing written.  While one block is decrypted and compared, a second
+// thread reads the next one from both files.  Returns 0 if they're the
+// same, 1 if they differ (like 'cmp'), or 2+ for errors.
+
+#define VERIFY_BUFFER_SIZE 0x800000 /* 8Mb */
+
+typedef struct tagVERIFY_READ
+{
+  FILE *pCipher, *pPlain;
+  LPBYTE pbCipher, pbPlain;
+  size_t cbCipher, cbPlain;
+  BOOL bError;
+} VERIFY_READ;
+
+static void * VerifyReadThread(void *pArg)
+{
+  VERIFY_READ *pR = (VERIFY_READ *)pArg;
+
+  pR->cbCipher = fread(pR->pbCipher, 1, VERIFY_BUFFER_SIZE, pR->pCipher);
+  pR->cbPlain = fread(pR->pbPlain, 1, VERIFY_BUFFER_SIZE, pR->pPlain);
+  pR->bError = ferror(pR->pCipher) || ferror(pR->pPlain);
+
+  return(NULL);
+}
+
+int VerifyStream(const BYTE *lpDict, FILE *pIN, FILE *pPlain,
+                 BYTE *pbSeed, UINT cbKeySize, int nThreads, BOOL bStats)
+{
+  VERIFY_READ aRead[2];
+  double dStart = GetElapsedSeconds(), dTotal = 0;
+  int i1, iCur = 0, iRval = 0;
+
+  memset(aRead, 0, sizeof(aRead));
+
+  for(i1=0; i1 < 2; i1++)
+  {
+    aRead[i1].pCipher = pIN;
+    aRead[i1].pPlain = pPlain;
+    aRead[i1].pbCipher = AllocAlignedBuffer(VERIFY_BUFFER_SIZE);
+    aRead[i1].pbPlain = AllocAlignedBuffer(VERIFY_BUFFER_SIZE);
+
+    if(!aRead[i1].pbCipher || !aRead[i1].pbPlain)
+    {
+      fprintf(stderr, "Not enough memory to complete the desired operation.\n");
+      iRval = -1;
+      goto done;
+    }
+  }
+
+  VerifyReadThread(aRead);
+
+  while(1)
+  {
+    VERIFY_READ *pR = aRead + iCur;
+    size_t cb1 = pR->cbCipher < pR->cbPlain ? pR->cbCipher : pR->cbPlain;
+
+    if(pR->bError)
+    {
+      fprintf(stderr, "Read error on input file\n");
+      iRval = 2;
+      break;
+    }
+
+    // start reading the next block (unless this is the last one)
+
+#ifndef WIN32
+    pthread_t hThread;
+    BOOL bThread = FALSE;
+#endif // WIN32
+    BOOL bMore = pR->cbCipher == VERIFY_BUFFER_SIZE && pR->cbPlain == VERIFY_BUFFER_SIZE;
+
+    if(bMore)
+    {
+#ifndef WIN32
+      bThread = !pthread_create(&hThread, NULL, VerifyReadThread, aRead + (iCur ^ 1));
+
+      if(!bThread)
+#endif // WIN32
+      {
+        VerifyReadThread(aRead + (iCur ^ 1));
+      }
+    }
+
+    DecryptDataParallel(lpDict, pR->pbCipher, (UINT)cb1, pbSeed, cbKeySize, nThreads);
+
+    if(memcmp(pR->pbCipher, pR->pbPlain, cb1))
+    {
+      size_t cb2;
+
+      for(cb2=0; pR->pbCipher[cb2] == pR->pbPlain[cb2]; cb2++)
+        { }
+
+      fprintf(stderr, "verify FAILED:  first difference at offset %.0f\n", dTotal + cb2);
+      iRval = 1;
+    }
+    else if(pR->cbCipher != pR->cbPlain)
+    {
+      fprintf(stderr, "verify FAILED:  %s is shorter (%.0f bytes)\n",
+              pR->cbCipher < pR->cbPlain ? "cipher text" : "plain text", dTotal + cb1);
+      iRval = 1;
+    }
+
+#ifndef WIN32
+    if(bThread)
+      pthread_join(hThread, NULL);
+#endif // WIN32
+
+    dTotal += cb1;
+
+    if(iRval || !bMore)
+      break;
+
+    iCur ^= 1;
+  }
+
+  if(!iRval)
+    fprintf(stderr, "verify OK:  %.0f bytes\n", dTotal);
+
+  if(bStats)
+  {
+    dStart = GetElapsedSeconds() - dStart;
+
+    fprintf(stderr, "%.0f bytes in %.3f sec, %.2f MB/s\n",
+            dTotal, dStart, dStart > 0 ? dTotal / dStart / 1048576.0 : 0.0);
+  }
+
+done:
+
+  for(i1=0; i1 < 2; i1++)
+  {
+    if(aRead[i1].pbCipher)
+    {
+      memset(aRead[i1].pbCipher, 0, VERIFY_BUFFER_SIZE);  // decrypted
+      FreeAlignedBuffer(aRead[i1].pbCipher, VERIFY_BUFFER_SIZE);
+    }
+
+    if(aRead[i1].pbPlain)
+    {
+      memset(aRead[i1].pbPlain, 0, VERIFY_BUFFER_SIZE);
+      FreeAlignedBuffer(aRead[i1].pbPlain, VERIFY_BUFFER_SIZE);
+    }
+  }
+
+  return(iRval);
+}
+
+
+// 'armored' text ('-a'), for the clipboard, e-mail and so on.  The cipher
+// text is base64 encoded, 76 characters per line, between BEGIN and END
+// lines.  The cipher and the codec work on the same small block (a few k)
+// one after the other, so the data is still in the L1 cache when it's
+// encoded (or decrypted, after decoding).  On x86 the base64 codec uses
+// SSSE3 (12 bytes <-> 16 characters at a time, see W. Mula's articles on
+// vectorized base64) when the CPU has it, and plain C otherwise.
+//
+// Decoding skips anything before the BEGIN line, and accepts any line
+// length, white space and '\r\n' line endings.
+
+#define ARMOR_BEGIN      "-----BEGIN SFTCRYPT MESSAGE-----\n"
+#define ARMOR_END        "-----END SFTCRYPT MESSAGE-----\n"
+#define ARMOR_LINE_BYTES 57  /* 76 characters */
+#define ARMOR_BLOCK      (ARMOR_LINE_BYTES * 64)  /* encrypt + encode this much at a time */
+#define ARMOR_READ       (ARMOR_BLOCK * 8)
+
+static const char szBase64[] =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static signed char abBase64Value[256];  // -1 for invalid characters
+
+typedef UINT (*LPBASE64ENCODE)(const BYTE *pbData, UINT cbData, char *pOut);
+typedef UINT (*LPBASE64DECODE)(const char *pIn, UINT cbIn, LPBYTE pOut);
+
+// encode 'cbData' bytes, padding the last group with '='.  returns the
+// number of characters.  no line breaks
+
+static UINT Base64EncodeScalar(const BYTE *pbData, UINT cbData, char *pOut)
+{
+  char *p1 = pOut;
+
+  for(; cbData >= 3; pbData += 3, cbData -= 3)
+  {
+    DWORD dw1 = ((DWORD)pbData[0] << 16) | ((DWORD)pbData[1] << 8) | pbData[2];
+
+    p1[0] = szBase64[dw1 >> 18];
+    p1[1] = szBase64[(dw1 >> 12) & 63];
+    p1[2] = szBase64[(dw1 >> 6) & 63];
+    p1[3] = szBase64[dw1 & 63];
+    p1 += 4;
+  }
+
+  if(cbData)
+  {
+    DWORD dw1 = ((DWORD)pbData[0] << 16) | (cbData > 1 ? (DWORD)pbData[1] << 8 : 0);
+
+    p1[0] = szBase64[dw1 >> 18];
+    p1[1] = szBase64[(dw1 >> 12) & 63];
+    p1[2] = cbData > 1 ? szBase64[(dw1 >> 6) & 63] : '=';
+    p1[3] = '=';
+    p1 += 4;
+  }
+
+  return((UINT)(p1 - pOut));
+}
+
+// decode whole groups of 4 valid characters, stopping at anything else
+// (white space, '=', the end).  returns the number of characters used
+
+static UINT Base64DecodeScalar(const char *pIn, UINT cbIn, LPBYTE pOut)
+{
+  UINT cb1;
+
+  for(cb1=0; cb1 + 4 <= cbIn; cb1 += 4, pOut += 3)
+  {
+    int i1 = abBase64Value[(BYTE)pIn[cb1]], i2 = abBase64Value[(BYTE)pIn[cb1 + 1]];
+    int i3 = abBase64Value[(BYTE)pIn[cb1 + 2]], i4 = abBase64Value[(BYTE)pIn[cb1 + 3]];
+
+    if((i1 | i2 | i3 | i4) < 0)
+      break;
+
+    DWORD dw1 = (i1 << 18) | (i2 << 12) | (i3 << 6) | i4;
+
+    pOut[0] = (BYTE)(dw1 >> 16);
+    pOut[1] = (BYTE)(dw1 >> 8);
+    pOut[2] = (BYTE)dw1;
+  }
+
+  return(cb1);
+}
+
+#ifdef BASE64_SSSE3
+
+// 12 bytes -> 16 characters per step.  Reads 16 bytes for each 12, so it
+// stops while at least 16 are left and lets the scalar code finish
+
+__attribute__((target("ssse3")))
+static UINT Base64EncodeSSSE3(const BYTE *pbData, UINT cbData, char *pOut)
+{
+  const __m128i mShuffle = _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+  const __m128i mShift = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                       '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                       '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+  char *p1 = pOut;
+
+  for(; cbData >= 16; pbData += 12, cbData -= 12, p1 += 16)
+  {
+    __m128i mIn = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)pbData), mShuffle);
+
+    // split each 3 bytes into 4 six bit values, one per byte
+
+    __m128i m1 = _mm_mulhi_epu16(_mm_and_si128(mIn, _mm_set1_epi32(0x0fc0fc00)),
+                                 _mm_set1_epi32(0x04000040));
+    __m128i m2 = _mm_mullo_epi16(_mm_and_si128(mIn, _mm_set1_epi32(0x003f03f0)),
+                                 _mm_set1_epi32(0x01000010));
+    __m128i mIndex = _mm_or_si128(m1, m2);
+
+    // then to ASCII, by adding an offset that depends on the range
+
+    __m128i mRange = _mm_subs_epu8(mIndex, _mm_set1_epi8(51));
+
+    mRange = _mm_or_si128(mRange, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), mIndex),
+                                                _mm_set1_epi8(13)));
+
+    _mm_storeu_si128((__m128i *)p1,
+                     _mm_add_epi8(_mm_shuffle_epi8(mShift, mRange), mIndex));
+  }
+
+  return((UINT)(p1 - pOut) + Base64EncodeScalar(pbData, cbData, p1));
+}
+
+// 16 characters -> 12 bytes per step, until something isn't a base64
+// character.  Writes 16 bytes for each 12, so 'pOut' needs 4 to spare
+
+__attribute__((target("ssse3")))
+static UINT Base64DecodeSSSE3(const char *pIn, UINT cbIn, LPBYTE pOut)
+{
+  const __m128i mLutLo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                       0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+  const __m128i mLutHi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                       0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+  const __m128i mLutRoll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+                                         0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i mMask2F = _mm_set1_epi8(0x2f);
+  const __m128i mPack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+  UINT cb1;
+
+  for(cb1=0; cb1 + 16 <= cbIn; cb1 += 16, pOut += 12)
+  {
+    __m128i mIn = _mm_loadu_si128((const __m128i *)(pIn + cb1));
+    __m128i mHi = _mm_and_si128(_mm_srli_epi32(mIn, 4), mMask2F);
+    __m128i mLo = _mm_shuffle_epi8(mLutLo, _mm_and_si128(mIn, mMask2F));
+    __m128i mRoll = _mm_shuffle_epi8(mLutRoll,
+                                     _mm_add_epi8(_mm_cmpeq_epi8(mIn, mMask2F), mHi));
+
+    // invalid characters have a bit in common in both tables
+
+    if(_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(mLo, _mm_shuffle_epi8(mLutHi, mHi)),
+                                        _mm_setzero_si128())))
+    {
+      break;
+    }
+
+    mIn = _mm_add_epi8(mIn, mRoll);  // now the 6 bit values
+
+    // pack 4 x 6 bits into 3 bytes
+
+    mIn = _mm_maddubs_epi16(mIn, _mm_set1_epi32(0x01400140));
+    mIn = _mm_madd_epi16(mIn, _mm_set1_epi32(0x00011000));
+
+    _mm_storeu_si128((__m128i *)pOut, _mm_shuffle_epi8(mIn, mPack));
+  }
+
+  return(cb1 + Base64DecodeScalar(pIn + cb1, cbIn - cb1, pOut));
+}
+
+#endif // BASE64_SSSE3
+
+static LPBASE64ENCODE lpfnBase64Encode = NULL;
+static LPBASE64DECODE lpfnBase64Decode = NULL;
+
+static void Base64Init(void)
+{
+  int i1;
+
+  if(lpfnBase64Encode)
+    return;
+
+  memset(abBase64Value, -1, sizeof(abBase64Value));
+
+  for(i1=0; i1 < 64; i1++)
+    abBase64Value[(BYTE)szBase64[i1]] = (signed char)i1;
+
+  lpfnBase64Encode = Base64EncodeScalar;
+  lpfnBase64Decode = Base64DecodeScalar;
+
+  // without optimization the intrinsics are all function calls, and it's
+  // slower than the plain C version ('--bench' shows both)
+
+#if defined(BASE64_SSSE3) && defined(__OPTIMIZE__)
+  if(__builtin_cpu_supports("ssse3"))
+  {
+    lpfnBase64Encode = Base64EncodeSSSE3;
+    lpfnBase64Decode = Base64DecodeSSSE3;
+  }
+#endif // BASE64_SSSE3, __OPTIMIZE__
+}
+
+// decoder state, for groups of 4 that are split up by white space or lines
+
+typedef struct tagBASE64_STATE
+{
+  DWORD dwBits;
+  UINT nChars;  // characters in 'dwBits'
+  BOOL bPadded; // '=' seen - nothing more is allowed
+} BASE64_STATE;
+
+// decode one line (or part of one).  returns the number of bytes, or -1
+// for an invalid character
+
+static int ArmorDecodeLine(const char *pLine, UINT cbLine, LPBYTE pOut, BASE64_STATE *pS)
+{
+  LPBYTE p1 = pOut;
+  UINT cb1 = 0;
+
+  if(!pS->nChars && !pS->bPadded)  // the fast way, for as long as it lasts
+  {
+    cb1 = lpfnBase64Decode(pLine, cbLine, p1);
+    p1 += cb1 / 4 * 3;
+  }
+
+  for(; cb1 < cbLine; cb1++)
+  {
+    BYTE b1 = (BYTE)pLine[cb1];
+
+    if(b1 == ' ' || b1 == '\t' || b1 == '\r' || b1 == '\n')
+      continue;
+
+    if(b1 == '=')
+    {
+      if(!pS->bPadded)
+      {
+        if(pS->nChars == 2)
+          *(p1++) = (BYTE)(pS->dwBits >> 4);
+        else if(pS->nChars == 3)
+        {
+          *(p1++) = (BYTE)(pS->dwBits >> 10);
+          *(p1++) = (BYTE)(pS->dwBits >> 2);
+        }
+        else
+          return(-1);
+
+        pS->bPadded = TRUE;
+      }
+
+      continue;
+    }
+
+    if(pS->bPadded || abBase64Value[b1] < 0)
+      return(-1);
+
+    pS->dwBits = (pS->dwBits << 6) | abBase64Value[b1];
+
+    if(++(pS->nChars) == 4)
+    {
+      *(p1++) = (BYTE)(pS->dwBits >> 16);
+      *(p1++) = (BYTE)(pS->dwBits >> 8);
+      *(p1++) = (BYTE)pS->dwBits;
+      pS->dwBits = 0;
+      pS->nChars = 0;
+    }
+  }
+
+  return((int)(p1 - pOut));
+}
+
+int ArmorEncodeStream(const BYTE *lpDict, FILE *pIN, FILE *pOUT,
+                      BYTE *pbSeed, UINT cbKeySize, BOOL bStats)
+{
+  // each line is 57 bytes -> 76 characters + newline
+  UINT cbOutMax = ARMOR_READ / ARMOR_LINE_BYTES * 77 + 80;
+  LPBYTE pBuf = new BYTE[ARMOR_READ];
+  char *pOut = new char[cbOutMax];
+  double dStart = GetElapsedSeconds(), dTotal = 0;
+  int iRval = 0;
+
+  if(!pBuf || !pOut)
+  {
+    fprintf(stderr, "Not enough memory to complete the desired operation.\n");
+    return(-1);
+  }
+
+  Base64Init();
+
+  if(fputs(ARMOR_BEGIN, pOUT) == EOF)
+    iRval = 3;
+
+  // NOTE: 'fread()' only returns a short count at the end of the input,
+  //       so every line but the last one is a full 76 characters
+
+  while(!iRval && !feof(pIN))
+  {
+    UINT cbRead = fread(pBuf, 1, ARMOR_READ, pIN), cb1, cb2;
+    char *p1 = pOut;
+
+    if(!cbRead)
+      break;
+
+    for(cb1=0; cb1 < cbRead; cb1 += ARMOR_BLOCK)
+    {
+      UINT cbBlock = cbRead - cb1 < ARMOR_BLOCK ? cbRead - cb1 : ARMOR_BLOCK;
+
+      lpfnEncryptDataStream(lpDict, pBuf + cb1, cbBlock, pbSeed, cbKeySize, FALSE, 0);
+
+      for(cb2=0; cb2 < cbBlock; cb2 += ARMOR_LINE_BYTES)
+      {
+        p1 += lpfnBase64Encode(pBuf + cb1 + cb2, cbBlock - cb2 < ARMOR_LINE_BYTES ?
+                               cbBlock - cb2 : ARMOR_LINE_BYTES, p1);
+        *(p1++) = '\n';
+      }
+    }
+
+    if(fwrite(pOut, 1, p1 - pOut, pOUT) != (size_t)(p1 - pOut))
+      iRval = 3;
+
+    dTotal += cbRead;
+  }
+
+  if(!iRval && fputs(ARMOR_END, pOUT) == EOF)
+    iRval = 3;
+
+  if(iRval)
+    fprintf(stderr, "Write error on output file\n");
+
+  if(bStats)
+  {
+    fflush(pOUT);
+    dStart = GetElapsedSeconds() - dStart;
+
+    fprintf(stderr, "%.0f bytes in %.3f sec, %.2f MB/s\n",
+            dTotal, dStart, dStart > 0 ? dTotal / dStart / 1048576.0 : 0.0);
+  }
+
+  delete[] pBuf;
+  delete[] pOut;
+
+  return(iRval);
+}
+
+int ArmorDecodeStream(const BYTE *lpDict, FILE *pIN, FILE *pOUT,
+                      BYTE *pbSeed, UINT cbKeySize, BOOL bStats)
+{
+  char *pIn = new char[ARMOR_READ];
+  LPBYTE pOut = new BYTE[ARMOR_READ / 4 * 3 + 16];
+  UINT cbIn = 0, nLine = 0;
+  int iState = 0;  // 0 = before BEGIN, 1 = in the text, 2 = after END
+  BOOL bEOF = FALSE, bLineStart = TRUE;
+  BASE64_STATE sState;
+  double dStart = GetElapsedSeconds(), dTotal = 0;
+  int iRval = 0;
+
+  if(!pIn || !pOut)
+  {
+    fprintf(stderr, "Not enough memory to complete the desired operation.\n");
+    return(-1);
+  }
+
+  Base64Init();
+  memset(&sState, 0, sizeof(sState));
+
+  while(!iRval && iState < 2 && (!bEOF || cbIn))
+  {
+    if(!bEOF && cbIn < ARMOR_READ)
+    {
+      size_t cb1 = fread(pIn + cbIn, 1, ARMOR_READ - cbIn, pIN);
+
+      if(!cb1)
+        bEOF = TRUE;
+
+      cbIn += cb1;
+    }
+
+    // decode every complete line (all of it at the end, or when there's
+    // no line break in the whole buffer), then decrypt it all
+
+    char *p1 = pIn, *pEnd = pIn + cbIn;
+    UINT cbOut = 0;
+
+    while(p1 < pEnd && iState < 2)
+    {
+      char *p2 = (char *)memchr(p1, '\n', pEnd - p1);
+      BOOL bWhole = p2 != NULL;
+
+      if(!p2)
+      {
+        if(!bEOF && p1 > pIn)  // wait for the rest of it
+          break;
+
+        p2 = pEnd;
+      }
+
+      if(bLineStart)
+        nLine++;
+
+      if(bLineStart && p2 - p1 >= 5 && !strncmp(p1, "-----", 5))
+      {
+        LPCSTR szMark = iState ? ARMOR_END : ARMOR_BEGIN;
+        UINT cbMark = strlen(szMark) - 1;  // without the '\n'
+
+        if((UINT)(p2 - p1) >= cbMark && !strncmp(p1, szMark, cbMark))
+        {
+          iState++;
+        }
+        else if(iState == 1)
+        {
+          fprintf(stderr, "Invalid armored input, line %u\n", nLine);
+          iRval = 2;
+          break;
+        }
+      }
+      else if(iState == 1)
+      {
+        int i1 = ArmorDecodeLine(p1, (UINT)(p2 - p1), pOut + cbOut, &sState);
+
+        if(i1 < 0)
+        {
+          fprintf(stderr, "Invalid armored input, line %u\n", nLine);
+          iRval = 2;
+          break;
+        }
+
+        cbOut += i1;
+      }
+
+      bLineStart = bWhole;
+      p1 = bWhole ? p2 + 1 : p2;
+    }
+
+    if(cbOut)
+    {
+      lpfnEncryptDataStream(lpDict, pOut, cbOut, pbSeed, cbKeySize, TRUE, 0);
+
+      if(fwrite(pOut, 1, cbOut, pOUT) != cbOut)
+      {
+        fprintf(stderr, "Write error on output file\n");
+        iRval = 3;
+      }
+
+      dTotal += cbOut;
+    }
+
+    memmove(pIn, p1, pEnd - p1);
+    cbIn = (UINT)(pEnd - p1);
+  }
+
+  if(!iRval && iState < 2)
+  {
+    fprintf(stderr, iState ? "Armored input is incomplete (no END line)\n"
+                           : "No armored input found\n");
+    iRval = 2;
+  }
+
+  if(bStats)
+  {
+    fflush(pOUT);
+    dStart = GetElapsedSeconds() - dStart;
+
+    fprintf(stderr, "%.0f bytes in %.3f sec, %.2f MB/s\n",
+            dTotal, dStart, dStart > 0 ? dTotal / dStart / 1048576.0 : 0.0);
+  }
+
+  memset(pOut, 0, ARMOR_READ / 4 * 3 + 16);
+  delete[] pIn;
+  delete[] pOut;
+
+  return(iRval);
+}
+
+// base64 codec speed, for '--bench'
+
+void BenchmarkArmor(const BYTE *pData, UINT cbData)
+{
+  struct
+  {
+    LPCSTR szName;
+    LPBASE64ENCODE lpfnEncode;
+    LPBASE64DECODE lpfnDecode;
+  } aCodec[2];
+  int i1, nCodec = 1;
+  char *pText = new char[cbData / 3 * 4 + 8];
+  LPBYTE pCheck = new BYTE[cbData + 16];
+
+  if(!pText || !pCheck)
+    return;
+
+  Base64Init();
+
+  aCodec[0].szName = "base64 (C)    ";
+  aCodec[0].lpfnEncode = Base64EncodeScalar;
+  aCodec[0].lpfnDecode = Base64DecodeScalar;
+
+#ifdef BASE64_SSSE3
+  if(__builtin_cpu_supports("ssse3"))
+  {
+    aCodec[1].szName = "base64 (SSSE3)";
+    aCodec[1].lpfnEncode = Base64EncodeSSSE3;
+    aCodec[1].lpfnDecode = Base64DecodeSSSE3;
+    nCodec = 2;
+  }
+#endif // BASE64_SSSE3
+
+  cbData -= cbData % 3;
+
+  for(i1=0; i1 < nCodec; i1++)
+  {
+    double dStart = GetElapsedSeconds(), dEncode, dDecode;
+    UINT cbText = aCodec[i1].lpfnEncode(pData, cbData, pText);
+
+    dEncode = GetElapsedSeconds() - dStart;
+
+    dStart = GetElapsedSeconds();
+    UINT cbUsed = aCodec[i1].lpfnDecode(pText, cbText, pCheck);
+    dDecode = GetElapsedSeconds() - dStart;
+
+    fprintf(stderr, "%s:  encode %8.2f MB/s  decode %8.2f MB/s%s\n", aCodec[i1].szName,
+            cbData / dEncode / 1048576.0, cbData / dDecode / 1048576.0,
+            cbUsed != cbText || memcmp(pCheck, pData, cbData) ? "  ** MISMATCH **" : "");
+  }
+
+  delete[] pText;
+  delete[] pCheck;
+}
+
+
+// scatter/gather encryption.  The buffers in 'pIov' are encrypted (or
+// decrypted) in place as if they were one continuous stream, i.e. a record
+// made up of a header, a payload and a trailer in separate buffers doesn't
+// need to be copied into one first.  The seed ring carries over from the
+// end of each buffer to the start of the next (and is returned in 'pbSeed'
+// as usual), so the result is the same as for the concatenated data.
+// 'lpfnCipher' is 'EncryptDataStream2' by default; sftcrypt itself passes
+// the one selected on the command line.
+
+void EncryptDataStreamV(const BYTE *lpDict, const struct iovec *pIov, int nIov,
+                        BYTE *pbSeed, UINT cbKeySize,
+                        BOOL bDecryptFlag /* = FALSE */,
+                        BYTE bTableSize /* = 0 */,
+                        LPENCRYPTDATASTREAM lpfnCipher /* = EncryptDataStream2 */)
+{
+  int i1;
+
+  for(i1=0; i1 < nIov; i1++)
+  {
+    if(pIov[i1].iov_len)
+    {
+      lpfnCipher(lpDict, (LPBYTE)pIov[i1].iov_base, (UINT)pIov[i1].iov_len,
+                 pbSeed, cbKeySize, bDecryptFlag, bTableSize);
+    }
+  }
+}
+
+// the main I/O loop.  'readv()' fills several buffers from the pool at a
+// time, which are encrypted in place with 'EncryptDataStreamV()' and
+// written with 'writev()', with no copies in between (and no stdio).  A
+// short read (from a pipe, say) only fills the first few.
+//
+// How much it reads at a time is up to the I/O schedule.  A few bytes of
+// key from a tty don't need a megabyte of buffers (which all have to be
+// zeroed afterwards), but a big file on a fast disk is mostly per-call
+// overhead with 32k.  So it starts with something that suits the input,
+// and every IO_SAMPLE_BATCHES full reads it compares the throughput with
+// the last size; if it's no worse, the size doubles (up to the cap).  If
+// it's worse, it goes back to the last size and stays there.
+//
+// A pipe can't return more than it holds, so on Linux it's made big enough
+// for the cap first (F_SETPIPE_SZ).  If that can't be done the cap is what
+// it does hold, since a bigger read would never come back full.
+
+#define IOV_SLOTS        8
+#define IOV_SLOT_MAX     0x80000   /* 512k - bigger reads use more slots */
+#define IO_BATCH_TTY     4096
+#define IO_BATCH_PIPE    65536     /* a pipe's buffer, on Linux */
+#define IO_BATCH_FILE    0x40000   /* 256k - to start with */
+#define IO_CAP_PIPE      0x100000  /* 1Mb */
+#define IO_CAP_FILE      0x400000  /* 4Mb */
+#define IO_SAMPLE_BATCHES 3
+#define IO_SAMPLE_TIME   0.002     /* seconds, at least */
+
+static UINT IoRoundUp(double dSize)  // to 4k, within the limits
+{
+  if(dSize > IO_CAP_FILE)
+    return(IO_CAP_FILE);
+
+  if(dSize < 4096)
+    return(4096);
+
+  return(((UINT)dSize + 4095) & ~4095U);
+}
+
+void IoScheduleInit(IO_SCHEDULE *pS, int iIn, UINT cbFixed)
+{
+  double dSize = 0;
+  BOOL bTTY, bFile;
+
+  memset(pS, 0, sizeof(*pS));
+
+#ifdef WIN32
+  bTTY = _isatty(iIn);
+  dSize = bTTY ? 0 : (double)_filelengthi64(iIn);
+  bFile = dSize > 0;
+#else // WIN32
+  struct stat sStat;
+
+  bTTY = isatty(iIn);
+
+  if(!fstat(iIn, &sStat))
+    dSize = (double)sStat.st_size;
+
+  bFile = !bTTY && !fstat(iIn, &sStat) &&
+          (S_ISREG(sStat.st_mode) || S_ISBLK(sStat.st_mode)) && dSize > 0;
+#endif // WIN32
+
+  if(bTTY)  // interactive - a line at a time, and not much of it
+  {
+    pS->szInput = "tty";
+    pS->cbBatch = pS->cbCap = IO_BATCH_TTY;
+  }
+  else if(bFile)  // no bigger than the file
+  {
+    pS->szInput = "file";
+    pS->cbBatch = IoRoundUp(dSize < IO_BATCH_FILE ? dSize : IO_BATCH_FILE);
+    pS->cbCap = IoRoundUp(dSize);
+  }
+  else  // a pipe or socket (or a device with no size), never more than it holds at once
+  {
+    pS->szInput = "pipe";
+    pS->cbBatch = IO_BATCH_PIPE;
+    pS->cbCap = IO_CAP_PIPE;
+
+#ifdef F_SETPIPE_SZ
+    if(!cbFixed && !fstat(iIn, &sStat) && S_ISFIFO(sStat.st_mode))
+    {
+      int cbPipe = fcntl(iIn, F_SETPIPE_SZ, IO_CAP_PIPE);
+
+      if(cbPipe < 0)  // not allowed (over /proc/sys/fs/pipe-max-size)
+        cbPipe = fcntl(iIn, F_GETPIPE_SZ);
+
+      if(cbPipe > 0 && (UINT)cbPipe < pS->cbCap)
+        pS->cbCap = cbPipe < IO_BATCH_PIPE ? IO_BATCH_PIPE : cbPipe;
+    }
+#endif // F_SETPIPE_SZ
+  }
+
+  if(cbFixed)
+  {
+    pS->cbBatch = pS->cbCap = cbFixed;
+  }
+
+  pS->bFixed = pS->cbBatch >= pS->cbCap;
+  pS->cbStart = pS->cbPrev = pS->cbBatch;
+}
+
+// after each read of 'cbData' bytes.  returns TRUE if 'cbBatch' changed
+
+BOOL IoScheduleUpdate(IO_SCHEDULE *pS, UINT cbData)
+{
+  double dNow, dRate;
+
+  if(pS->bFixed)
+    return(FALSE);
+
+  if(cbData < pS->cbBatch)  // limited by the input, not the buffers
+  {
+    pS->nBatches = 0;
+    return(FALSE);
+  }
+
+  dNow = GetElapsedSeconds();
+
+  if(!pS->nBatches++)  // the first one (at this size) starts the clock
+  {
+    pS->dStart = dNow;
+    pS->dBytes = 0;
+    return(FALSE);
+  }
+
+  pS->dBytes += cbData;
+
+  if(pS->nBatches <= IO_SAMPLE_BATCHES || dNow - pS->dStart < IO_SAMPLE_TIME)
+    return(FALSE);
+
+  dRate = pS->dBytes / (dNow - pS->dStart);
+  pS->nBatches = 0;
+
+  if(dRate < pS->dLastRate * 0.95)  // worse - back to the last one
+  {
+    pS->cbBatch = pS->cbPrev;  // (not half, if it was held to the cap)
+    pS->bFixed = TRUE;
+    return(TRUE);
+  }
+
+  pS->dLastRate = dRate;
+  pS->cbPrev = pS->cbBatch;
+  pS->cbBatch = pS->cbBatch * 2 < pS->cbCap ? pS->cbBatch * 2 : pS->cbCap;
+  pS->bFixed = pS->cbBatch >= pS->cbCap;
+
+  return(TRUE);
+}
+
+// the number of buffers that hold 'cbData' bytes, with the last one trimmed
+
+static int IovecTrim(struct iovec *pIov, int nIov, size_t cbData)
+{
+  int i1;
+
+  for(i1=0; i1 < nIov && cbData; i1++)
+  {
+    if(pIov[i1].iov_len > cbData)
+      pIov[i1].iov_len = cbData;
+
+    cbData -= pIov[i1].iov_len;
+  }
+
+  return(i1);
+}
+
+// write all of it, picking up where a short 'writev()' left off
+
+static int IovecWriteAll(int iFile, struct iovec *pIov, int nIov)
+{
+#ifdef WIN32
+
+  return(-1);
+
+#else // WIN32
+
+  while(nIov > 0)
+  {
+    ssize_t cb1 = writev(iFile, pIov, nIov > IOV_MAX ? IOV_MAX : nIov);
+
+    if(cb1 < 0)
+    {
+      if(errno == EINTR)
+        continue;
+
+      return(-1);
+    }
+
+    while(nIov > 0 && (size_t)cb1 >= pIov->iov_len)
+    {
+      cb1 -= pIov->iov_len;
+      pIov++;
+      nIov--;
+    }
+
+    if(nIov > 0)
+    {
+      pIov->iov_base = (LPBYTE)pIov->iov_base + cb1;
+      pIov->iov_len -= cb1;
+    }
+  }
+
+  return(0);
+
+#endif // WIN32
+}
+
+// (re)allocate the slots for 'cbBatch' bytes.  The old ones are zeroed and
+// go back to the pool.  returns the number of slots, or 0 on error
+
+static int IovecAllocSlots(LPBYTE *apSlot, int nSlots, UINT *pcbSlot, UINT cbBatch)
+{
+  int i1;
+
+  for(i1=0; i1 < nSlots; i1++)
+  {
+    memset(apSlot[i1], 0, *pcbSlot);
+    FreeAlignedBuffer(apSlot[i1], *pcbSlot);
+  }
+
+  nSlots = (cbBatch + IOV_SLOT_MAX - 1) / IOV_SLOT_MAX;
+
+  if(nSlots > IOV_SLOTS)
+    nSlots = IOV_SLOTS;
+
+  *pcbSlot = ((cbBatch + nSlots - 1) / nSlots + 4095) & ~4095U;
+
+  for(i1=0; i1 < nSlots; i1++)
+  {
+    apSlot[i1] = AllocAlignedBuffer(*pcbSlot);
+
+    if(!apSlot[i1])
+    {
+      while(i1-- > 0)
+        FreeAlignedBuffer(apSlot[i1], *pcbSlot);
+
+      return(0);
+    }
+  }
+
+  return(nSlots);
+}
+
+int IovecDataTransfer(const BYTE *lpDict, int iIn, int iOut,
+                      BYTE *pbSeed, UINT cbKeySize, BOOL bDecryptFlag,
+                      IO_SCHEDULE *pSched, PERF_COUNTERS *pPerf, double *pdTotal)
+{
+#ifdef WIN32
+
+  return(-1);  // use 'fread()'
+
+#else // WIN32
+
+  struct iovec aIov[IOV_SLOTS];
+  LPBYTE apSlot[IOV_SLOTS];
+  UINT cbSlot = 0;
+  int i1, nIov, iRval = 0;
+  int nSlots = IovecAllocSlots(apSlot, 0, &cbSlot, pSched->cbBatch);
+
+  if(!nSlots)
+  {
+    fprintf(stderr, "Not enough memory to complete the desired operation.\n");
+    return(-1);
+  }
+
+  while(1)
+  {
+    for(i1=0; i1 < nSlots; i1++)
+    {
+      aIov[i1].iov_base = apSlot[i1];
+      aIov[i1].iov_len = cbSlot;
+    }
+
+    ssize_t cbRead = readv(iIn, aIov, IovecTrim(aIov, nSlots, pSched->cbBatch));
+
+    if(cbRead < 0)
+    {
+      if(errno == EINTR)
+        continue;
+
+      fprintf(stderr, "Read error on input file\n");
+      iRval = -1;
+      break;
+    }
+
+    if(!cbRead)
+      break;
+
+    nIov = IovecTrim(aIov, nSlots, cbRead);
+
+    PerfCountersStart(pPerf);
+
+    EncryptDataStreamV(lpDict, aIov, nIov, pbSeed, cbKeySize, bDecryptFlag, 0,
+                       lpfnEncryptDataStream);
+
+    PerfCountersStop(pPerf);
+
+    if(IovecWriteAll(iOut, aIov, nIov))
+    {
+      fprintf(stderr, "Write error on output file\n");
+      iRval = 3;
+      break;
+    }
+
+    *pdTotal += cbRead;
+
+    if(IoScheduleUpdate(pSched, (UINT)cbRead) &&
+       !(nSlots = IovecAllocSlots(apSlot, nSlots, &cbSlot, pSched->cbBatch)))
+    {
+      fprintf(stderr, "Not enough memory to complete the desired operation.\n");
+      return(-1);
+    }
+  }
+
+  for(i1=0; i1 < nSlots; i1++)
+  {
+    memset(apSlot[i1], 0, cbSlot);
+    FreeAlignedBuffer(apSlot[i1], cbSlot);
+  }
+
+  return(iRval);
+
+#endif // WIN32
+}
+
+// '--bench':  the main I/O loop with each fixed buffer size and with the
+// schedule, reading a file, a pipe (fed by a thread) and lots of small
+// files (a few secrets).  Output to /dev/null, and with the version 1
+// cipher, so there's something left to see besides the cipher.
+
+#define BENCH_SMALL_FILE  1024
+#define BENCH_SMALL_COUNT 200
+
+#ifndef WIN32
+
+typedef struct tagBENCH_PIPE
+{
+  int iFile;
+  const BYTE *pData;
+  UINT cbData;
+} BENCH_PIPE;
+
+static void *BenchPipeThread(void *pArg)
+{
+  BENCH_PIPE *pP = (BENCH_PIPE *)pArg;
+  sigset_t sSet;
+  UINT cb1;
+
+  // if the reader gives up early, 'write()' fails with EPIPE - SIGPIPE
+  // would end the whole benchmark
+
+  sigemptyset(&sSet);
+  sigaddset(&sSet, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &sSet, NULL);
+
+  for(cb1=0; cb1 < pP->cbData; )
+  {
+    ssize_t cb2 = write(pP->iFile, pP->pData + cb1,
+                        pP->cbData - cb1 < 65536 ? pP->cbData - cb1 : 65536);
+
+    if(cb2 <= 0)
+      break;
+
+    cb1 += cb2;
+  }
+
+  close(pP->iFile);
+
+  return(NULL);
+}
+
+// one run, returns the time (or a negative number on error)
+
+static double BenchTransfer(const BYTE *lpDict, const BYTE *pbSeed0, int iIn,
+                            UINT cbFixed, UINT *pcbFinal)
+{
+  BYTE pbSeed[16];
+  IO_SCHEDULE sSched;
+  double dStart, dTotal = 0;
+  int iNull = open("/dev/null", O_WRONLY), iRval;
+
+  memcpy(pbSeed, pbSeed0, sizeof(pbSeed));
+  IoScheduleInit(&sSched, iIn, cbFixed);
+
+  dStart = GetElapsedSeconds();
+
+  iRval = IovecDataTransfer(lpDict, iIn, iNull, pbSeed, sizeof(pbSeed),
+                            FALSE, &sSched, NULL, &dTotal);
+
+  dStart = GetElapsedSeconds() - dStart;
+
+  close(iNull);
+  *pcbFinal = sSched.cbBatch;
+
+  return(iRval ? -1.0 : dStart);
+}
+
+#endif // WIN32
+
+void BenchmarkBufferSizes(const BYTE *lpDict, const BYTE *pbSeed0, UINT cbMB)
+{
+#ifndef WIN32
+
+  static const UINT acbFixed[] = { 4096, 32768, 0x20000, 0x80000, 0x200000, 0x800000, 0 };
+  const int nSizes = sizeof(acbFixed) / sizeof(acbFixed[0]);
+  LPENCRYPTDATASTREAM lpfnSave = lpfnEncryptDataStream;
+  char szPath[] = "/tmp/sftcrypt-bench-XXXXXX";
+  UINT cbData = (cbMB < 32 ? cbMB : 32) * 0x100000;
+  LPBYTE pData = new BYTE[cbData];
+  int iFile, i1, iClass;
+
+  iFile = pData ? mkstemp(szPath) : -1;
+
+  if(iFile < 0)
+  {
+    delete[] pData;
+    return;
+  }
+
+  unlink(szPath);
+
+  for(i1=0; (UINT)i1 < cbData; i1++)
+    pData[i1] = (BYTE)(i1 * 13 + (i1 >> 11));
+
+  if(write(iFile, pData, cbData) != (ssize_t)cbData)
+  {
+    close(iFile);
+    delete[] pData;
+    return;
+  }
+
+  lpfnEncryptDataStream = EncryptDataStream;
+
+  fprintf(stderr, "buffer sizes (v1 cipher):  %uMb file, %uMb pipe, %u x %u byte files\n",
+          cbData / 0x100000, cbData / 0x100000, BENCH_SMALL_COUNT, BENCH_SMALL_FILE);
+
+  for(iClass=0; iClass < 3; iClass++)
+  {
+    static const LPCSTR aszClass[3] = { "file ", "pipe ", "small" };
+
+    for(i1=0; i1 < nSizes; i1++)
+    {
+      double dTime = 0, dBytes = cbData;
+      UINT cbFinal = 0, u1;
+
+      if(iClass == 0)
+      {
+        lseek(iFile, 0, SEEK_SET);
+        dTime = BenchTransfer(lpDict, pbSeed0, iFile, acbFixed[i1], &cbFinal);
+      }
+      else if(iClass == 1)
+      {
+        BENCH_PIPE sPipe;
+        pthread_t thread;
+        int aiPipe[2];
+
+        if(pipe(aiPipe))
+          break;
+
+        sPipe.iFile = aiPipe[1];
+        sPipe.pData = pData;
+        sPipe.cbData = cbData;
+
+        if(pthread_create(&thread, NULL, BenchPipeThread, &sPipe))
+        {
+          close(aiPipe[0]);
+          close(aiPipe[1]);
+          break;
+        }
+
+        dTime = BenchTransfer(lpDict, pbSeed0, aiPipe[0], acbFixed[i1], &cbFinal);
+
+        close(aiPipe[0]);  // (the thread gets EPIPE if it didn't finish)
+        pthread_join(thread, NULL);
+      }
+      else
+      {
+        // the first 1k of the file, over and over - each one a new 'file'
+
+        dBytes = (double)BENCH_SMALL_COUNT * BENCH_SMALL_FILE;
+
+        if(ftruncate(iFile, BENCH_SMALL_FILE))
+          break;
+
+        for(u1=0; u1 < BENCH_SMALL_COUNT && dTime >= 0; u1++)
+        {
+          double dOne;
+
+          lseek(iFile, 0, SEEK_SET);
+          dOne = BenchTransfer(lpDict, pbSeed0, iFile, acbFixed[i1], &cbFinal);
+          dTime = dOne < 0 ? dOne : dTime + dOne;
+        }
+      }
+
+      if(dTime < 0)
+      {
+        fprintf(stderr, "  %s  FAILED\n", aszClass[iClass]);
+        break;
+      }
+
+      if(acbFixed[i1])
+        fprintf(stderr, "  %s  %7uk    ", aszClass[iClass], acbFixed[i1] / 1024);
+      else
+        fprintf(stderr, "  %s  adaptive  ", aszClass[iClass]);
+
+      if(iClass == 2)
+        fprintf(stderr, "%8.1f usec/file", dTime / BENCH_SMALL_COUNT * 1e6);
+      else
+        fprintf(stderr, "%8.2f MB/s", dBytes / dTime / 1048576.0);
+
+      if(!acbFixed[i1])
+        fprintf(stderr, "  (ended at %uk)", cbFinal / 1024);
+
+      fprintf(stderr, "\n");
+    }
+  }
+
+  lpfnEncryptDataStream = lpfnSave;
+
+  close(iFile);
+  delete[] pData;
+
+#endif // WIN32
+}
+
+// fragmented records for '--bench':  a 16 byte header, a 200 byte payload
+// and an 8 byte trailer, each in its own buffer.  Copying each record into
+// a staging buffer and encrypting it vs encrypting the pieces in place.
+
+#define BENCH_RECORDS 20000
+
+void BenchmarkIovec(const BYTE *lpDict, const BYTE *pbSeed0)
+{
+  static const UINT acbPart[3] = { 16, 200, 8 };
+  const UINT cbRecord = 16 + 200 + 8;
+  LPBYTE pParts = new BYTE[BENCH_RECORDS * cbRecord];  // each part is separate
+  LPBYTE pCheck = new BYTE[BENCH_RECORDS * cbRecord];
+  BYTE pbSeed[16];
+  struct iovec aIov[3];
+  UINT i1, i2, cb1;
+  int iCipher;
+
+  if(!pParts || !pCheck)
+    return;
+
+  for(iCipher=0; iCipher < 2; iCipher++)
+  {
+    LPENCRYPTDATASTREAM lpfnCipher = iCipher ? EncryptDataStream : EncryptDataStream2;
+    double dCopy, dIovec;
+
+    // the parts are laid out part 0 for every record, then part 1, etc.
+    // so no record is contiguous
+
+    for(cb1=0; cb1 < BENCH_RECORDS * cbRecord; cb1++)
+      pParts[cb1] = (BYTE)(cb1 * 7);
+
+    // copied into a staging buffer (one per record, so the results can
+    // be checked against the in place version)
+
+    memcpy(pbSeed, pbSeed0, sizeof(pbSeed));
+    dCopy = GetElapsedSeconds();
+
+    for(i1=0; i1 < BENCH_RECORDS; i1++)
+    {
+      LPBYTE p1 = pParts, pStage = pCheck + i1 * cbRecord, p2 = pStage;
+
+      for(i2=0; i2 < 3; p1 += BENCH_RECORDS * acbPart[i2], p2 += acbPart[i2], i2++)
+        memcpy(p2, p1 + i1 * acbPart[i2], acbPart[i2]);
+
+      lpfnCipher(lpDict, pStage, cbRecord, pbSeed, sizeof(pbSeed), FALSE, 0);
+    }
+
+    dCopy = GetElapsedSeconds() - dCopy;
+
+    // in place, with 'EncryptDataStreamV()'
+
+    memcpy(pbSeed, pbSeed0, sizeof(pbSeed));
+    dIovec = GetElapsedSeconds();
+
+    for(i1=0; i1 < BENCH_RECORDS; i1++)
+    {
+      LPBYTE p1 = pParts;
+
+      for(i2=0; i2 < 3; p1 += BENCH_RECORDS * acbPart[i2], i2++)
+      {
+        aIov[i2].iov_base = p1 + i1 * acbPart[i2];
+        aIov[i2].iov_len = acbPart[i2];
+      }
+
+      EncryptDataStreamV(lpDict, aIov, 3, pbSeed, sizeof(pbSeed), FALSE, 0, lpfnCipher);
+    }
+
+    dIovec = GetElapsedSeconds() - dIovec;
+
+    // same cipher text?
+
+    BOOL bMatch = TRUE;
+
+    for(i1=0; i1 < BENCH_RECORDS && bMatch; i1++)
+    {
+      LPBYTE p1 = pParts, p2 = pCheck + i1 * cbRecord;
+
+      for(i2=0; i2 < 3; p1 += BENCH_RECORDS * acbPart[i2], p2 += acbPart[i2], i2++)
+      {
+        if(memcmp(p2, p1 + i1 * acbPart[i2], acbPart[i2]))
+          bMatch = FALSE;
+      }
+    }
+
+    fprintf(stderr, "%s records (%u+%u+%u):  copy %6.0f ns/record  iovec %6.0f ns/record%s\n",
+            iCipher ? "v1" : "v2", acbPart[0], acbPart[1], acbPart[2],
+            dCopy / BENCH_RECORDS * 1e9, dIovec / BENCH_RECORDS * 1e9,
+            bMatch ? "" : "  ** MISMATCH **");
+  }
+
+  delete[] pParts;
+  delete[] pCheck;
+}
+
+
+// multiple outputs ('tee').  Each buffer is encrypted once and queued for
+// every destination, each of which has its own writer thread and a queue
+// of (at most) TEE_QUEUE_DEPTH buffers.  The buffers are shared; one goes
+// back to the free list when the last writer is done with it.  A slow
+// destination only holds up the reader once its own queue is full, so
+// the others keep writing at their own speed until then.  If a write
+// fails, that destination is dropped (and reported), and the rest carry on.
+
+#define TEE_BUFFER_SIZE 0x40000 /* 256k */
+#define TEE_QUEUE_DEPTH 8
+#define TEE_BUFFERS     (TEE_QUEUE_DEPTH + 2) /* enough for every queue to be full */
+
+#ifndef WIN32
+
+typedef struct tagTEE_BUFFER
+{
+  LPBYTE pData;
+  UINT cbData;
+  int nRefs;  // writers still to write it
+} TEE_BUFFER;
+
+typedef struct tagTEE_SHARED
+{
+  pthread_mutex_t mtx;
+  pthread_cond_t cndFree;
+  TEE_BUFFER *apFree[TEE_BUFFERS];
+  int nFree;
+} TEE_SHARED;
+
+typedef struct tagTEE_DEST
+{
+  LPCSTR szName;
+  int iFile;
+  TEE_SHARED *pShared;
+
+  pthread_mutex_t mtx;
+  pthread_cond_t cndNotEmpty, cndNotFull;
+  TEE_BUFFER *apQueue[TEE_QUEUE_DEPTH];
+  int iHead, nQueued;
+  BOOL bEOF, bError;
+
+  double dBytes, dDone;  // for statistics
+  UINT nFull;            // times the reader had to wait for this one
+} TEE_DEST;
+
+static void TeeRelease(TEE_SHARED *pS, TEE_BUFFER *pB)
+{
+  pthread_mutex_lock(&pS->mtx);
+
+  if(!--(pB->nRefs))
+  {
+    pS->apFree[pS->nFree++] = pB;
+    pthread_cond_signal(&pS->cndFree);
+  }
+
+  pthread_mutex_unlock(&pS->mtx);
+}
+
+static void * TeeWriterThread(void *pArg)
+{
+  TEE_DEST *pD = (TEE_DEST *)pArg;
+
+  while(1)
+  {
+    TEE_BUFFER *pB;
+
+    pthread_mutex_lock(&pD->mtx);
+
+    while(!pD->nQueued && !pD->bEOF)
+      pthread_cond_wait(&pD->cndNotEmpty, &pD->mtx);
+
+    if(!pD->nQueued) // EOF and nothing left
+    {
+      pthread_mutex_unlock(&pD->mtx);
+      break;
+    }
+
+    pB = pD->apQueue[pD->iHead];
+    pD->iHead = (pD->iHead + 1) % TEE_QUEUE_DEPTH;
+    pD->nQueued--;
+
+    pthread_cond_signal(&pD->cndNotFull);
+    pthread_mutex_unlock(&pD->mtx);
+
+    UINT cb1 = 0;
+
+    while(!pD->bError && cb1 < pB->cbData)
+    {
+      ssize_t cb2 = write(pD->iFile, pB->pData + cb1, pB->cbData - cb1);
+
+      if(cb2 < 0 && errno == EINTR)
+        continue;
+
+      if(cb2 <= 0)
+      {
+        fprintf(stderr, "Write error on output file '%s' (error %d), dropping it\n",
+                pD->szName, errno);
+
+        pthread_mutex_lock(&pD->mtx);
+        pD->bError = TRUE;  // the reader stops queueing for it
+        pthread_mutex_unlock(&pD->mtx);
+        break;
+      }
+
+      cb1 += cb2;
+    }
+
+    pD->dBytes += cb1;
+
+    TeeRelease(pD->pShared, pB);
+  }
+
+  pD->dDone = GetElapsedSeconds();
+
+  return(NULL);
+}
+
+#endif // WIN32
+
+int TeeDataTransfer(const BYTE *lpDict, int iIn, LPCSTR *pszOut, int nOut,
+                    BYTE *pbSeed, UINT cbKeySize, BOOL bDecryptFlag, BOOL bStats)
+{
+#ifdef WIN32
+
+  fprintf(stderr, "multiple output files are not supported on this platform\n");
+  return(2);
+
+#else // WIN32
+
+  TEE_SHARED sShared;
+  TEE_BUFFER aBuf[TEE_BUFFERS];
+  TEE_DEST *pDest = new TEE_DEST[nOut];
+  pthread_t *pThread = new pthread_t[nOut];
+  double dStart = GetElapsedSeconds(), dTotal = 0;
+  int i1, nStarted = 0, iRval = 0;
+
+  memset(aBuf, 0, sizeof(aBuf));
+
+  if(!pDest || !pThread)
+  {
+    fprintf(stderr, "Not enough memory to complete the desired operation.\n");
+    return(-1);
+  }
+
+  // a destination that goes away (a pipe whose reader exits) is dropped
+  // like any other write error, not the end of the whole process
+
+  signal(SIGPIPE, SIG_IGN);
+
+  pthread_mutex_init(&sShared.mtx, NULL);
+  pthread_cond_init(&sShared.cndFree, NULL);
+  sShared.nFree = 0;
+
+  for(i1=0; i1 < TEE_BUFFERS; i1++)
+  {
+    aBuf[i1].pData = AllocAlignedBuffer(TEE_BUFFER_SIZE);
+
+    if(!aBuf[i1].pData)
+    {
+      fprintf(stderr, "Not enough memory to complete the desired operation.\n");
+      iRval = -1;
+      goto done;
+    }
+
+    sShared.apFree[sShared.nFree++] = aBuf + i1;
+  }
+
+  // open every output first, so that nothing is written if one can't be
+
+  for(i1=0; i1 < nOut; i1++)
+  {
+    TEE_DEST *pD = pDest + i1;
+
+    memset(pD, 0, sizeof(*pD));
+    pD->szName = strcmp(pszOut[i1], "-") ? pszOut[i1] : "(stdout)";
+    pD->pShared = &sShared;
+
+    if(!strcmp(pszOut[i1], "-"))
+    {
+      pD->iFile = _fileno(stdout);
+    }
+    else
+    {
+      struct stat sStat;
+
+      // just in case (but only files - some outputs may be pipes or devices)
+
+      if(!lstat(pszOut[i1], &sStat) && S_ISREG(sStat.st_mode))
+        unlink(pszOut[i1]);
+
+      pD->iFile = open(pszOut[i1], O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    }
+
+    if(pD->iFile < 0)
+    {
+      fprintf(stderr, "Unable to open output file '%s'\n", pszOut[i1]);
+
+      while(i1-- > 0)
+      {
+        if(pDest[i1].iFile != _fileno(stdout))
+          close(pDest[i1].iFile);
+      }
+
+      iRval = -1;
+      goto done;
+    }
+
+    pthread_mutex_init(&pD->mtx, NULL);
+    pthread_cond_init(&pD->cndNotEmpty, NULL);
+    pthread_cond_init(&pD->cndNotFull, NULL);
+  }
+
+  for(nStarted=0; nStarted < nOut; nStarted++)
+  {
+    if(pthread_create(pThread + nStarted, NULL, TeeWriterThread, pDest + nStarted))
+    {
+      fprintf(stderr, "Unable to start a writer thread\n");
+      iRval = -1;
+      break;
+    }
+  }
+
+  while(!iRval)
+  {
+    TEE_BUFFER *pB;
+    UINT cbRead = 0;
+
+    // a free buffer (once the slowest writer is done with one)
+
+    pthread_mutex_lock(&sShared.mtx);
+
+    while(!sShared.nFree)
+      pthread_cond_wait(&sShared.cndFree, &sShared.mtx);
+
+    pB = sShared.apFree[--sShared.nFree];
+
+    pthread_mutex_unlock(&sShared.mtx);
+
+    while(cbRead < TEE_BUFFER_SIZE)  // fill it, unless it's the end
+    {
+      ssize_t cb1 = read(iIn, pB->pData + cbRead, TEE_BUFFER_SIZE - cbRead);
+
+      if(cb1 < 0 && errno == EINTR)
+        continue;
+
+      if(cb1 < 0)
+      {
+        fprintf(stderr, "Read error on input file\n");
+        iRval = -1;
+      }
+
+      if(cb1 <= 0)
+        break;
+
+      cbRead += cb1;
+    }
+
+    if(!cbRead)
+    {
+      pthread_mutex_lock(&sShared.mtx);
+      sShared.apFree[sShared.nFree++] = pB;
+      pthread_mutex_unlock(&sShared.mtx);
+      break;
+    }
+
+    // encrypt it once, then queue it for every destination
+
+    lpfnEncryptDataStream(lpDict, pB->pData, cbRead, pbSeed, cbKeySize, bDecryptFlag, 0);
+
+    pB->cbData = cbRead;
+    pB->nRefs = nOut + 1;  // +1 for me, so it can't be freed while I queue it
+
+    for(i1=0; i1 < nOut; i1++)
+    {
+      TEE_DEST *pD = pDest + i1;
+
+      pthread_mutex_lock(&pD->mtx);
+
+      if(pD->bError)  // set by its writer, so only looked at with 'mtx'
+      {
+        pthread_mutex_unlock(&pD->mtx);
+        TeeRelease(&sShared, pB);
+        continue;
+      }
+
+      if(pD->nQueued == TEE_QUEUE_DEPTH)
+      {
+        pD->nFull++;
+
+        while(pD->nQueued == TEE_QUEUE_DEPTH)
+          pthread_cond_wait(&pD->cndNotFull, &pD->mtx);
+      }
+
+      pD->apQueue[(pD->iHead + pD->nQueued) % TEE_QUEUE_DEPTH] = pB;
+      pD->nQueued++;
+
+      pthread_cond_signal(&pD->cndNotEmpty);
+      pthread_mutex_unlock(&pD->mtx);
+    }
+
+    TeeRelease(&sShared, pB);
+
+    dTotal += cbRead;
+  }
+
+  // tell the writers to finish up, and wait for them
+
+  for(i1=0; i1 < nOut; i1++)
+  {
+    pthread_mutex_lock(&pDest[i1].mtx);
+    pDest[i1].bEOF = TRUE;
+    pthread_cond_signal(&pDest[i1].cndNotEmpty);
+    pthread_mutex_unlock(&pDest[i1].mtx);
+  }
+
+  for(i1=0; i1 < nStarted; i1++)
+    pthread_join(pThread[i1], NULL);
+
+  for(i1=0; i1 < nOut; i1++)
+  {
+    TEE_DEST *pD = pDest + i1;
+
+    if(pD->iFile != _fileno(stdout) && close(pD->iFile) && !pD->bError)
+    {
+      fprintf(stderr, "Write error on output file '%s'\n", pD->szName);
+      pD->bError = TRUE;
+    }
+
+    if(pD->bError && !iRval)
+      iRval = 3;
+
+    if(bStats)
+    {
+      double dTime = pD->dDone - dStart;
+
+      fprintf(stderr, "%s:  %.0f bytes in %.3f sec, %.2f MB/s, reader waited %u times%s\n",
+              pD->szName, pD->dBytes, dTime,
+              dTime > 0 ? pD->dBytes / dTime / 1048576.0 : 0.0,
+              pD->nFull, pD->bError ? " (FAILED)" : "");
+    }
+
+    pthread_mutex_destroy(&pD->mtx);
+    pthread_cond_destroy(&pD->cndNotEmpty);
+    pthread_cond_destroy(&pD->cndNotFull);
+  }
+
+  if(bStats)
+  {
+    dStart = GetElapsedSeconds() - dStart;
+
+    fprintf(stderr, "%.0f bytes encrypted once for %d outputs in %.3f sec, %.2f MB/s\n",
+            dTotal, nOut, dStart, dStart > 0 ? dTotal / dStart / 1048576.0 : 0.0);
+  }
+
+done:
+
+  for(i1=0; i1 < TEE_BUFFERS; i1++)
+  {
+    if(aBuf[i1].pData)
+    {
+      memset(aBuf[i1].pData, 0, TEE_BUFFER_SIZE); // plain text, if decrypting
+      FreeAlignedBuffer(aBuf[i1].pData, TEE_BUFFER_SIZE);
+    }
+  }
+
+  pthread_mutex_destroy(&sShared.mtx);
+  pthread_cond_destroy(&sShared.cndFree);
+
+  delete[] pDest;
+  delete[] pThread;
+
+  return(iRval);
+
+#endif // WIN32
+}
+
+
+// encrypted shared memory ring, for streaming between two local processes
+// (Linux).  One producer and one consumer share a segment (a 'memfd', or a
+// file in /dev/shm) that has a header and a power-of-2 sized data ring.
+// 'uHead' (bytes written) is only written by the producer and 'uTail'
+// (bytes read) only by the consumer, each in its own cache line, so no
+// locks are needed.  The producer copies data into the ring and encrypts
+// it there (with its own seed state) before publishing it; the consumer
+// copies it out and decrypts it in its own buffer (with the matching seed
+// state), so the plain text is never visible in the segment.
+//
+// A side that has to wait reads the other side's wake-up sequence number,
+// sets its 'waiting' flag, checks again, and then sleeps in FUTEX_WAIT on
+// that sequence number.  The other side only bumps it and makes the
+// FUTEX_WAKE system call when it sees the flag, so a ring that
+// never runs empty (or full) needs no system calls at all.  On machines
+// with more than one CPU it spins for a short while before sleeping.
+//
+// Each side puts its process ID in the header when it maps the ring.  The
+// futex waits time out every SHM_WAIT_MSEC, and after every wake-up a side
+// that's still waiting checks that the other process is alive, so if one
+// of them dies (or is killed) the other gets an error instead of waiting
+// forever.
+
+#define SHM_RING_MAGIC  0x53465452 /* 'SFTR' */
+#define SHM_RING_HEADER 4096       /* the data starts on the next page */
+#define SHM_RING_SIZE   0x100000   /* default - 1Mb */
+#define SHM_SPIN_COUNT  4000
+#define SHM_WAIT_MSEC   100
+
+typedef struct tagSHM_RING_HDR
+{
+  DWORD dwMagic;
+  UINT cbRing;
+  volatile DWORD dwProducerPid;  // 0 until that side has mapped it
+  volatile DWORD dwConsumerPid;
+  BYTE abPad0[48];
+
+  // the producer's cache line
+  volatile UINT uHead;
+  volatile UINT uClosed;
+  volatile UINT uDataSeq;          // the consumer waits on this
+  volatile UINT uProducerWaiting;  // for space
+  BYTE abPad1[48];
+
+  // the consumer's cache line
+  volatile UINT uTail;
+  volatile UINT uSpaceSeq;         // the producer waits on this
+  volatile UINT uConsumerWaiting;  // for data
+  BYTE abPad2[52];
+} SHM_RING_HDR;
+
+struct tagSHM_RING
+{
+  SHM_RING_HDR *pHdr;
+  LPBYTE pData;
+  UINT cbRing, cbMap;
+  BOOL bProducer;
+  int nSpin;
+  const BYTE *lpDict;
+  LPENCRYPTDATASTREAM lpfnCipher;  // both sides must use the same one
+  BYTE pbSeed[16];
+};
+
+#ifdef __linux__
+
+static void ShmFutexWait(volatile UINT *pWord, UINT uVal)
+{
+  struct timespec ts;
+
+  ts.tv_sec = 0;
+  ts.tv_nsec = SHM_WAIT_MSEC * 1000000L;
+
+  syscall(SYS_futex, pWord, FUTEX_WAIT, uVal, &ts, NULL, 0);
+}
+
+// TRUE if the other side has mapped the ring and its process is gone (or
+// is a child of mine that has exited, but hasn't been waited for yet)
+
+static BOOL ShmPeerGone(SHM_RING *pR)
+{
+  pid_t pid = (pid_t)__atomic_load_n(pR->bProducer ? &pR->pHdr->dwConsumerPid
+                                                   : &pR->pHdr->dwProducerPid,
+                                     __ATOMIC_ACQUIRE);
+  siginfo_t sInfo;
+
+  if(!pid)
+    return(FALSE);
+
+  if(kill(pid, 0) && errno == ESRCH)
+    return(TRUE);
+
+  memset(&sInfo, 0, sizeof(sInfo));
+
+  return(!waitid(P_PID, pid, &sInfo, WEXITED | WNOHANG | WNOWAIT) &&
+         sInfo.si_pid == pid);
+}
+
+static void ShmFutexWake(volatile UINT *pWord)
+{
+  syscall(SYS_futex, pWord, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+// wait for '*pWord' to be something other than 'uVal' (or for '*pClosed').
+// returns FALSE if the other side has gone away in the meantime
+
+static BOOL ShmRingWait(SHM_RING *pR, volatile UINT *pWord, UINT uVal,
+                        volatile UINT *pClosed, volatile UINT *pSeq,
+                        volatile UINT *pWaiting)
+{
+  int i1;
+
+  for(i1=0; i1 < pR->nSpin; i1++)
+  {
+    if(__atomic_load_n(pWord, __ATOMIC_ACQUIRE) != uVal ||
+       (pClosed && __atomic_load_n(pClosed, __ATOMIC_ACQUIRE)))
+    {
+      return(TRUE);
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif // x86
+  }
+
+  UINT uSeq = __atomic_load_n(pSeq, __ATOMIC_ACQUIRE);
+
+  __atomic_store_n(pWaiting, 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  // the other side either sees the flag (and changes '*pSeq', so the
+  // FUTEX_WAIT returns right away if it's too late), or I see what it did
+
+  if(__atomic_load_n(pWord, __ATOMIC_ACQUIRE) == uVal &&
+     !(pClosed && __atomic_load_n(pClosed, __ATOMIC_ACQUIRE)))
+  {
+    ShmFutexWait(pSeq, uSeq);
+
+    // woken up, or timed out - if there's still nothing, is it still there?
+
+    if(__atomic_load_n(pWord, __ATOMIC_ACQUIRE) == uVal &&
+       !(pClosed && __atomic_load_n(pClosed, __ATOMIC_ACQUIRE)) &&
+       ShmPeerGone(pR))
+    {
+      return(FALSE);
+    }
+  }
+
+  return(TRUE);
+}
+
+// after changing something, wake the other side if it's waiting
+
+static void ShmRingNotify(volatile UINT *pSeq, volatile UINT *pWaiting, BOOL bAlways)
+{
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  if(bAlways || __atomic_load_n(pWaiting, __ATOMIC_RELAXED))
+  {
+    __atomic_store_n(pWaiting, 0, __ATOMIC_RELAXED);
+    __atomic_add_fetch(pSeq, 1, __ATOMIC_RELEASE);
+    ShmFutexWake(pSeq);
+  }
+}
+
+#endif // __linux__
+
+// a new segment of (at least) 'cbRing' bytes, as a memfd (for a child
+// process) if 'szPath' is NULL, or a file (i.e. in /dev/shm).  An existing
+// file is only replaced if it's a ring.  returns the file descriptor, or -1
+// on error (EEXIST if something else is in the way)
+
+int ShmRingCreate(LPCSTR szPath, UINT cbRing)
+{
+#ifdef __linux__
+
+  SHM_RING_HDR sHdr;
+  UINT cb1;
+  int iFile;
+
+  for(cb1=4096; cb1 < cbRing && cb1 < 0x40000000; cb1 <<= 1)
+    { }
+
+  if(szPath)
+  {
+    iFile = open(szPath, O_RDWR | O_CREAT | O_EXCL, 0600);
+
+    if(iFile < 0 && errno == EEXIST)
+    {
+      // a stale ring (from a crash) is replaced, but nothing else is
+
+      struct stat sStat;
+      DWORD dwMagic = 0;
+      int iOld = open(szPath, O_RDONLY | O_NOFOLLOW | O_NONBLOCK);
+
+      if(iOld >= 0)
+      {
+        if(fstat(iOld, &sStat) || !S_ISREG(sStat.st_mode) ||
+           pread(iOld, &dwMagic, sizeof(dwMagic), 0) != sizeof(dwMagic))
+        {
+          dwMagic = 0;
+        }
+
+        close(iOld);
+      }
+
+      if(dwMagic != SHM_RING_MAGIC)
+      {
+        errno = EEXIST;
+        return(-1);
+      }
+
+      unlink(szPath);
+      iFile = open(szPath, O_RDWR | O_CREAT | O_EXCL, 0600);
+    }
+  }
+  else
+  {
+#ifdef SYS_memfd_create
+    iFile = (int)syscall(SYS_memfd_create, "sftcrypt-ring", 0);
+#else // SYS_memfd_create
+    iFile = -1;
+    errno = ENOSYS;
+#endif // SYS_memfd_create
+  }
+
+  if(iFile < 0)
+    return(-1);
+
+  memset(&sHdr, 0, sizeof(sHdr));
+  sHdr.cbRing = cb1;
+
+  if(ftruncate(iFile, SHM_RING_HEADER + cb1) ||
+     pwrite(iFile, &sHdr, sizeof(sHdr), 0) != sizeof(sHdr))
+  {
+    close(iFile);
+
+    if(szPath)
+      unlink(szPath);
+
+    return(-1);
+  }
+
+  // the magic number goes in last, so the other side knows it's ready
+
+  sHdr.dwMagic = SHM_RING_MAGIC;
+
+  if(pwrite(iFile, &sHdr.dwMagic, sizeof(sHdr.dwMagic), 0) != sizeof(sHdr.dwMagic))
+  {
+    close(iFile);
+    return(-1);
+  }
+
+  return(iFile);
+
+#else // __linux__
+
+  fprintf(stderr, "shared memory rings are not supported on this platform\n");
+  return(-1);
+
+#endif // __linux__
+}
+
+// map the segment as the producer or the consumer, with the dictionary,
+// initial seed and cipher.  returns NULL on error
+
+SHM_RING *ShmRingOpen(int iFile, BOOL bProducer, const BYTE *lpDict,
+                      const BYTE *pbSeed, UINT cbKeySize,
+                      LPENCRYPTDATASTREAM lpfnCipher /* = EncryptDataStream2 */)
+{
+#ifdef __linux__
+
+  struct stat sStat;
+  SHM_RING *pR;
+  void *pMap;
+
+  if(cbKeySize != sizeof(pR->pbSeed) || fstat(iFile, &sStat) ||
+     sStat.st_size < SHM_RING_HEADER + 4096)
+  {
+    return(NULL);
+  }
+
+  pMap = mmap(NULL, sStat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, iFile, 0);
+
+  if(pMap == MAP_FAILED)
+    return(NULL);
+
+  pR = new SHM_RING;
+
+  if(!pR)
+  {
+    munmap(pMap, sStat.st_size);
+    return(NULL);
+  }
+
+  pR->pHdr = (SHM_RING_HDR *)pMap;
+  pR->pData = (LPBYTE)pMap + SHM_RING_HEADER;
+  pR->cbMap = (UINT)sStat.st_size;
+  pR->cbRing = pR->pHdr->cbRing;
+  pR->bProducer = bProducer;
+  pR->nSpin = GetDefaultThreadCount() > 1 ? SHM_SPIN_COUNT : 0;
+  pR->lpDict = lpDict;
+  pR->lpfnCipher = lpfnCipher;
+  memcpy(pR->pbSeed, pbSeed, sizeof(pR->pbSeed));
+
+  if(pR->pHdr->dwMagic != SHM_RING_MAGIC || pR->cbRing & (pR->cbRing - 1) ||
+     pR->cbRing > pR->cbMap - SHM_RING_HEADER)
+  {
+    munmap(pMap, pR->cbMap);
+    delete pR;
+    return(NULL);
+  }
+
+  __atomic_store_n(bProducer ? &pR->pHdr->dwProducerPid : &pR->pHdr->dwConsumerPid,
+                   (DWORD)getpid(), __ATOMIC_RELEASE);
+
+  return(pR);
+
+#else // __linux__
+
+  return(NULL);
+
+#endif // __linux__
+}
+
+// write (and encrypt) all of 'cbData' bytes, waiting for space as needed.
+// returns 0, or -1 if this isn't the producer or the consumer has gone away
+// (errno is EPIPE)
+
+int ShmRingWrite(SHM_RING *pR, const BYTE *pData, UINT cbData)
+{
+#ifdef __linux__
+
+  SHM_RING_HDR *pHdr = pR->pHdr;
+
+  if(!pR->bProducer)
+    return(-1);
+
+  while(cbData)
+  {
+    UINT uHead = pHdr->uHead;  // only I write it
+    UINT uTail = __atomic_load_n(&pHdr->uTail, __ATOMIC_ACQUIRE);
+    UINT cbFree = pR->cbRing - (uHead - uTail);
+
+    if(!cbFree)
+    {
+      if(!ShmRingWait(pR, &pHdr->uTail, uTail, NULL, &pHdr->uSpaceSeq,
+                      &pHdr->uProducerWaiting))
+      {
+        errno = EPIPE;
+        return(-1);
+      }
+
+      continue;
+    }
+
+    UINT cb1 = cbData < cbFree ? cbData : cbFree;
+    UINT cbPos = uHead & (pR->cbRing - 1);
+    struct iovec aIov[2];
+    int nIov = 1;
+
+    aIov[0].iov_base = pR->pData + cbPos;
+    aIov[0].iov_len = cb1;
+
+    if(cbPos + cb1 > pR->cbRing)  // wraps around
+    {
+      aIov[0].iov_len = pR->cbRing - cbPos;
+      aIov[1].iov_base = pR->pData;
+      aIov[1].iov_len = cb1 - aIov[0].iov_len;
+      nIov = 2;
+    }
+
+    memcpy(aIov[0].iov_base, pData, aIov[0].iov_len);
+
+    if(nIov > 1)
+      memcpy(aIov[1].iov_base, pData + aIov[0].iov_len, aIov[1].iov_len);
+
+    EncryptDataStreamV(pR->lpDict, aIov, nIov, pR->pbSeed, sizeof(pR->pbSeed), FALSE, 0,
+                       pR->lpfnCipher);
+
+    __atomic_store_n(&pHdr->uHead, uHead + cb1, __ATOMIC_RELEASE);
+    ShmRingNotify(&pHdr->uDataSeq, &pHdr->uConsumerWaiting, FALSE);
+
+    pData += cb1;
+    cbData -= cb1;
+  }
+
+  return(0);
+
+#else // __linux__
+
+  return(-1);
+
+#endif // __linux__
+}
+
+// read (and decrypt) up to 'cbMax' bytes, waiting for at least one.
+// returns the number of bytes, 0 at the end (once the producer has closed
+// it and it's empty), or -1 if this isn't the consumer or the producer has
+// gone away without closing it (errno is EPIPE)
+
+int ShmRingRead(SHM_RING *pR, LPBYTE pData, UINT cbMax)
+{
+#ifdef __linux__
+
+  SHM_RING_HDR *pHdr = pR->pHdr;
+
+  if(pR->bProducer)
+    return(-1);
+
+  while(1)
+  {
+    UINT uTail = pHdr->uTail;  // only I write it
+    UINT uHead = __atomic_load_n(&pHdr->uHead, __ATOMIC_ACQUIRE);
+
+    if(uHead == uTail)
+    {
+      if(__atomic_load_n(&pHdr->uClosed, __ATOMIC_ACQUIRE))
+      {
+        // anything written before it was closed?
+        if(__atomic_load_n(&pHdr->uHead, __ATOMIC_ACQUIRE) == uTail)
+          return(0);
+
+        continue;
+      }
+
+      if(!ShmRingWait(pR, &pHdr->uHead, uHead, &pHdr->uClosed, &pHdr->uDataSeq,
+                      &pHdr->uConsumerWaiting))
+      {
+        errno = EPIPE;
+        return(-1);
+      }
+
+      continue;
+    }
+
+    UINT cb1 = uHead - uTail < cbMax ? uHead - uTail : cbMax;
+    UINT cbPos = uTail & (pR->cbRing - 1);
+    UINT cb2 = cbPos + cb1 > pR->cbRing ? pR->cbRing - cbPos : cb1;
+
+    memcpy(pData, pR->pData + cbPos, cb2);
+
+    if(cb2 < cb1)  // wrapped around
+      memcpy(pData + cb2, pR->pData, cb1 - cb2);
+
+    __atomic_store_n(&pHdr->uTail, uTail + cb1, __ATOMIC_RELEASE);
+    ShmRingNotify(&pHdr->uSpaceSeq, &pHdr->uProducerWaiting, FALSE);
+
+    pR->lpfnCipher(pR->lpDict, pData, cb1, pR->pbSeed, sizeof(pR->pbSeed), TRUE, 0);
+
+    return((int)cb1);
+  }
+
+#else // __linux__
+
+  return(-1);
+
+#endif // __linux__
+}
+
+// unmap it.  The producer marks the ring as closed first (end of data)
+
+void ShmRingClose(SHM_RING *pR)
+{
+  if(!pR)
+    return;
+
+#ifdef __linux__
+
+  if(pR->bProducer)
+  {
+    __atomic_store_n(&pR->pHdr->uClosed, 1, __ATOMIC_RELEASE);
+    ShmRingNotify(&pR->pHdr->uDataSeq, &pR->pHdr->uConsumerWaiting, TRUE);
+  }
+
+  munmap(pR->pHdr, pR->cbMap);
+
+#endif // __linux__
+
+  memset(pR->pbSeed, 0, sizeof(pR->pbSeed));
+  delete pR;
+}
+
+// '--shm-send=NAME' and '--shm-recv=NAME' - the input file to the output
+// file of another sftcrypt (with the same key) via /dev/shm/NAME.  Either
+// one can start first; the receiver waits for the sender's ring to appear,
+// and removes it when it's done.  'NAME' is always a file in /dev/shm (the
+// caller has made sure it has no '/').
+
+static void ShmRingPath(LPCSTR szName, char *szPath, UINT cbPath)
+{
+  snprintf(szPath, cbPath, "/dev/shm/%s", szName);
+}
+
+int ShmSendStream(const BYTE *lpDict, FILE *pIN, LPCSTR szName,
+                  const BYTE *pbSeed, UINT cbKeySize, BOOL bStats)
+{
+  char szPath[1024];
+  BYTE cBuf[65536];
+  double dStart = GetElapsedSeconds(), dTotal = 0;
+  int iFile, iRval = 0;
+  SHM_RING *pR;
+
+  ShmRingPath(szName, szPath, sizeof(szPath));
+
+  iFile = ShmRingCreate(szPath, SHM_RING_SIZE);
+
+  if(iFile < 0 || !(pR = ShmRingOpen(iFile, TRUE, lpDict, pbSeed, cbKeySize,
+                                     lpfnEncryptDataStream)))
+  {
+    fprintf(stderr, "Unable to create shared memory ring '%s' (error %d)\n", szPath, errno);
+
+    if(iFile >= 0)
+    {
+      close(iFile);
+      unlink(szPath);
+    }
+
+    return(-1);
+  }
+
+  close(iFile);  // the mapping stays
+
+  while(!feof(pIN))
+  {
+    UINT cb1 = fread(cBuf, 1, sizeof(cBuf), pIN);
+
+    if(!cb1)
+      break;
+
+    if(ShmRingWrite(pR, cBuf, cb1))
+    {
+      fprintf(stderr, "The receiver of shared memory ring '%s' has gone away\n", szPath);
+      iRval = -1;
+      break;
+    }
+
+    dTotal += cb1;
+  }
+
+  ShmRingClose(pR);
+  memset(cBuf, 0, sizeof(cBuf));
+
+  if(iRval)
+    unlink(szPath);  // nobody else will
+
+  if(bStats)
+  {
+    dStart = GetElapsedSeconds() - dStart;
+
+    fprintf(stderr, "sent %.0f bytes in %.3f sec, %.2f MB/s\n",
+            dTotal, dStart, dStart > 0 ? dTotal / dStart / 1048576.0 : 0.0);
+  }
+
+  return(iRval);
+}
+
+int ShmRecvStream(const BYTE *lpDict, FILE *pOUT, LPCSTR szName,
+                  const BYTE *pbSeed, UINT cbKeySize, BOOL bStats)
+{
+  char szPath[1024];
+  BYTE cBuf[65536];
+  double dStart, dTotal = 0;
+  SHM_RING *pR = NULL;
+  int cb1, iRval = 0;
+
+  ShmRingPath(szName, szPath, sizeof(szPath));
+
+  while(!pR)  // wait for the sender
+  {
+    int iFile = open(szPath, O_RDWR);
+
+    if(iFile >= 0)
+    {
+      pR = ShmRingOpen(iFile, FALSE, lpDict, pbSeed, cbKeySize, lpfnEncryptDataStream);
+      close(iFile);
+    }
+    else if(errno != ENOENT)
+    {
+      fprintf(stderr, "Unable to open shared memory ring '%s' (error %d)\n", szPath, errno);
+      return(-1);
+    }
+
+    if(!pR)
+      usleep(10000);
+  }
+
+  dStart = GetElapsedSeconds();
+
+  while((cb1 = ShmRingRead(pR, cBuf, sizeof(cBuf))) > 0)
+  {
+    if(fwrite(cBuf, 1, cb1, pOUT) != (size_t)cb1)
+    {
+      fprintf(stderr, "Write error on output file\n");
+      iRval = 3;
+      break;
+    }
+
+    dTotal += cb1;
+  }
+
+  if(cb1 < 0)
+  {
+    fprintf(stderr, "The sender of shared memory ring '%s' has gone away\n", szPath);
+    iRval = -1;
+  }
+
+  ShmRingClose(pR);
+  unlink(szPath);
+  memset(cBuf, 0, sizeof(cBuf));
+
+  if(bStats)
+  {
+    dStart = GetElapsedSeconds() - dStart;
+
+    fprintf(stderr, "received %.0f bytes in %.3f sec, %.2f MB/s\n",
+            dTotal, dStart, dStart > 0 ? dTotal / dStart / 1048576.0 : 0.0);
+  }
+
+  return(iRval);
+}
+
+// '--shm-bench[=SIZE]' - a child process reads what its parent writes,
+// through a ring and then through a pipe (encrypted the same way) for
+// comparison.  First 'SIZE' byte messages one at a time (the child
+// acknowledges each one) for the one-way latency, stamped when they're
+// written and measured when the child has decrypted them, then 16Mb as
+// fast as it will go, 64k at a time.
+
+#define SHM_BENCH_MESSAGES 20000
+#define SHM_BENCH_BYTES    0x1000000 /* 16Mb */
+#define SHM_BENCH_WRITE    65536
+
+#ifdef __linux__
+
+// send or receive exactly 'cbData' bytes by ring or by pipe (with its own
+// seed, for the pipe).  returns non-zero on error
+
+static int ShmBenchSend(SHM_RING *pR, int iFile, const BYTE *lpDict, BYTE *pbSeed,
+                        LPBYTE pData, UINT cbData)
+{
+  if(pR)
+    return(ShmRingWrite(pR, pData, cbData));
+
+  lpfnEncryptDataStream(lpDict, pData, cbData, pbSeed, 16, FALSE, 0);
+
+  while(cbData)
+  {
+    ssize_t cb1 = write(iFile, pData, cbData);
+
+    if(cb1 <= 0)
+      return(-1);
+
+    pData += cb1;
+    cbData -= cb1;
+  }
+
+  return(0);
+}
+
+static int ShmBenchRecv(SHM_RING *pR, int iFile, const BYTE *lpDict, BYTE *pbSeed,
+                        LPBYTE pData, UINT cbData)
+{
+  UINT cb1 = 0;
+
+  while(cb1 < cbData)
+  {
+    ssize_t cb2 = pR ? ShmRingRead(pR, pData + cb1, cbData - cb1)
+                     : read(iFile, pData + cb1, cbData - cb1);
+
+    if(cb2 <= 0)
+      return(-1);
+
+    cb1 += cb2;
+  }
+
+  if(!pR)
+    lpfnEncryptDataStream(lpDict, pData, cbData, pbSeed, 16, TRUE, 0);
+
+  return(0);
+}
+
+#endif // __linux__
+
+int ShmBenchmark(const BYTE *lpDict, const BYTE *pbSeed0, UINT cbKeySize, UINT cbMsg)
+{
+#ifdef __linux__
+
+  static const LPCSTR aszWhat[2] = { "shm ring", "pipe    " };
+  LPBYTE pBuf = new BYTE[SHM_BENCH_WRITE];
+  int i1, iRval = 0;
+
+  if(!pBuf)
+    return(-1);
+
+  if(cbMsg < sizeof(double))
+    cbMsg = sizeof(double);
+  else if(cbMsg > SHM_BENCH_WRITE)
+    cbMsg = SHM_BENCH_WRITE;
+
+  for(i1=0; i1 < 2 && !iRval; i1++)
+  {
+    int aiData[2] = { -1, -1 }, aiAck[2];
+    int iRing = -1;
+    SHM_RING *pR = NULL;
+    BYTE pbSeed[16], bAck = 0;
+    pid_t pid;
+    UINT u1;
+
+    memcpy(pbSeed, pbSeed0, sizeof(pbSeed));
+
+    if(pipe(aiAck) || (i1 ? pipe(aiData) : (iRing = ShmRingCreate(NULL, SHM_RING_SIZE)) < 0))
+    {
+      fprintf(stderr, "%s:  unable to create it (error %d)\n", aszWhat[i1], errno);
+      iRval = -1;
+      break;
+    }
+
+    fflush(stderr);
+    pid = fork();
+
+    if(pid < 0)
+    {
+      fprintf(stderr, "unable to start a process (error %d)\n", errno);
+      iRval = -1;
+      break;
+    }
+
+    if(!pid)  // the consumer
+    {
+      double *pdSamples = new double[SHM_BENCH_MESSAGES], dStart = 0;
+
+      close(aiAck[0]);
+
+      if(i1)
+        close(aiData[1]);
+      else
+        pR = ShmRingOpen(iRing, FALSE, lpDict, pbSeed0, cbKeySize, lpfnEncryptDataStream);
+
+      if((!i1 && !pR) || !pdSamples)
+        _exit(1);
+
+      for(u1=0; u1 < SHM_BENCH_MESSAGES; u1++)
+      {
+        double dSent;
+
+        if(ShmBenchRecv(pR, aiData[0], lpDict, pbSeed, pBuf, cbMsg))
+          _exit(1);
+
+        memcpy(&dSent, pBuf, sizeof(dSent));
+        pdSamples[u1] = GetElapsedSeconds() - dSent;
+
+        if(write(aiAck[1], &bAck, 1) != 1)
+          _exit(1);
+      }
+
+      ReportLatencyStats(aszWhat[i1], pdSamples, SHM_BENCH_MESSAGES);
+
+      for(u1=0; u1 < SHM_BENCH_BYTES; u1 += SHM_BENCH_WRITE)
+      {
+        if(ShmBenchRecv(pR, aiData[0], lpDict, pbSeed, pBuf, SHM_BENCH_WRITE))
+          _exit(1);
+
+        if(!u1)
+          dStart = GetElapsedSeconds();
+      }
+
+      dStart = GetElapsedSeconds() - dStart;
+
+      fprintf(stderr, "%s throughput:  %.2f MB/s (%u byte messages)\n", aszWhat[i1],
+              (SHM_BENCH_BYTES - SHM_BENCH_WRITE) / dStart / 1048576.0, SHM_BENCH_WRITE);
+
+      ShmRingClose(pR);
+      _exit(0);
+    }
+
+    // the producer
+
+    close(aiAck[1]);
+
+    if(i1)
+      close(aiData[0]);
+    else
+      pR = ShmRingOpen(iRing, TRUE, lpDict, pbSeed0, cbKeySize, lpfnEncryptDataStream);
+
+    for(u1=0; u1 < SHM_BENCH_WRITE; u1++)
+      pBuf[u1] = (BYTE)u1;
+
+    if(!i1 && !pR)
+      iRval = -1;
+
+    for(u1=0; !iRval && u1 < SHM_BENCH_MESSAGES; u1++)
+    {
+      double dNow = GetElapsedSeconds();
+
+      memcpy(pBuf, &dNow, sizeof(dNow));
+
+      if(ShmBenchSend(pR, aiData[1], lpDict, pbSeed, pBuf, cbMsg) ||
+         read(aiAck[0], &bAck, 1) != 1)
+      {
+        iRval = -1;
+        break;
+      }
+    }
+
+    for(u1=0; !iRval && u1 < SHM_BENCH_BYTES; u1 += SHM_BENCH_WRITE)
+    {
+      if(ShmBenchSend(pR, aiData[1], lpDict, pbSeed, pBuf, SHM_BENCH_WRITE))
+        iRval = -1;
+    }
+
+    ShmRingClose(pR);
+
+    if(iRing >= 0)
+      close(iRing);
+
+    if(i1)
+      close(aiData[1]);
+
+    close(aiAck[0]);
+
+    int iStatus = 0;
+
+    if(iRval)
+      kill(pid, SIGTERM);
+
+    waitpid(pid, &iStatus, 0);
+
+    if(iRval || !WIFEXITED(iStatus) || WEXITSTATUS(iStatus))
+    {
+      fprintf(stderr, "%s:  benchmark FAILED\n", aszWhat[i1]);
+      iRval = 1;
+    }
+  }
+
+  delete[] pBuf;
+
+  return(iRval);
+
+#else // __linux__
+
+  fprintf(stderr, "'--shm-bench' is not supported on this platform\n");
+  return(2);
+
+#endif // __linux__
+}